@@ -24,6 +24,7 @@
 #include "via_3d.h"
 #include "via_3d_reg.h"
 #include <picturestr.h>
+#include <string.h>
 
 typedef struct
 {
@@ -43,12 +44,22 @@ typedef struct
     CARD32 texFormat;
 } Via3DFormat;
 
+typedef union
+{
+    float f;
+    CARD32 u;
+} ViaVertexWord;
+
 static ViaCompositeOperator viaOperatorModes[256];
+static ViaCompositeOperator viaOperatorModesCA[256];
 static Via3DFormat via3DFormats[256];
 
 #define VIA_NUM_3D_OPCODES 19
+#define VIA_NUM_3D_OPCODES_CA 5
 #define VIA_NUM_3D_FORMATS 15
 #define VIA_FMT_HASH(arg) (((((arg) >> 1) + (arg)) >> 8) & 0xFF)
+#define VIA_MAX_VERTEX_SIZE (3 + 2 * VIA_NUM_TEXUNITS)
+#define VIA_SUBA(reg, val) (((reg) << HC_SubA_SHIFT) | ((val) & HC_Para_MASK))
 
 static const CARD32 viaOpCodes[VIA_NUM_3D_OPCODES][5] = {
     {PictOpClear, 0x05, 0x45, 0x40, 0x80},
@@ -72,6 +83,20 @@ static const CARD32 viaOpCodes[VIA_NUM_3D_OPCODES][5] = {
     {PictOpConjointDst, 0x05, 0x55, 0x40, 0x90}
 };
 
+/*
+ * Operators that work with a component alpha mask. The texture stages then
+ * produce a color per component, which OutReverse uses as the source
+ * factor instead of the source alpha. Over is done by EXA as OutReverse
+ * followed by Add.
+ */
+static const CARD32 viaOpCodesCA[VIA_NUM_3D_OPCODES_CA][5] = {
+    {PictOpClear, 0x05, 0x45, 0x40, 0x80},
+    {PictOpSrc, 0x15, 0x45, 0x50, 0x80},
+    {PictOpDst, 0x05, 0x55, 0x40, 0x90},
+    {PictOpOutReverse, 0x05, 0x50, 0x40, 0x91},
+    {PictOpAdd, 0x15, 0x55, 0x50, 0x90}
+};
+
 static const CARD32 viaFormats[VIA_NUM_3D_FORMATS][5] = {
     {PICT_x1r5g5b5, HC_HDBFM_RGB555, HC_HTXnFM_RGB555, 1, 1},
     {PICT_r5g6b5, HC_HDBFM_RGB565, HC_HTXnFM_RGB565, 1, 1},
@@ -122,14 +147,24 @@ via3DTexSupported(int format)
     return fm->texSupported;
 }
 
+/*
+ * The setters below only mark state dirty when it actually changes, so that
+ * back to back composites with the same setup don't upload anything.
+ */
 static void
 viaSet3DDestination(Via3DState * v3d, CARD32 offset, CARD32 pitch, int format)
 {
+    CARD32 destFormat = via3DDstFormat(format);
+
+    if (offset == v3d->destOffset && pitch == v3d->destPitch &&
+        destFormat == v3d->destFormat)
+        return;
+
     v3d->drawingDirty = TRUE;  /* Affects planemask format. */
     v3d->destDirty = TRUE;
     v3d->destOffset = offset;
     v3d->destPitch = pitch;
-    v3d->destFormat = via3DDstFormat(format);
+    v3d->destFormat = destFormat;
     v3d->destDepth = (v3d->destFormat < HC_HDBFM_ARGB0888) ? 16 : 32;
 }
 
@@ -137,6 +172,10 @@ static void
 viaSet3DDrawing(Via3DState * v3d, int rop,
                 CARD32 planeMask, CARD32 solidColor, CARD32 solidAlpha)
 {
+    if (rop == v3d->rop && planeMask == v3d->planeMask &&
+        solidColor == v3d->solidColor && solidAlpha == v3d->solidAlpha)
+        return;
+
     v3d->drawingDirty = TRUE;
     v3d->rop = rop;
     v3d->planeMask = planeMask;
@@ -148,14 +187,27 @@ static void
 viaSet3DFlags(Via3DState * v3d, int numTextures,
               Bool writeAlpha, Bool writeColor, Bool blend)
 {
+    if (numTextures == v3d->numTextures && writeAlpha == v3d->writeAlpha &&
+        writeColor == v3d->writeColor && blend == v3d->blend)
+        return;
+
     v3d->enableDirty = TRUE;
-    v3d->blendDirty = TRUE;
     v3d->numTextures = numTextures;
     v3d->writeAlpha = writeAlpha;
     v3d->writeColor = writeColor;
     v3d->blend = blend;
 }
 
+static void
+viaSet3DDither(Via3DState * v3d, Bool dither)
+{
+    if (dither == v3d->dither)
+        return;
+
+    v3d->enableDirty = TRUE;
+    v3d->dither = dither;
+}
+
 static Bool
 viaOrder(CARD32 val, CARD32 * shift)
 {
@@ -166,6 +218,44 @@ viaOrder(CARD32 val, CARD32 * shift)
     return (val == (1 << *shift));
 }
 
+/*
+ * Encode the register writes of a texture unit, as sent by via3DEmitState.
+ */
+static void
+via3DEncodeTexture(ViaTextureUnit * vTex)
+{
+    CARD32 *p = vTex->texPacket;
+
+    *p++ = VIA_SUBA(HC_SubA_HTXnFM, vTex->textureFormat |
+                    (vTex->agpTexture ? HC_HTXnLoc_AGP : HC_HTXnLoc_Local));
+    *p++ = VIA_SUBA(HC_SubA_HTXnL0BasL,
+                    vTex->textureLevel0Offset & 0x00FFFFFF);
+    *p++ = VIA_SUBA(HC_SubA_HTXnL012BasH, vTex->textureLevel0Offset >> 24);
+    if (vTex->npot) {
+        *p++ = VIA_SUBA(HC_SubA_HTXnL0Pit,
+                        (vTex->textureLevel0Pitch & HC_HTXnLnPit_MASK) |
+                        HC_HTXnEnPit_MASK);
+    } else {
+        *p++ = VIA_SUBA(HC_SubA_HTXnL0Pit,
+                        vTex->textureLevel0Exp << HC_HTXnLnPitE_SHIFT);
+    }
+    *p++ = VIA_SUBA(HC_SubA_HTXnL0_5WE, vTex->textureLevel0WExp);
+    *p++ = VIA_SUBA(HC_SubA_HTXnL0_5HE, vTex->textureLevel0HExp);
+    *p++ = VIA_SUBA(HC_SubA_HTXnL0OS, 0x00);
+    *p++ = VIA_SUBA(HC_SubA_HTXnTB, (vTex->bilinear) ?
+                    (HC_HTXnFLSe_Linear | HC_HTXnFLSs_Linear |
+                     HC_HTXnFLTe_Linear | HC_HTXnFLTs_Linear) : 0x00);
+    *p++ = VIA_SUBA(HC_SubA_HTXnMPMD,
+                    ((((unsigned)vTex->textureModesT) << 19)
+                     | (((unsigned)vTex->textureModesS) << 16)));
+    *p++ = VIA_SUBA(HC_SubA_HTXnTBLCsat, vTex->texCsat);
+    *p++ = VIA_SUBA(HC_SubA_HTXnTBLCop, (0x00 << 22) | (0x00 << 19) |
+                    (0x00 << 14) | (0x02 << 11) |
+                    (0x00 << 7) | (0x03 << 3) | 0x02);
+    *p++ = VIA_SUBA(HC_SubA_HTXnTBLAsat, vTex->texAsat);
+    *p++ = VIA_SUBA(HC_SubA_HTXnTBLRFog, 0x00);
+}
+
 static Bool
 viaSet3DTexture(Via3DState * v3d, int tex, CARD32 offset,
                 CARD32 pitch, Bool npot, CARD32 width, CARD32 height,
@@ -196,9 +286,20 @@ viaSet3DTexture(Via3DState * v3d, int tex, CARD32 offset,
             vTex->texAsat = ((0x0B << 14)
                              | ((PICT_FORMAT_A(format) ? 0x04 : 0x02) << 7)
                              | 0x03);
+            if (vTex->texRCa || vTex->texRAa)
+                vTex->texBColDirty = TRUE;
+            vTex->texRCa = 0x00000000;
+            vTex->texRAa = 0x00000000;
+            break;
+        case via_src_alpha:
+            vTex->texCsat = (0x01 << 23) | (0x10 << 14) | (0x07 << 7) | 0x00;
+            vTex->texAsat = ((0x0B << 14)
+                             | ((PICT_FORMAT_A(format) ? 0x04 : 0x02) << 7)
+                             | 0x03);
+            if (vTex->texRCa || vTex->texRAa)
+                vTex->texBColDirty = TRUE;
             vTex->texRCa = 0x00000000;
             vTex->texRAa = 0x00000000;
-            vTex->texBColDirty = TRUE;
             break;
         case via_src_onepix_mask:
             vTex->texCsat = (0x01 << 23) | (0x09 << 14) | (0x03 << 7) | 0x00;
@@ -220,31 +321,81 @@ viaSet3DTexture(Via3DState * v3d, int tex, CARD32 offset,
             vTex->texCsat = (0x01 << 23) | (0x03 << 14) | (0x04 << 7) | 0x00;
             vTex->texAsat = (0x01 << 23) | (0x04 << 14) | (0x02 << 7) | 0x03;
             break;
+        case via_src_onepix_comp_mask_alpha:
+            vTex->texCsat = (0x01 << 23) | (0x09 << 14) | (0x07 << 7) | 0x00;
+            vTex->texAsat = ((0x03 << 14)
+                             | ((PICT_FORMAT_A(format) ? 0x04 : 0x02) << 7)
+                             | 0x03);
+            break;
+        case via_comp_mask_alpha:
+            vTex->texCsat = (0x01 << 23) | (0x03 << 14) | (0x08 << 7) | 0x00;
+            vTex->texAsat = (0x01 << 23) | (0x04 << 14) | (0x02 << 7) | 0x03;
+            break;
         default:
             return FALSE;
     }
 
     vTex->textureDirty = TRUE;
+    vTex->bilinear = FALSE;
+    vTex->transformed = FALSE;
     vTex->textureModesS = sMode - via_single;
     vTex->textureModesT = tMode - via_single;
 
     vTex->agpTexture = agpTexture;
+    vTex->scaleX = 1.f / (float)(1 << vTex->textureLevel0WExp);
+    vTex->scaleY = 1.f / (float)(1 << vTex->textureLevel0HExp);
+    via3DEncodeTexture(vTex);
     return TRUE;
 }
 
+/*
+ * Use bilinear instead of nearest texel filtering. Must be called after
+ * setTexture, which resets the filter.
+ */
+static void
+viaSet3DTexFilter(Via3DState * v3d, int tex, Bool bilinear)
+{
+    ViaTextureUnit *vTex = v3d->tex + tex;
+
+    vTex->bilinear = bilinear;
+    vTex->textureDirty = TRUE;
+    via3DEncodeTexture(vTex);
+}
+
+/*
+ * Transform the texel coordinates of a texture unit, as given to emitQuad,
+ * by the affine matrix { a, b, c, d, e, f }: x' = a x + b y + c,
+ * y' = d x + e y + f. NULL switches back to the identity. Must be called
+ * after setTexture, which resets the transform.
+ */
+static void
+viaSet3DTexTransform(Via3DState * v3d, int tex, const float *transform)
+{
+    ViaTextureUnit *vTex = v3d->tex + tex;
+
+    vTex->transformed = (transform != NULL);
+    if (transform)
+        memcpy(vTex->transform, transform, sizeof(vTex->transform));
+}
+
 static void
 viaSet3DTexBlendCol(Via3DState * v3d, int tex, Bool component, CARD32 color)
 {
-    CARD32 alpha;
+    CARD32 alpha, texRAa, texRCa;
     ViaTextureUnit *vTex = v3d->tex + tex;
 
-    vTex->texRAa = (color >> 8) & 0x00FF0000;
+    texRAa = (color >> 8) & 0x00FF0000;
     if (component) {
-        vTex->texRCa = (color & 0x00FFFFFF);
+        texRCa = (color & 0x00FFFFFF);
     } else {
         alpha = color >> 24;
-        vTex->texRCa = alpha | (alpha << 8) | (alpha << 16) | (alpha << 24);
+        texRCa = alpha | (alpha << 8) | (alpha << 16) | (alpha << 24);
     }
+    if (texRAa == vTex->texRAa && texRCa == vTex->texRCa)
+        return;
+
+    vTex->texRAa = texRAa;
+    vTex->texRCa = texRCa;
     vTex->texBColDirty = TRUE;
 }
 
@@ -253,21 +404,23 @@ viaSet3DTexBlendCol(Via3DState * v3d, int tex, Bool component, CARD32 color)
  * return the corresponding register setting.
  */
 static void
-viaSet3DCompositeOperator(Via3DState * v3d, CARD8 op)
+viaSet3DCompositeOperator(Via3DState * v3d, CARD8 op, Bool componentAlpha)
 {
-    ViaCompositeOperator *vOp = viaOperatorModes + op;
+    ViaCompositeOperator *vOp = ((componentAlpha) ? viaOperatorModesCA :
+                                 viaOperatorModes) + op;
 
-    if (v3d)
-        v3d->blendDirty = TRUE;
-    else
+    if (!v3d || !vOp->supported)
         return;
 
-    if (vOp->supported) {
-        v3d->blendCol0 = vOp->col0 << 4;
-        v3d->blendCol1 = vOp->col1 << 2;
-        v3d->blendAl0 = vOp->al0 << 4;
-        v3d->blendAl1 = vOp->al1 << 2;
-    }
+    if (v3d->blendCol0 == vOp->col0 << 4 && v3d->blendCol1 == vOp->col1 << 2 &&
+        v3d->blendAl0 == vOp->al0 << 4 && v3d->blendAl1 == vOp->al1 << 2)
+        return;
+
+    v3d->blendDirty = TRUE;
+    v3d->blendCol0 = vOp->col0 << 4;
+    v3d->blendCol1 = vOp->col1 << 2;
+    v3d->blendAl0 = vOp->al0 << 4;
+    v3d->blendAl1 = vOp->al1 << 2;
 }
 
 static Bool
@@ -276,111 +429,224 @@ via3DOpSupported(CARD8 op)
     return viaOperatorModes[op].supported;
 }
 
+static Bool
+via3DOpSupportedCA(CARD8 op)
+{
+    return viaOperatorModesCA[op].supported;
+}
+
+/*
+ * Close the vertex data block of the queued quads and submit it.
+ */
 static void
-via3DEmitQuad(Via3DState * v3d, ViaCommandBuffer * cb, int dstX, int dstY,
-              int src0X, int src0Y, int src1X, int src1Y, int w, int h)
+via3DFlushQuads(Via3DState * v3d, ViaCommandBuffer * cb)
 {
+    if (!v3d->quadsOpen)
+        return;
+
+    v3d->quadsOpen = FALSE;
+    OUT_RING_SubA(0xEE, v3d->quadsCmd | HC_HPLEND_MASK |
+                  HC_HPMValidN_MASK | HC_HE3Fire_MASK);
+    OUT_RING_SubA(0xEE, v3d->quadsCmd | HC_HPLEND_MASK |
+                  HC_HPMValidN_MASK | HC_HE3Fire_MASK);
+
+    ADVANCE_RING;
+}
+
+/*
+ * Texture coordinates of the four quad corners for a transformed texture.
+ * An affine transform is exact when interpolated across the triangles.
+ */
+static void
+via3DTransformCorners(ViaTextureUnit * vTex,
+                      ViaVertexWord corner[4][VIA_MAX_VERTEX_SIZE], int pos,
+                      float sx1, float sy1, float sx2, float sy2)
+{
+    const float *m = vTex->transform;
+    float x[4], y[4];
+    int j;
+
+    x[0] = x[2] = sx1;
+    x[1] = x[3] = sx2;
+    y[0] = y[1] = sy1;
+    y[2] = y[3] = sy2;
+
+    for (j = 0; j < 4; ++j) {
+        corner[j][pos].f = (m[0] * x[j] + m[1] * y[j] + m[2]) * vTex->scaleX;
+        corner[j][pos + 1].f = (m[3] * x[j] + m[4] * y[j] + m[5]) *
+                               vTex->scaleY;
+    }
+}
+
+/*
+ * Queue a quad as two 3-point triangles. Consecutive quads go into the same
+ * vertex data block as one triangle list, which is only closed by
+ * via3DFlushQuads. Emitting state flushes the queued quads; other users of
+ * the command buffer must call flushQuads first. Texture coordinates are
+ * given in texels and normalized here.
+ *
+ * The four corners are encoded once and then copied into the command
+ * buffer in triangle order, which also avoids type punning each float.
+ */
+static void
+via3DEmitVertices(Via3DState * v3d, ViaCommandBuffer * cb,
+                  float dx1, float dy1, float dx2, float dy2,
+                  const float *sx1, const float *sy1,
+                  const float *sx2, const float *sy2)
+{
+    ViaVertexWord corner[4][VIA_MAX_VERTEX_SIZE];
     CARD32 acmd;
-    float dx1, dx2, dy1, dy2, sx1[2], sx2[2], sy1[2], sy2[2], wf;
-    double scalex, scaley;
-    int i, numTex;
+    int i, numTex, size, vSize;
     ViaTextureUnit *vTex;
+    CARD32 *p;
 
     numTex = v3d->numTextures;
-    dx1 = dstX;
-    dx2 = dstX + w;
-    dy1 = dstY;
-    dy2 = dstY + h;
-
-    if (numTex) {
-        sx1[0] = src0X;
-        sx1[1] = src1X;
-        sy1[0] = src0Y;
-        sy1[1] = src1Y;
-        for (i = 0; i < numTex; ++i) {
-            vTex = v3d->tex + i;
-            scalex = 1. / (double)((1 << vTex->textureLevel0WExp));
-            scaley = 1. / (double)((1 << vTex->textureLevel0HExp));
-            sx2[i] = sx1[i] + w;
-            sy2[i] = sy1[i] + h;
-            sx1[i] *= scalex;
-            sy1[i] *= scaley;
-            sx2[i] *= scalex;
-            sy2[i] *= scaley;
+    vSize = 3 + 2 * numTex;
+
+    /*
+     * Corners top left, top right, bottom left and bottom right. The W
+     * coordinate goes after x and y.
+     */
+    corner[0][0].f = corner[2][0].f = dx1;
+    corner[1][0].f = corner[3][0].f = dx2;
+    corner[0][1].f = corner[1][1].f = dy1;
+    corner[2][1].f = corner[3][1].f = dy2;
+    corner[0][2].f = corner[1][2].f = corner[2][2].f = corner[3][2].f = 0.05f;
+    for (i = 0; i < numTex; ++i) {
+        vTex = v3d->tex + i;
+        if (vTex->transformed) {
+            via3DTransformCorners(vTex, corner, 3 + 2 * i,
+                                  sx1[i], sy1[i], sx2[i], sy2[i]);
+            continue;
         }
+        corner[0][3 + 2 * i].f = corner[2][3 + 2 * i].f =
+            sx1[i] * vTex->scaleX;
+        corner[1][3 + 2 * i].f = corner[3][3 + 2 * i].f =
+            sx2[i] * vTex->scaleX;
+        corner[0][4 + 2 * i].f = corner[1][4 + 2 * i].f =
+            sy1[i] * vTex->scaleY;
+        corner[2][4 + 2 * i].f = corner[3][4 + 2 * i].f =
+            sy2[i] * vTex->scaleY;
     }
 
-    wf = 0.05;
-
     /*
-     * Vertex buffer. Emit two 3-point triangles. The W or Z coordinate
-     * is needed for AGP DMA, and the W coordinate is for some obscure
-     * reason needed for texture mapping to be done correctly. So emit
-     * a w value after the x and y coordinates.
+     * Keep room for closing the block, and for the padding added when
+     * flushing.
      */
+    size = 6 * vSize;
+    if (v3d->quadsOpen &&
+        ((v3d->quadsNumTex != numTex) ||
+         (cb->pos + size + 8 > cb->bufSize)))
+        via3DFlushQuads(v3d, cb);
 
-    BEGIN_H2(HC_ParaType_CmdVdata, 22 + numTex * 6);
-    acmd = ((1 << 14) | (1 << 13) | (1 << 11));
-    if (numTex)
-        acmd |= ((1 << 7) | (1 << 8));
-    OUT_RING_SubA(0xEC, acmd);
+    if (!v3d->quadsOpen) {
 
-    acmd = 2 << 16;
-    OUT_RING_SubA(0xEE, acmd);
+        /*
+         * Vertex buffer. The W or Z coordinate is needed for AGP DMA, and
+         * the W coordinate is for some obscure reason needed for texture
+         * mapping to be done correctly.
+         */
 
-    OUT_RING(*((CARD32 *) (&dx1)));
-    OUT_RING(*((CARD32 *) (&dy1)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx1 + i)));
-        OUT_RING(*((CARD32 *) (sy1 + i)));
-    }
+        BEGIN_H2(HC_ParaType_CmdVdata, size + 4);
+        acmd = ((1 << 14) | (1 << 13) | (1 << 11));
+        if (numTex)
+            acmd |= ((1 << 7) | (1 << 8));
+        OUT_RING_SubA(0xEC, acmd);
 
-    OUT_RING(*((CARD32 *) (&dx2)));
-    OUT_RING(*((CARD32 *) (&dy1)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx2 + i)));
-        OUT_RING(*((CARD32 *) (sy1 + i)));
-    }
+        acmd = 2 << 16;
+        OUT_RING_SubA(0xEE, acmd);
 
-    OUT_RING(*((CARD32 *) (&dx1)));
-    OUT_RING(*((CARD32 *) (&dy2)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx1 + i)));
-        OUT_RING(*((CARD32 *) (sy2 + i)));
+        v3d->quadsOpen = TRUE;
+        v3d->quadsNumTex = numTex;
+        v3d->quadsCmd = acmd;
     }
 
-    OUT_RING(*((CARD32 *) (&dx1)));
-    OUT_RING(*((CARD32 *) (&dy2)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx1 + i)));
-        OUT_RING(*((CARD32 *) (sy2 + i)));
-    }
+    p = cb->buf + cb->pos;
+    memcpy(p, corner[0], vSize * sizeof(CARD32));
+    p += vSize;
+    memcpy(p, corner[1], vSize * sizeof(CARD32));
+    p += vSize;
+    memcpy(p, corner[2], vSize * sizeof(CARD32));
+    p += vSize;
+    memcpy(p, corner[2], vSize * sizeof(CARD32));
+    p += vSize;
+    memcpy(p, corner[1], vSize * sizeof(CARD32));
+    p += vSize;
+    memcpy(p, corner[3], vSize * sizeof(CARD32));
+    cb->pos += size;
+}
 
-    OUT_RING(*((CARD32 *) (&dx2)));
-    OUT_RING(*((CARD32 *) (&dy1)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx2 + i)));
-        OUT_RING(*((CARD32 *) (sy1 + i)));
+static void
+via3DEmitQuad(Via3DState * v3d, ViaCommandBuffer * cb, int dstX, int dstY,
+              int src0X, int src0Y, int src1X, int src1Y, int w, int h)
+{
+    float sx1[2], sx2[2], sy1[2], sy2[2];
+    int i;
+
+    sx1[0] = src0X;
+    sx1[1] = src1X;
+    sy1[0] = src0Y;
+    sy1[1] = src1Y;
+    for (i = 0; i < 2; ++i) {
+        sx2[i] = sx1[i] + w;
+        sy2[i] = sy1[i] + h;
     }
 
-    OUT_RING(*((CARD32 *) (&dx2)));
-    OUT_RING(*((CARD32 *) (&dy2)));
-    OUT_RING(*((CARD32 *) (&wf)));
-    for (i = 0; i < numTex; ++i) {
-        OUT_RING(*((CARD32 *) (sx2 + i)));
-        OUT_RING(*((CARD32 *) (sy2 + i)));
+    via3DEmitVertices(v3d, cb, dstX, dstY, dstX + w, dstY + h,
+                      sx1, sy1, sx2, sy2);
+}
+
+/*
+ * Like via3DEmitQuad, but maps the source rectangle onto a destination
+ * rectangle of a different size. All texture units use the same source
+ * coordinates.
+ */
+static void
+via3DEmitQuadScaled(Via3DState * v3d, ViaCommandBuffer * cb,
+                    int dstX, int dstY, int dstW, int dstH,
+                    float srcX, float srcY, float srcW, float srcH)
+{
+    float sx1[2], sx2[2], sy1[2], sy2[2];
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        sx1[i] = srcX;
+        sy1[i] = srcY;
+        sx2[i] = srcX + srcW;
+        sy2[i] = srcY + srcH;
     }
-    OUT_RING_SubA(0xEE,
-                  acmd | HC_HPLEND_MASK | HC_HPMValidN_MASK | HC_HE3Fire_MASK);
-    OUT_RING_SubA(0xEE,
-                  acmd | HC_HPLEND_MASK | HC_HPMValidN_MASK | HC_HE3Fire_MASK);
 
-    ADVANCE_RING;
+    via3DEmitVertices(v3d, cb, dstX, dstY, dstX + dstW, dstY + dstH,
+                      sx1, sy1, sx2, sy2);
+}
+
+/*
+ * Whether via3DEmitState has anything to send. A texture unit that was set
+ * up again exactly as the engine already has it doesn't count.
+ */
+static Bool
+via3DStateDirty(Via3DState * v3d)
+{
+    ViaTextureUnit *vTex;
+    int i;
+
+    if (v3d->destDirty || v3d->blendDirty || v3d->drawingDirty ||
+        v3d->enableDirty)
+        return TRUE;
+
+    for (i = 0; i < v3d->numTextures; ++i) {
+        vTex = v3d->tex + i;
+
+        if (vTex->texBColDirty)
+            return TRUE;
+        if (vTex->textureDirty) {
+            if (memcmp(vTex->texPacket, vTex->texEmitted,
+                       sizeof(vTex->texPacket)))
+                return TRUE;
+            vTex->textureDirty = FALSE;
+        }
+    }
+    return FALSE;
 }
 
 static void
@@ -390,6 +656,12 @@ via3DEmitState(Via3DState * v3d, ViaCommandBuffer * cb, Bool forceUpload)
     Bool saveHas3dState;
     ViaTextureUnit *vTex;
 
+    /* Unchanged state doesn't even close the pending quads. */
+    if (!forceUpload && !via3DStateDirty(v3d))
+        return;
+
+    via3DFlushQuads(v3d, cb);
+
     /*
      * Destination buffer location, format and pitch.
      */
@@ -457,7 +729,8 @@ via3DEmitState(Via3DState * v3d, ViaCommandBuffer * cb, Bool forceUpload)
                       ((v3d->writeColor) ? HC_HenCW_MASK : 0) |
                       ((v3d->blend) ? HC_HenABL_MASK : 0) |
                       ((v3d->numTextures) ? HC_HenTXMP_MASK : 0) |
-                      ((v3d->writeAlpha) ? HC_HenAW_MASK : 0));
+                      ((v3d->writeAlpha) ? HC_HenAW_MASK : 0) |
+                      ((v3d->dither) ? HC_HenDT_MASK : 0));
 
         if (v3d->numTextures) {
             BEGIN_H2((HC_ParaType_Tex | (HC_SubType_TexGeneral << 8)), 2);
@@ -471,44 +744,19 @@ via3DEmitState(Via3DState * v3d, ViaCommandBuffer * cb, Bool forceUpload)
     for (i = 0; i < v3d->numTextures; ++i) {
         vTex = v3d->tex + i;
 
-        if (forceUpload || vTex->textureDirty) {
-            vTex->textureDirty = FALSE;
-
+        if (forceUpload || (vTex->textureDirty &&
+                            memcmp(vTex->texPacket, vTex->texEmitted,
+                                   sizeof(vTex->texPacket)))) {
             BEGIN_H2((HC_ParaType_Tex |
                       (((i == 0) ? HC_SubType_Tex0 : HC_SubType_Tex1) << 8)),
-                     13);
-
-            OUT_RING_SubA(HC_SubA_HTXnFM, (vTex->textureFormat |
-                                           (vTex->
-                                            agpTexture ? HC_HTXnLoc_AGP :
-                                            HC_HTXnLoc_Local)));
-            OUT_RING_SubA(HC_SubA_HTXnL0BasL,
-                          vTex->textureLevel0Offset & 0x00FFFFFF);
-            OUT_RING_SubA(HC_SubA_HTXnL012BasH,
-                          vTex->textureLevel0Offset >> 24);
-            if (vTex->npot) {
-                OUT_RING_SubA(HC_SubA_HTXnL0Pit,
-                              (vTex->textureLevel0Pitch & HC_HTXnLnPit_MASK) |
-                              HC_HTXnEnPit_MASK);
-            } else {
-                OUT_RING_SubA(HC_SubA_HTXnL0Pit,
-                              vTex->textureLevel0Exp << HC_HTXnLnPitE_SHIFT);
-            }
-            OUT_RING_SubA(HC_SubA_HTXnL0_5WE, vTex->textureLevel0WExp);
-            OUT_RING_SubA(HC_SubA_HTXnL0_5HE, vTex->textureLevel0HExp);
-            OUT_RING_SubA(HC_SubA_HTXnL0OS, 0x00);
-            OUT_RING_SubA(HC_SubA_HTXnTB, 0x00);
-            OUT_RING_SubA(HC_SubA_HTXnMPMD,
-                          ((((unsigned)vTex->textureModesT) << 19)
-                           | (((unsigned)vTex->textureModesS) << 16)));
-
-            OUT_RING_SubA(HC_SubA_HTXnTBLCsat, vTex->texCsat);
-            OUT_RING_SubA(HC_SubA_HTXnTBLCop, (0x00 << 22) | (0x00 << 19) |
-                          (0x00 << 14) | (0x02 << 11) |
-                          (0x00 << 7) | (0x03 << 3) | 0x02);
-            OUT_RING_SubA(HC_SubA_HTXnTBLAsat, vTex->texAsat);
-            OUT_RING_SubA(HC_SubA_HTXnTBLRFog, 0x00);
+                     VIA_TEX_PACKET_SIZE);
+            memcpy(cb->buf + cb->pos, vTex->texPacket,
+                   sizeof(vTex->texPacket));
+            cb->pos += VIA_TEX_PACKET_SIZE;
+            memcpy(vTex->texEmitted, vTex->texPacket,
+                   sizeof(vTex->texPacket));
         }
+        vTex->textureDirty = FALSE;
     }
 
     for (i = 0; i < v3d->numTextures; ++i) {
@@ -537,6 +785,8 @@ via3DEmitClipRect(Via3DState * v3d, ViaCommandBuffer * cb, int x, int y,
 {
     Bool saveHas3dState;
 
+    via3DFlushQuads(v3d, cb);
+
     saveHas3dState = cb->has3dState;
     BEGIN_H2(HC_ParaType_NotTex, 4);
     OUT_RING_SubA(HC_SubA_HClipTB, (y << 12) | (y + h));
@@ -552,14 +802,21 @@ viaInit3DState(Via3DState * v3d)
     CARD32 tmp, hash;
     Via3DFormat *format;
 
+    v3d->quadsOpen = FALSE;
     v3d->setDestination = viaSet3DDestination;
     v3d->setDrawing = viaSet3DDrawing;
     v3d->setFlags = viaSet3DFlags;
+    v3d->setDither = viaSet3DDither;
     v3d->setTexture = viaSet3DTexture;
+    v3d->setTexFilter = viaSet3DTexFilter;
+    v3d->setTexTransform = viaSet3DTexTransform;
     v3d->setTexBlendCol = viaSet3DTexBlendCol;
     v3d->opSupported = via3DOpSupported;
+    v3d->opSupportedCA = via3DOpSupportedCA;
     v3d->setCompositeOperator = viaSet3DCompositeOperator;
     v3d->emitQuad = via3DEmitQuad;
+    v3d->emitQuadScaled = via3DEmitQuadScaled;
+    v3d->flushQuads = via3DFlushQuads;
     v3d->emitState = via3DEmitState;
     v3d->emitClipRect = via3DEmitClipRect;
     v3d->dstSupported = via3DDstSupported;
@@ -567,6 +824,7 @@ viaInit3DState(Via3DState * v3d)
 
     for (i = 0; i < 256; ++i) {
         viaOperatorModes[i].supported = FALSE;
+        viaOperatorModesCA[i].supported = FALSE;
     }
 
     for (i = 0; i < VIA_NUM_3D_OPCODES; ++i) {
@@ -578,6 +836,15 @@ viaInit3DState(Via3DState * v3d)
         op->al1 = viaOpCodes[i][4];
     }
 
+    for (i = 0; i < VIA_NUM_3D_OPCODES_CA; ++i) {
+        op = viaOperatorModesCA + viaOpCodesCA[i][0];
+        op->supported = TRUE;
+        op->col0 = viaOpCodesCA[i][1];
+        op->col1 = viaOpCodesCA[i][2];
+        op->al0 = viaOpCodesCA[i][3];
+        op->al1 = viaOpCodesCA[i][4];
+    }
+
     for (i = 0; i < 256; ++i) {
         via3DFormats[i].pictFormat = 0x00;
     }
@@ -29,6 +29,7 @@
 #include "via_dmabuffer.h"
 
 #define VIA_NUM_TEXUNITS 2
+#define VIA_TEX_PACKET_SIZE 13
 
 typedef enum
 {
@@ -45,7 +46,12 @@ typedef enum
     via_src_onepix_mask,
     via_src_onepix_comp_mask,
     via_mask,
-    via_comp_mask
+    via_comp_mask,
+    /* Source alpha times the component mask, for component alpha OutReverse. */
+    via_src_onepix_comp_mask_alpha,
+    via_comp_mask_alpha,
+    /* Source alpha in all channels, for A8 destinations. */
+    via_src_alpha
 } ViaTexBlendingModes;
 
 typedef struct _ViaTextureUnit
@@ -66,6 +72,13 @@ typedef struct _ViaTextureUnit
     Bool textureDirty;
     Bool texBColDirty;
     Bool npot;
+    Bool bilinear;
+    float scaleX;                            /* Texels to texture coords */
+    float scaleY;
+    Bool transformed;
+    float transform[6];                      /* Affine, applied to texels */
+    CARD32 texPacket[VIA_TEX_PACKET_SIZE];   /* Encoded texture registers */
+    CARD32 texEmitted[VIA_TEX_PACKET_SIZE];  /* What the engine last got */
 } ViaTextureUnit;
 
 typedef struct _Via3DState
@@ -90,7 +103,11 @@ typedef struct _Via3DState
     CARD32 blendAl1;
     Bool writeAlpha;
     Bool writeColor;
+    Bool dither;
     Bool useDestAlpha;
+    Bool quadsOpen;
+    int quadsNumTex;
+    CARD32 quadsCmd;
     ViaTextureUnit tex[VIA_NUM_TEXUNITS];
     void (*setDestination) (struct _Via3DState * v3d, CARD32 offset,
 	CARD32 pitch, int format);
@@ -98,17 +115,27 @@ typedef struct _Via3DState
 	CARD32 planeMask, CARD32 solidColor, CARD32 solidAlpha);
     void (*setFlags) (struct _Via3DState * v3d, int numTextures,
 	Bool writeAlpha, Bool writeColor, Bool blend);
+    void (*setDither) (struct _Via3DState * v3d, Bool dither);
         Bool(*setTexture) (struct _Via3DState * v3d, int tex, CARD32 offset,
 	CARD32 pitch, Bool nPot, CARD32 width, CARD32 height, int format,
 	ViaTextureModes sMode, ViaTextureModes tMode,
 	ViaTexBlendingModes blendingMode, Bool agpTexture);
+    void (*setTexFilter) (struct _Via3DState * v3d, int tex, Bool bilinear);
+    void (*setTexTransform) (struct _Via3DState * v3d, int tex,
+	const float *transform);
     void (*setTexBlendCol) (struct _Via3DState * v3d, int tex, Bool component,
 	CARD32 color);
-    void (*setCompositeOperator) (struct _Via3DState * v3d, CARD8 op);
+    void (*setCompositeOperator) (struct _Via3DState * v3d, CARD8 op,
+	Bool componentAlpha);
         Bool(*opSupported) (CARD8 op);
+        Bool(*opSupportedCA) (CARD8 op);
     void (*emitQuad) (struct _Via3DState * v3d, ViaCommandBuffer * cb,
 	int dstX, int dstY, int src0X, int src0Y, int src1X, int src1Y, int w,
 	int h);
+    void (*emitQuadScaled) (struct _Via3DState * v3d, ViaCommandBuffer * cb,
+	int dstX, int dstY, int dstW, int dstH, float srcX, float srcY,
+	float srcW, float srcH);
+    void (*flushQuads) (struct _Via3DState * v3d, ViaCommandBuffer * cb);
     void (*emitState) (struct _Via3DState * v3d, ViaCommandBuffer * cb,
 	Bool forceUpload);
     void (*emitClipRect) (struct _Via3DState * v3d, ViaCommandBuffer * cb,
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2016 The OpenChrome Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Memory bandwidth model.
+ *
+ * All figures are in the units the old Xv bandwidth check used: a "dot
+ * clock" of width * height * refresh / 680000, multiplied by the number of
+ * bytes fetched per pixel.  The available bandwidth is the memory clock
+ * times 16 bytes (128 bit bus) times a per-chipset efficiency factor.
+ *
+ * The tables and the formula are derived from the tables present in VIA's
+ * own drivers, and are conservative.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "via_driver.h"
+
+/* Memory clock in MHz, indexed by pVia->MemClk. */
+static const float viaMemClock[VIA_MEM_END] = {
+    [VIA_MEM_SDR66]   = 33.,
+    [VIA_MEM_SDR100]  = 50.,
+    [VIA_MEM_SDR133]  = 66.5,
+    [VIA_MEM_DDR200]  = 100.,
+    [VIA_MEM_DDR266]  = 133.,
+    [VIA_MEM_DDR333]  = 166.,
+    [VIA_MEM_DDR400]  = 200.,
+    [VIA_MEM_DDR533]  = 266.,
+    [VIA_MEM_DDR667]  = 333.,
+    [VIA_MEM_DDR800]  = 400.,
+    [VIA_MEM_DDR1066] = 533.
+};
+
+/*
+ * The old overlay check for the CLE266 only limited the display:
+ * HDisplay / 16 * VDisplay / 32 * bpp * refresh had to stay below 1800000
+ * with DDR200 and 7901250 with DDR266, and there was no overlay with SDR.
+ * In the units here, those are display demands of limit * 512 / 5440000.
+ * The overlay is charged on top at full screen, which doubles the demand
+ * at 16 bpp, so the efficiencies are such that twice those demands fit.
+ */
+#define CLE266_DDR200 (2. * 1800000 * 512 / 5440000 / (100. * 16.))
+#define CLE266_DDR266 (2. * 7901250 * 512 / 5440000 / (133. * 16.))
+
+/*
+ * Memory efficiency per chipset, for SDR, DDR200 and faster memory.
+ * An efficiency of 0 means the overlay cannot be used at all.
+ */
+static const struct {
+    int chipset;
+    float sdr;
+    float ddr200;
+    float ddr266;
+} viaMemEfficiency[] = {
+    {VIA_CLE266,    0.,              CLE266_DDR200,   CLE266_DDR266},
+    {VIA_KM400,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_K8M800,    SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_PM800,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_P4M800PRO, SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_CX700,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_P4M890,    SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_K8M890,    SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_P4M900,    SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_VX800,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_VX855,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {VIA_VX900,     SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133},
+    {-1,            SINGLE_3205_100, SINGLE_3205_100, SINGLE_3205_133}
+};
+
+/*
+ * Bandwidth available for display, video and acceleration.
+ */
+float
+viaBandwidthAvailable(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    int memClk = pVia->MemClk;
+    float efficiency;
+    int i;
+
+    /* FIXME: Some CLE266s report SDR66, which they do not support. */
+    if ((pVia->Chipset == VIA_CLE266) && (memClk == VIA_MEM_SDR66))
+        memClk = VIA_MEM_DDR266;
+
+    if (memClk >= VIA_MEM_END) {
+        ErrorF("Unknown DRAM Type!\n");
+        memClk = VIA_MEM_DDR333;
+    }
+
+    for (i = 0; viaMemEfficiency[i].chipset != -1; i++)
+        if (viaMemEfficiency[i].chipset == pVia->Chipset)
+            break;
+
+    if (memClk < VIA_MEM_DDR200)
+        efficiency = viaMemEfficiency[i].sdr;
+    else if (memClk == VIA_MEM_DDR200)
+        efficiency = viaMemEfficiency[i].ddr200;
+    else
+        efficiency = viaMemEfficiency[i].ddr266;
+
+    return viaMemClock[memClk] * 16. * efficiency;
+}
+
+static float
+viaBandwidthRefresh(DisplayModePtr mode)
+{
+    float refresh = mode->VRefresh;
+
+    if (refresh <= 0.)
+        refresh = xf86ModeVRefresh(mode);
+    if (refresh <= 0.) {
+        ErrorF("Unable to fetch vertical refresh value, "
+               "needed for bandwidth calculation.\n");
+        refresh = 60.;
+    }
+
+    return refresh;
+}
+
+/*
+ * Pixel rate of a mode, in units of 680000 pixels per second.
+ */
+static float
+viaBandwidthDotClock(DisplayModePtr mode)
+{
+    return ((float) mode->HDisplay * mode->VDisplay *
+            viaBandwidthRefresh(mode)) / 680000.;
+}
+
+/*
+ * Bandwidth needed to scan out all enabled CRTCs.  If crtc and mode are
+ * given, mode replaces the current mode of crtc, e.g. while it is being
+ * set.
+ */
+float
+viaBandwidthCrtcDemand(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+                       DisplayModePtr mode)
+{
+    xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+    float demand = 0.;
+    int i;
+
+    for (i = 0; i < xf86_config->num_crtc; i++) {
+        xf86CrtcPtr iter = xf86_config->crtc[i];
+
+        if (iter == crtc)
+            continue;
+        if (!iter->enabled)
+            continue;
+        demand += viaBandwidthDotClock(&iter->mode) *
+                  (pScrn->bitsPerPixel >> 3);
+    }
+
+    if (crtc && mode)
+        demand += viaBandwidthDotClock(mode) * (pScrn->bitsPerPixel >> 3);
+
+    return demand;
+}
+
+/*
+ * Bandwidth needed by the video overlay on this CRTC.  Once per refresh
+ * the engine fetches the visible part of the destination, or the source
+ * when it is larger, i.e. when downscaling.  Without the HQV the overlay
+ * downscales vertically itself, and fetches another source line for
+ * each destination line it interpolates.
+ */
+static float
+viaBandwidthOverlayDemand(xf86CrtcPtr crtc, Bool hqv,
+                          unsigned srcW, unsigned srcH,
+                          unsigned dstW, unsigned dstH)
+{
+    DisplayModePtr mode = &crtc->desiredMode;
+    float refresh = viaBandwidthRefresh(mode);
+    float pixels;
+
+    pixels = (float) min(dstW, mode->HDisplay) * min(dstH, mode->VDisplay);
+    if ((float) srcW * srcH > (float) dstW * dstH)
+        pixels = (float) srcW * srcH;
+    if (!hqv && srcH > dstH)
+        pixels += (float) srcW * min(dstH, mode->VDisplay);
+
+    return pixels * refresh / 680000. * VIDEO_BPP;
+}
+
+/*
+ * Check whether the overlay fits next to the active CRTCs and the other
+ * numOther overlays already shown, which are accounted at full screen.
+ *
+ * Returns 1 if it fits, 2 or 4 if it only fits with the source decimated
+ * by that factor in both directions, and 0 if it does not fit at all.
+ */
+int
+viaBandwidthOverlayCheck(xf86CrtcPtr crtc, int numOther, Bool hqv,
+                         unsigned srcW, unsigned srcH,
+                         unsigned dstW, unsigned dstH)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    float available = viaBandwidthAvailable(pScrn);
+    float display = viaBandwidthCrtcDemand(pScrn, crtc, &crtc->desiredMode);
+    int decimate;
+
+    display += numOther * viaBandwidthDotClock(&crtc->desiredMode) * VIDEO_BPP;
+
+    for (decimate = 1; decimate <= 4; decimate <<= 1) {
+        float overlay = viaBandwidthOverlayDemand(crtc, hqv,
+                                                  srcW / decimate,
+                                                  srcH / decimate,
+                                                  dstW, dstH);
+
+        DBG_DD(ErrorF("viaBandwidthOverlayCheck: decimate %d, "
+                      "display %f, overlay %f, available %f\n",
+                      decimate, display, overlay, available));
+
+        if (display + overlay < available)
+            return decimate;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the display alone uses more than half of the memory bandwidth.
+ */
+Bool
+viaBandwidthIsTight(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, DisplayModePtr mode)
+{
+    float available = viaBandwidthAvailable(pScrn);
+    float display = viaBandwidthCrtcDemand(pScrn, crtc, mode);
+
+    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                     "Display bandwidth: %f of %f.\n", display, available));
+
+    return (display * 2. > available);
+}
+
+/*
+ * Warn once when the display alone needs more memory bandwidth than the
+ * model gives. The FIFO thresholds themselves are the measured ones of
+ * the mode setting code, the model is only advisory there.
+ */
+void
+viaBandwidthCheckMode(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, DisplayModePtr mode)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (pVia->bandwidthWarned ||
+        viaBandwidthCrtcDemand(pScrn, crtc, mode) <=
+        viaBandwidthAvailable(pScrn))
+        return;
+
+    pVia->bandwidthWarned = TRUE;
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+               "Mode %s may exceed the available memory bandwidth.\n",
+               mode ? mode->name : "");
+}
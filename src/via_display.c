@@ -1197,11 +1197,21 @@ viaIGA1SetFBStartingAddress(xf86CrtcPtr crtc, int x, int y)
     DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                         "Entered viaIGA1SetFBStartingAddress.\n"));
 
-    Base = (y * pScrn->displayWidth + x) * (pScrn->bitsPerPixel / 8);
-    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-                        "Base Address: 0x%lx\n",
-                        Base));
-    Base = (Base + drmmode->front_bo->offset) >> 1;
+    if (crtc->rotatedData && drmmode_crtc->rotate_bo) {
+        /* Scan out from the rotation shadow, with its own pitch. */
+        Base = drmmode_crtc->rotate_bo->offset >> 1;
+
+        /* 3X5.13[7:0] and 3X5.35[7:5] - Primary Display Horizontal
+         * Offset */
+        hwp->writeCrtc(hwp, 0x13, (drmmode_crtc->rotate_pitch >> 3) & 0xFF);
+        ViaCrtcMask(hwp, 0x35, drmmode_crtc->rotate_pitch >> 6, 0xE0);
+    } else {
+        Base = (y * pScrn->displayWidth + x) * (pScrn->bitsPerPixel / 8);
+        DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                            "Base Address: 0x%lx\n",
+                            Base));
+        Base = (Base + drmmode->front_bo->offset) >> 1;
+    }
     xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                 "DRI Base Address: 0x%lx\n",
                 Base);
@@ -1690,13 +1700,15 @@ ViaSetPrimaryExpireNumber(ScrnInfoPtr pScrn, DisplayModePtr mode,
 }
 
 static void
-ViaSetPrimaryFIFO(ScrnInfoPtr pScrn, DisplayModePtr mode)
+ViaSetPrimaryFIFO(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, DisplayModePtr mode)
 {
     vgaHWPtr hwp = VGAHWPTR(pScrn);
     VIAPtr pVia = VIAPTR(pScrn);
 
     DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO, "ViaSetPrimaryFIFO\n"));
 
+    viaBandwidthCheckMode(pScrn, crtc, mode);
+
     /* Standard values. */
     ViaSeqMask(hwp, 0x17, 0x1F, 0xFF);
 
@@ -2350,11 +2362,21 @@ viaIGA2SetFBStartingAddress(xf86CrtcPtr crtc, int x, int y)
     DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                         "Entered viaIGA2SetFBStartingAddress.\n"));
 
-    Base = (y * pScrn->displayWidth + x) * (pScrn->bitsPerPixel / 8);
-    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-                        "Base Address: 0x%lx\n",
-                        Base));
-    Base = (Base + drmmode->front_bo->offset) >> 3;
+    if (crtc->rotatedData && drmmode_crtc->rotate_bo) {
+        /* Scan out from the rotation shadow, with its own pitch. */
+        Base = drmmode_crtc->rotate_bo->offset >> 3;
+
+        /* 3X5.66[7:0] and 3X5.67[1:0] - Second Display Horizontal
+         * Offset */
+        hwp->writeCrtc(hwp, 0x66, (drmmode_crtc->rotate_pitch >> 3) & 0xFF);
+        ViaCrtcMask(hwp, 0x67, drmmode_crtc->rotate_pitch >> 11, 0x03);
+    } else {
+        Base = (y * pScrn->displayWidth + x) * (pScrn->bitsPerPixel / 8);
+        DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                            "Base Address: 0x%lx\n",
+                            Base));
+        Base = (Base + drmmode->front_bo->offset) >> 3;
+    }
     xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                 "DRI Base Address: 0x%lx\n",
                 Base);
@@ -2689,13 +2711,15 @@ viaIGA2ModeValid(ScrnInfoPtr pScrn, DisplayModePtr mode)
  *
  */
 static void
-ViaSetSecondaryFIFO(ScrnInfoPtr pScrn, DisplayModePtr mode)
+ViaSetSecondaryFIFO(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, DisplayModePtr mode)
 {
     vgaHWPtr hwp = VGAHWPTR(pScrn);
     VIAPtr pVia = VIAPTR(pScrn);
 
     DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO, "ViaSetSecondaryFIFO\n"));
 
+    viaBandwidthCheckMode(pScrn, crtc, mode);
+
     switch (pVia->Chipset) {
         case VIA_CLE266:
             if (CLE266_REV_IS_CX(pVia->ChipRev)) {
@@ -3288,7 +3312,7 @@ iga1_crtc_mode_set(xf86CrtcPtr crtc, DisplayModePtr mode,
     /* Set display controller screen parameters. */
     viaIGA1SetDisplayRegister(pScrn, adjusted_mode);
 
-    ViaSetPrimaryFIFO(pScrn, adjusted_mode);
+    ViaSetPrimaryFIFO(pScrn, crtc, adjusted_mode);
 
     pVIADisplay->Clock = ViaModeDotClockTranslate(pScrn, adjusted_mode);
     pVIADisplay->ClockExternal = FALSE;
@@ -3382,22 +3406,6 @@ iga1_crtc_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
                         "Exiting iga1_crtc_gamma_set.\n"));
 }
 
-static void *
-iga1_crtc_shadow_allocate (xf86CrtcPtr crtc, int width, int height)
-{
-    return NULL;
-}
-
-static PixmapPtr
-iga1_crtc_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
-{
-    return NULL;
-}
-
-static void
-iga1_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data)
-{
-}
 
 /*
     Set the cursor foreground and background colors.  In 8bpp, fg and
@@ -3508,6 +3516,82 @@ iga_crtc_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
     }
 }
 
+/*
+ * RandR rotation.  The CRTC scans out from a shadow buffer in video
+ * memory; on every damaged frame the server redraws the damaged boxes
+ * into it with a transformed Render composite, which EXA hands to the
+ * 3D engine.
+ */
+static void *
+iga_crtc_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    drmmode_crtc_private_ptr iga = crtc->driver_private;
+    unsigned pitch = (width * (pScrn->bitsPerPixel >> 3) + 31) & ~31;
+
+    iga->rotate_bo = drm_bo_alloc(pScrn, pitch * height, 32,
+                                  TTM_PL_FLAG_VRAM, VIA_BO_ROTATE);
+    if (!iga->rotate_bo) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                    "Couldn't allocate shadow memory for rotated CRTC.\n");
+        return NULL;
+    }
+
+    if (!drm_bo_map(pScrn, iga->rotate_bo)) {
+        drm_bo_free(pScrn, iga->rotate_bo);
+        iga->rotate_bo = NULL;
+        return NULL;
+    }
+
+    iga->rotate_pitch = pitch;
+    return iga->rotate_bo->ptr;
+}
+
+static PixmapPtr
+iga_crtc_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    drmmode_crtc_private_ptr iga = crtc->driver_private;
+    PixmapPtr rotate_pixmap;
+
+    if (!data)
+        data = iga_crtc_shadow_allocate(crtc, width, height);
+    if (!data)
+        return NULL;
+
+    /* The buffer lies inside the framebuffer aperture, so EXA treats the
+     * pixmap as offscreen and accelerates rendering into it. */
+    rotate_pixmap = GetScratchPixmapHeader(pScrn->pScreen, width, height,
+                                           pScrn->depth, pScrn->bitsPerPixel,
+                                           iga->rotate_pitch, data);
+    if (!rotate_pixmap)
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                    "Couldn't allocate shadow pixmap for rotated CRTC.\n");
+
+    return rotate_pixmap;
+}
+
+static void
+iga_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    VIAPtr pVia = VIAPTR(pScrn);
+    drmmode_crtc_private_ptr iga = crtc->driver_private;
+
+    if (rotate_pixmap)
+        FreeScratchPixmapHeader(rotate_pixmap);
+
+    if (data && iga->rotate_bo) {
+        /* The engine may still be drawing into the buffer. */
+        if (!pVia->NoAccel)
+            viaAccelSync(pScrn);
+
+        drm_bo_unmap(pScrn, iga->rotate_bo);
+        drm_bo_free(pScrn, iga->rotate_bo);
+        iga->rotate_bo = NULL;
+    }
+}
+
 static void
 iga_crtc_destroy(xf86CrtcPtr crtc)
 {
@@ -3526,9 +3610,9 @@ const xf86CrtcFuncsRec iga1_crtc_funcs = {
     .mode_set               = iga1_crtc_mode_set,
     .commit                 = iga1_crtc_commit,
     .gamma_set              = iga1_crtc_gamma_set,
-    .shadow_create          = iga1_crtc_shadow_create,
-    .shadow_allocate        = iga1_crtc_shadow_allocate,
-    .shadow_destroy         = iga1_crtc_shadow_destroy,
+    .shadow_create          = iga_crtc_shadow_create,
+    .shadow_allocate        = iga_crtc_shadow_allocate,
+    .shadow_destroy         = iga_crtc_shadow_destroy,
     .set_cursor_colors      = iga_crtc_set_cursor_colors,
     .set_cursor_position    = iga_crtc_set_cursor_position,
     .show_cursor            = iga_crtc_show_cursor,
@@ -3717,7 +3801,7 @@ iga2_crtc_mode_set(xf86CrtcPtr crtc, DisplayModePtr mode,
     /* Set display controller screen parameters. */
     viaIGA2SetDisplayRegister(pScrn, adjusted_mode);
 
-    ViaSetSecondaryFIFO(pScrn, adjusted_mode);
+    ViaSetSecondaryFIFO(pScrn, crtc, adjusted_mode);
     pVIADisplay->Clock = ViaModeDotClockTranslate(pScrn, adjusted_mode);
     pVIADisplay->ClockExternal = FALSE;
     ViaSetSecondaryDotclock(pScrn, pVIADisplay->Clock);
@@ -3811,22 +3895,6 @@ iga2_crtc_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
                         "Exiting iga2_crtc_gamma_set.\n"));
 }
 
-static void *
-iga2_crtc_shadow_allocate (xf86CrtcPtr crtc, int width, int height)
-{
-    return NULL;
-}
-
-static PixmapPtr
-iga2_crtc_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
-{
-    return NULL;
-}
-
-static void
-iga2_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data)
-{
-}
 
 const xf86CrtcFuncsRec iga2_crtc_funcs = {
     .dpms                   = iga2_crtc_dpms,
@@ -3839,9 +3907,9 @@ const xf86CrtcFuncsRec iga2_crtc_funcs = {
     .mode_set               = iga2_crtc_mode_set,
     .commit                 = iga2_crtc_commit,
     .gamma_set              = iga2_crtc_gamma_set,
-    .shadow_create          = iga2_crtc_shadow_create,
-    .shadow_allocate        = iga2_crtc_shadow_allocate,
-    .shadow_destroy         = iga2_crtc_shadow_destroy,
+    .shadow_create          = iga_crtc_shadow_create,
+    .shadow_allocate        = iga_crtc_shadow_allocate,
+    .shadow_destroy         = iga_crtc_shadow_destroy,
     .set_cursor_colors      = iga_crtc_set_cursor_colors,
     .set_cursor_position    = iga_crtc_set_cursor_position,
     .show_cursor            = iga_crtc_show_cursor,
@@ -41,6 +41,12 @@ typedef struct _ViaCommandBuffer
 } ViaCommandBuffer;
 
 #define VIA_DMASIZE 16384
+/*
+ * With DRI the DRM copies each submission through its own 60000 byte
+ * buffer for verification before it goes into the AGP ring, so that is
+ * the most that one ioctl can take.
+ */
+#define VIA_DRI_DMASIZE 49152
 
 #define H1_ADDR(val) (((val) >> 2) | 0xF0000000)
 #define WAITFLAGS(flags)			\
@@ -666,6 +666,13 @@ VIADRICloseScreen(ScreenPtr pScreen)
 
     DRICloseScreen(pScreen);
     drm_bo_free(pScrn, pVia->driOffScreenMem);
+    pVia->driOffScreenMem = NULL;
+    free(pVia->driOffScreenSave);
+    pVia->driOffScreenSave = NULL;
+    pVia->driOffScreenSaved = FALSE;
+    pVia->driOffScreenDirty = FALSE;
+    pVia->driContexts = 0;
+    drm_bo_cache_purge(pScrn);
 
     if (pVia->pDRIInfo) {
         if ((pVIADRI = (VIADRIPtr) pVia->pDRIInfo->devPrivate)) {
@@ -695,6 +702,17 @@ VIACreateContext(ScreenPtr pScreen, VisualPtr visual,
                  drm_context_t hwContext, void *pVisualConfigPriv,
                  DRIContextType contextStore)
 {
+    VIAPtr pVia = VIAPTR(xf86ScreenToScrn(pScreen));
+
+    /*
+     * Only DRI clients write to the DRI offscreen memory. The server's own
+     * contexts, its 2D one and the dummy one of DRI_HIDE_X_CONTEXT, come
+     * without a visual.
+     */
+    if (visual && contextStore != DRI_2D_CONTEXT) {
+        pVia->driContexts++;
+        pVia->driOffScreenDirty = TRUE;
+    }
     return TRUE;
 }
 
@@ -702,6 +720,14 @@ static void
 VIADestroyContext(ScreenPtr pScreen, drm_context_t hwContext,
                   DRIContextType contextStore)
 {
+    VIAPtr pVia = VIAPTR(xf86ScreenToScrn(pScreen));
+
+    /*
+     * The server's own contexts are only destroyed with the screen, which
+     * resets the count, so any other is a client's.
+     */
+    if (pVia->driContexts)
+        pVia->driContexts--;
 }
 
 Bool
@@ -731,7 +757,8 @@ VIADRIFinishScreenInit(ScreenPtr pScreen)
                    "[drm] the frame buffer memory area in the BIOS.\n");
     }
 
-    pVia->driOffScreenMem = drm_bo_alloc(pScrn, pVia->driSize, 16, TTM_PL_FLAG_VRAM);
+    pVia->driOffScreenMem = drm_bo_alloc(pScrn, pVia->driSize, 16,
+                                         TTM_PL_FLAG_VRAM, VIA_BO_DRI);
 
     DRIFinishScreenInit(pScreen);
 
@@ -867,97 +894,182 @@ VIADRIMapInit(ScreenPtr pScreen, VIAPtr pVia)
     return TRUE;
 }
 
-#define DRM_VIA_BLIT_MAX_SIZE (2048*2048*4)
+/*
+ * The blit engine gets one descriptor per line, so the memory is laid out
+ * as page sized lines, in blits of as many lines as the kernel takes.
+ */
+#define VIA_DRI_BLIT_PITCH      4096
+#define VIA_DRI_BLIT_LINES      1024
+/* Blits queued in the kernel at once; it has eight slots per engine. */
+#define VIA_DRI_BLIT_DEPTH      4
 
+/*
+ * Copy a whole buffer object between video memory and system memory with
+ * DMA. Up to VIA_DRI_BLIT_DEPTH blits are in flight, and a blit is only
+ * waited for when its slot is needed again, so the engine always has the
+ * next one queued.
+ */
 static int
-viaDRIFBMemcpy(int fd, struct buffer_object *vram, unsigned char *addr,
-               Bool toFB)
+viaDRIFBMemcpy(ScrnInfoPtr pScrn, struct buffer_object *vram,
+               unsigned char *addr, Bool toFB)
 {
+    VIAPtr pVia = VIAPTR(pScrn);
     unsigned long fbOffset = vram->offset, size = vram->size, curSize;
-    drm_via_dmablit_t blit;
-    int err;
+    drm_via_dmablit_t blit[VIA_DRI_BLIT_DEPTH], *curBlit;
+    Bool doSync[VIA_DRI_BLIT_DEPTH];
+    CARD32 start = GetTimeInMillis(), elapsed;
+    int curBuf, err, ret = 0, i;
+
+    for (i = 0; i < VIA_DRI_BLIT_DEPTH; i++)
+        doSync[i] = FALSE;
 
+    curBuf = 0;
     do {
-        curSize = (size > DRM_VIA_BLIT_MAX_SIZE) ? DRM_VIA_BLIT_MAX_SIZE : size;
+        curBlit = &blit[curBuf];
+        if (doSync[curBuf]) {
+            do {
+                err = drmCommandWrite(pVia->drmmode.fd, DRM_VIA_BLIT_SYNC,
+                                      &curBlit->sync, sizeof(curBlit->sync));
+            } while (err == -EAGAIN);
+
+            doSync[curBuf] = FALSE;
+            if (err && !ret)
+                ret = err;
+        }
 
-        blit.num_lines = 1;
-        blit.line_length = curSize;
-        blit.fb_addr = fbOffset;
-        blit.fb_stride = ALIGN_TO(curSize, 16);
-        blit.mem_addr = addr;
-        blit.mem_stride = blit.fb_stride;
-        blit.to_fb = (toFB) ? 1 : 0;
+        if (!size || ret)
+            goto next;
 
-        do {
-            err = drmCommandWriteRead(fd, DRM_VIA_DMA_BLIT,
-                                      &blit, sizeof(blit));
-        } while (-EAGAIN == err);
-        if (err)
-            return err;
+        if (size >= VIA_DRI_BLIT_PITCH) {
+            curBlit->num_lines = size / VIA_DRI_BLIT_PITCH;
+            if (curBlit->num_lines > VIA_DRI_BLIT_LINES)
+                curBlit->num_lines = VIA_DRI_BLIT_LINES;
+            curBlit->line_length = VIA_DRI_BLIT_PITCH;
+            curBlit->fb_stride = VIA_DRI_BLIT_PITCH;
+            curSize = curBlit->num_lines * VIA_DRI_BLIT_PITCH;
+        } else {
+            /* The tail that doesn't fill a line. */
+            curBlit->num_lines = 1;
+            curBlit->line_length = size;
+            curBlit->fb_stride = ALIGN_TO(size, 16);
+            curSize = size;
+        }
+        curBlit->mem_stride = curBlit->fb_stride;
+        curBlit->fb_addr = fbOffset;
+        curBlit->mem_addr = addr;
+        curBlit->flags = 0;
+        curBlit->to_fb = (toFB) ? 1 : 0;
 
         do {
-            err = drmCommandWriteRead(fd, DRM_VIA_BLIT_SYNC,
-                                      &blit.sync, sizeof(blit.sync));
-        } while (-EAGAIN == err);
-        if (err)
-            return err;
+            err = drmCommandWriteRead(pVia->drmmode.fd, DRM_VIA_DMA_BLIT,
+                                      curBlit, sizeof(*curBlit));
+        } while (err == -EAGAIN);
 
+        if (err) {
+            ret = err;
+            goto next;
+        }
+
+        doSync[curBuf] = TRUE;
         fbOffset += curSize;
         addr += curSize;
         size -= curSize;
 
-    } while (size > 0);
+next:
+        curBuf = (curBuf + 1) % VIA_DRI_BLIT_DEPTH;
+        for (i = 0; i < VIA_DRI_BLIT_DEPTH; i++)
+            if (doSync[i])
+                break;
+    } while (i < VIA_DRI_BLIT_DEPTH || (size && !ret));
+
+    if (ret)
+        return ret;
+
+    elapsed = GetTimeInMillis() - start;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "%s %lu KB of DRI offscreen memory in %u ms (%lu MB/s).\n",
+               toFB ? "Restored" : "Saved", vram->size >> 10,
+               (unsigned) elapsed,
+               elapsed ? (vram->size / 1000) / elapsed : 0);
     return 0;
 }
 
+/*
+ * The DRI offscreen memory is saved on leaving the VT and restored on
+ * entering it. Only DRI clients write to it, and they can't while the
+ * VT is switched away, so the save is skipped when no DRI context has
+ * existed since the last one: the copy still matches the memory, or the
+ * memory was never used at all, in which case there is nothing to
+ * restore either. The save buffer is kept across switches.
+ */
 void
 viaDRIOffscreenSave(ScrnInfoPtr pScrn)
 {
     VIAPtr pVia = VIAPTR(pScrn);
-    unsigned long srcSize = pVia->driOffScreenMem->size;
+    unsigned long srcSize;
+    void *dst, *src;
     int err;
 
-    if (pVia->driOffScreenSave)
-        free(pVia->driOffScreenSave);
+    if (!pVia->driOffScreenMem || !pVia->driOffScreenDirty)
+        return;
 
-    pVia->driOffScreenSave = malloc(srcSize + 16);
-    if (pVia->driOffScreenSave) {
-        void *dst, *src = drm_bo_map(pScrn, pVia->driOffScreenMem);
+    srcSize = pVia->driOffScreenMem->size;
+    if (!pVia->driOffScreenSave) {
+        pVia->driOffScreenSave = malloc(srcSize + 16);
+        if (!pVia->driOffScreenSave) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "Out of memory trying to backup DRI offscreen "
+                       "memory.\n");
+            return;
+        }
+    }
 
-        dst = (void *) ALIGN_TO((unsigned long) pVia->driOffScreenSave, 16);
-        if ((pVia->drmVerMajor == 2) && (pVia->drmVerMinor >= 8)) {
-            err = viaDRIFBMemcpy(pVia->drmmode.fd, pVia->driOffScreenMem, dst, FALSE);
-            if (!err)
-                return;
+    /* Whatever happens, the old copy is stale now. */
+    pVia->driOffScreenSaved = FALSE;
+    dst = (void *) ALIGN_TO((unsigned long) pVia->driOffScreenSave, 16);
+    if ((pVia->drmVerMajor == 2) && (pVia->drmVerMinor >= 8)) {
+        err = viaDRIFBMemcpy(pScrn, pVia->driOffScreenMem, dst, FALSE);
+        if (!err)
+            goto done;
 
-            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-                       "Hardware backup of DRI offscreen memory failed: %s.\n"
-                       "\tUsing slow software backup instead.\n",
-                       strerror(-err));
-        }
-        memcpy(dst, src, srcSize);
-        drm_bo_unmap(pScrn, pVia->driOffScreenMem);
-    } else {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                   "Out of memory trying to backup DRI offscreen memory.\n");
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "Hardware backup of DRI offscreen memory failed: %s.\n"
+                   "\tUsing slow software backup instead.\n",
+                   strerror(-err));
     }
-    return;
+
+    src = drm_bo_map(pScrn, pVia->driOffScreenMem);
+    memcpy(dst, src, srcSize);
+    drm_bo_unmap(pScrn, pVia->driOffScreenMem);
+
+done:
+    pVia->driOffScreenSaved = TRUE;
+    pVia->driOffScreenDirty = (pVia->driContexts > 0);
 }
 
 void
 viaDRIOffscreenRestore(ScrnInfoPtr pScrn)
 {
     VIAPtr pVia = VIAPTR(pScrn);
+    void *src, *dst;
+    int err;
 
-    if (pVia->driOffScreenSave) {
-        void *src, *dst = drm_bo_map(pScrn, pVia->driOffScreenMem);
+    if (!pVia->driOffScreenMem || !pVia->driOffScreenSaved)
+        return;
 
-        src = pVia->driOffScreenSave;
-        memcpy(dst, src, pVia->driOffScreenMem->size);
-        free(pVia->driOffScreenSave);
-        pVia->driOffScreenSave = NULL;
+    src = (void *) ALIGN_TO((unsigned long) pVia->driOffScreenSave, 16);
+    if ((pVia->drmVerMajor == 2) && (pVia->drmVerMinor >= 8)) {
+        err = viaDRIFBMemcpy(pScrn, pVia->driOffScreenMem, src, TRUE);
+        if (!err)
+            return;
 
-        drm_bo_unmap(pScrn, pVia->driOffScreenMem);
-    } else {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "Hardware restore of DRI offscreen memory failed: %s.\n"
+                   "\tUsing slow software restore instead.\n",
+                   strerror(-err));
     }
+
+    dst = drm_bo_map(pScrn, pVia->driOffScreenMem);
+    memcpy(dst, src, pVia->driOffScreenMem->size);
+    drm_bo_unmap(pScrn, pVia->driOffScreenMem);
 }
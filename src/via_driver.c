@@ -275,6 +275,9 @@ VIAEnterVT_internal(ScrnInfoPtr pScrn, int flags)
             viaRestoreVideo(pScrn);
         }
 
+        /* The 3D engine state cached in pVia->v3d may be gone. */
+        pVia->lastToUpload = NULL;
+
 #ifdef HAVE_DRI
         if (pVia->directRenderingType == DRI_1) {
             kickVblank(pScrn);
@@ -723,7 +726,7 @@ via_xf86crtc_resize(ScrnInfoPtr scrn, int width, int height)
     alignedPitch = ALIGN_TO(alignedPitch, 16);
     drmmode->front_bo = drm_bo_alloc(scrn,
                                         alignedPitch * height,
-                                        16, TTM_PL_FLAG_VRAM);
+                                        16, TTM_PL_FLAG_VRAM, VIA_BO_FRONT);
     if (!drmmode->front_bo) {
         goto fail;
     }
@@ -1344,6 +1347,7 @@ VIACloseScreen(CLOSE_SCREEN_ARGS_DECL)
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
     VIAPtr pVia = VIAPTR(pScrn);
+    Bool ret;
     int i;
 
     DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO, "VIACloseScreen\n"));
@@ -1389,6 +1393,10 @@ VIACloseScreen(CLOSE_SCREEN_ARGS_DECL)
             drm_bo_free(pScrn, iga->cursor_bo);
     }
 
+    drm_bo_cache_purge(pScrn);
+    if (pVia->directRenderingType == DRI_NONE)
+        viaVRAMHeapFini(pScrn);
+
 #ifdef HAVE_DRI
     if (pVia->directRenderingType == DRI_1)
         VIADRICloseScreen(pScreen);
@@ -1409,7 +1417,11 @@ VIACloseScreen(CLOSE_SCREEN_ARGS_DECL)
 
     pScrn->vtSema = FALSE;
     pScreen->CloseScreen = pVia->CloseScreen;
-    return (*pScreen->CloseScreen) (CLOSE_SCREEN_ARGS);
+    ret = (*pScreen->CloseScreen) (CLOSE_SCREEN_ARGS);
+
+    /* Only now are the rotation shadows gone too. */
+    viaMemStatsFini(pScrn);
+    return ret;
 }
 
 static Bool
@@ -1560,7 +1572,7 @@ VIAScreenInit(SCREEN_INIT_ARGS_DECL)
          * Set cursor location in frame buffer.
          */
         bo = drm_bo_alloc(pScrn, cursorSize, alignment,
-                            TTM_PL_FLAG_VRAM);
+                            TTM_PL_FLAG_VRAM, VIA_BO_CURSOR);
         if (!bo) {
             return FALSE;
         }
@@ -1590,7 +1602,7 @@ VIAScreenInit(SCREEN_INIT_ARGS_DECL)
     pVia->drmmode.front_bo = drm_bo_alloc(pScrn,
                                             alignedPitch *
                                             pScrn->virtualY,
-                                            16, TTM_PL_FLAG_VRAM);
+                                            16, TTM_PL_FLAG_VRAM, VIA_BO_FRONT);
     if (!pVia->drmmode.front_bo)
         return FALSE;
 
@@ -1603,6 +1615,7 @@ VIAScreenInit(SCREEN_INIT_ARGS_DECL)
     pScreen->CloseScreen = VIACloseScreen;
     pVia->CreateScreenResources = pScreen->CreateScreenResources;
     pScreen->CreateScreenResources = VIACreateScreenResources;
+    viaMemStatsInit(pScrn);
 
     if (!xf86CrtcScreenInit(pScreen))
         return FALSE;
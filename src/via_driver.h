@@ -91,9 +91,45 @@
 #define VIA_AGP_UPL_SIZE    (1024*128)
 #define VIA_DMA_DL_SIZE     (1024*128)
 #define VIA_SCRATCH_SIZE    (4*1024*1024)
+/* Largest ordinary pixmap (bytes) put in the AGP pixmap pool. */
+#define VIA_AGP_POOL_PIXMAP (4*1024)
 
 /*
- * Pixmap sizes below which we don't try to do hw accel.
+ * Pixmaps up to VIA_EXA_MAX pixels wide and high are accelerated, which
+ * keeps their pitch within what the engines take. The 2D engine addresses
+ * 4095 pixels, but the 3D engine clips at 2047, so 3D operations are split
+ * along a grid of VIA_TILE pixel squares, see viaExaTile3D.
+ */
+#define VIA_TILE            2048
+#define VIA_EXA_MAX         4088
+
+/* The pixmap heap compaction copies lines of this pitch, this many at once. */
+#define VIA_MOVE_PITCH      4096
+#define VIA_MOVE_LINES      2048
+
+/* EXA 2.5 and later let the driver allocate the pixmaps. */
+#if (EXA_VERSION_MAJOR > 2) || \
+    ((EXA_VERSION_MAJOR == 2) && (EXA_VERSION_MINOR >= 5))
+#define VIA_EXA_DRIVER_PIXMAPS
+#endif
+
+/* Pixmap driver private with ExaDriverPixmaps. */
+struct via_pixmap {
+    struct buffer_object *bo;           /* Video memory we allocated */
+    struct via_heap_block *block;       /* Or AGP pixmap pool memory */
+    void            *sys;               /* Or system memory */
+    void            *ptr;               /* Where the pixels are */
+    unsigned long   offset;             /* ptr - FBBase */
+    Bool            offscreen;          /* Reachable by the engines */
+    int             sync;               /* Marker of the free */
+    int             access;             /* Under CPU access, can't move */
+    struct via_pixmap *prev;            /* All of them, for viaExitAccel */
+    struct via_pixmap *next;            /* Or the freed ones */
+};
+
+/*
+ * Pixmap sizes below which we don't try to do hw accel. VIA_MIN_COMPOSITE
+ * is only the default, it is calibrated at startup.
  */
 
 #define VIA_MIN_COMPOSITE   400
@@ -110,6 +146,10 @@
 
 #define VIA_VQ_SIZE     (256 * 1024)
 
+/* VRAM cache for gradient source pictures rendered by pixman. */
+#define VIA_GRADIENT_SLOTS      8
+#define VIA_GRADIENT_SLOT_SIZE  (256 * 1024)
+
 #if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 6
 #define VIA_RES_SHARED RES_SHARED_VGA
 #define VIA_RES_UNDEF RES_UNDEFINED
@@ -188,6 +228,33 @@ typedef struct _twodContext {
     int clipY2;
 } ViaTwodContext;
 
+/* Parts of a rectangle, one per VIA_TILE square, see viaExaTileNext. */
+typedef struct {
+    int x1, y1, x2, y2;         /* Whole rectangle */
+    int x, y, w, h;             /* Current part, w is 0 before the first */
+} ViaTileIter;
+
+/* 3D destination of the current operation. */
+typedef struct {
+    unsigned long offset;
+    unsigned pitch;
+    unsigned cpp;
+    int format;
+    int width, height;
+    Bool a8;                    /* Drawn as ARGB8888, see viaExaCompositeA8 */
+    int x, y;                   /* Square the 3D engine draws to */
+} ViaTile3D;
+
+typedef struct _ViaGradientSlot {
+    CARD32 hash;
+    unsigned char *key;         /* See viaExaGradientKey */
+    unsigned keyLen;
+    int x, y, width, height;    /* Area of the gradient, height 0 if empty */
+    unsigned long lastUse;
+    int sync;                   /* Marker of the last composite reading it */
+    Bool busy;                  /* Read by the current composite */
+} ViaGradientSlot;
+
 typedef struct _VIA {
     int                 Bpl;
 
@@ -199,6 +266,11 @@ typedef struct _VIA {
     int                 driSize;
     int                 maxDriSize;
     struct buffer_object *vq_bo;
+    struct via_bo_cache boCache[2];     /* VRAM and TT */
+    OsTimerPtr          boCacheTimer;
+    struct via_heap     vramHeap;       /* Driver buffers without DRI */
+    struct via_heap     pixmapHeap;     /* Driver pixmaps without DRI */
+    struct via_mem_stats memStats;
     int                 VQStart;
     int                 VQEnd;
 
@@ -213,6 +285,7 @@ typedef struct _VIA {
     unsigned char*      MapBaseDense;
     uint8_t*            FBBase;
     CARD8               MemClk;
+    Bool                bandwidthWarned;
 
     /* Here are all the Options */
     Bool                VQEnable;
@@ -223,6 +296,8 @@ typedef struct _VIA {
 
 	CreateScreenResourcesProcPtr CreateScreenResources;
     CloseScreenProcPtr  CloseScreen;
+    CreatePixmapProcPtr CreatePixmap;
+    DestroyPixmapProcPtr DestroyPixmap;
 #ifdef HAVE_PCIACCESS
     struct pci_device  *PciInfo;
 #else
@@ -261,11 +336,34 @@ typedef struct _VIA {
     Bool                componentAlpha;
     void               *srcP;
     CARD32              srcFormat;
+    CARD32              srcSolid;
+    PicturePtr          gradPict;
+    pixman_image_t     *gradImage;
+    CARD32              gradHash;
+    unsigned char      *gradKey;
+    unsigned            gradKeyLen;
+    unsigned            gradKeySize;
+    ViaTexBlendingModes gradMode;
+    struct buffer_object *gradBuffer;
+    ViaGradientSlot     gradSlots[VIA_GRADIENT_SLOTS];
+    unsigned long       gradCount;
+    Bool                dstA8;
+    Bool                srcTransformed;
+    Bool                srcTransClear;
+    BoxRec              srcTransClip;
     unsigned            scratchOffset;
     int                 exaScratchSize;
+    Bool                exaDither;
+    Bool                copy3D;
+    ViaTile3D           tile3D;
     char *              scratchAddr;
     Bool                noComposite;
+    int                 minComposite;   /* Smaller composites go to software */
     struct buffer_object *scratchBuffer;
+    struct via_heap     agpPool;        /* Pixmaps in scratchBuffer */
+    struct via_pixmap  *pixmapsFreed;   /* Still in use, newest first */
+    Bool                exaDriverPixmaps;
+    struct via_pixmap  *pixmaps;
 #ifdef HAVE_DRI
     struct buffer_object *texAGPBuffer;
     char *              dBounce;
@@ -303,6 +401,9 @@ typedef struct _VIA {
     int                 drmVerPatchLevel;
     struct buffer_object *driOffScreenMem;
     void *              driOffScreenSave;
+    Bool                driOffScreenSaved;  /* driOffScreenSave is valid */
+    Bool                driOffScreenDirty;  /* May differ from the copy */
+    int                 driContexts;
 #endif
     Bool                DRIIrqEnable;
     Bool                agpEnable;
@@ -321,6 +422,7 @@ typedef struct _VIA {
     unsigned long       VidRegCursor; /* Write cursor for VidRegBuffer. */
 
     unsigned long       old_dwUseExtendedFIFO;
+    viaPortPrivPtr      xvActivePort;   /* Port owning swov and VideoStatus */
 
     ViaSharedPtr        sharedData;
     Bool                useDmaBlit;
@@ -367,6 +469,8 @@ int viaEXAOffscreenAlloc(ScrnInfoPtr pScrn,
                             unsigned long alignment);
 Bool viaIsAGP(VIAPtr pVia, PixmapPtr pPix, unsigned long *offset);
 Bool viaExaIsOffscreen(PixmapPtr pPix);
+Bool viaExaIsAGPPool(PixmapPtr pPix);
+unsigned long viaExaPixmapOffset(PixmapPtr pPix);
 Bool viaInitExa(ScreenPtr pScreen);
 Bool viaAccelSetMode(int bpp, ViaTwodContext * tdc);
 void viaSetClippingRectangle(ScrnInfoPtr pScrn,
@@ -379,6 +483,35 @@ CARD32 viaBitExpandHelper(CARD32 pixel, CARD32 bits);
 Bool viaCheckUpload(ScrnInfoPtr pScrn, Via3DState * v3d);
 void viaPixelARGB8888(unsigned format, void *pixelP, CARD32 * argb8888);
 Bool viaExpandablePixel(int format);
+Bool viaExaCheckSourcePict(PicturePtr pPict);
+Bool viaExaPrepareSourcePict(ScrnInfoPtr pScrn, PicturePtr pPict);
+void viaExaGradientComposite(ScrnInfoPtr pScrn, int srcX, int srcY,
+                             int maskX, int maskY, int dstX, int dstY,
+                             int width, int height);
+void viaExaDoneSourcePict(ScrnInfoPtr pScrn);
+Bool viaExaCheckTransform(int op, PicturePtr pPict);
+void viaExaPrepareTransform(ScrnInfoPtr pScrn, int op, PicturePtr pPict,
+                            PixmapPtr pPix, int tex);
+Bool viaExaClipTransform(ScrnInfoPtr pScrn, int *srcX, int *srcY, int *maskX,
+                         int *maskY, int *dstX, int *dstY,
+                         int *width, int *height);
+Bool viaExaCopyOverlap(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap,
+                       int *xdir, int *ydir);
+void viaExaTileInit(ViaTileIter *t, int x, int y, int width, int height);
+Bool viaExaTileNext(ViaTileIter *t);
+void viaExaTile3DSetup(ScrnInfoPtr pScrn, PixmapPtr pDst, int format,
+                       Bool a8);
+void viaExaTile3DClip(ScrnInfoPtr pScrn);
+void viaExaTile3D(ScrnInfoPtr pScrn, int *x, int *y);
+Bool viaExaPrepareCopy3D(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap,
+                         int alu, Pixel planeMask);
+void viaExaCopy3D(ScrnInfoPtr pScrn, int srcX, int srcY, int dstX, int dstY,
+                  int width, int height);
+void viaExaDoneCopy3D(ScrnInfoPtr pScrn);
+Bool viaExaCheckA8Dst(int op, PicturePtr pSrcPicture,
+                      PicturePtr pMaskPicture);
+void viaExaCompositeA8(ScrnInfoPtr pScrn, int srcX, int srcY, int maskX,
+                       int maskY, int dstX, int dstY, int width, int height);
 void viaAccelFillPixmap(ScrnInfoPtr, unsigned long, unsigned long,
 			int, int, int, int, int, unsigned long);
 void viaAccelTextureBlit(ScrnInfoPtr, unsigned long, unsigned, unsigned,
@@ -408,7 +541,10 @@ Bool viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
 void viaExaComposite_H2(PixmapPtr pDst, int srcX, int srcY,
                         int maskX, int maskY, int dstX, int dstY,
                         int width, int height);
+void viaExaDoneComposite_H2(PixmapPtr pDst);
 int viaAccelMarkSync_H2(ScreenPtr);
+void viaAccelMove_H2(ScrnInfoPtr pScrn, unsigned long srcOffset,
+                     unsigned long dstOffset, unsigned long size);
 
 /* In via_exa_h6.c */
 Bool viaExaPrepareSolid_H6(PixmapPtr pPixmap, int alu, Pixel planeMask,
@@ -427,7 +563,22 @@ Bool viaExaPrepareComposite_H6(int op, PicturePtr pSrcPicture,
 void viaExaComposite_H6(PixmapPtr pDst, int srcX, int srcY,
                         int maskX, int maskY, int dstX, int dstY,
                         int width, int height);
+void viaExaDoneComposite_H6(PixmapPtr pDst);
 int viaAccelMarkSync_H6(ScreenPtr);
+void viaAccelMove_H6(ScrnInfoPtr pScrn, unsigned long srcOffset,
+                     unsigned long dstOffset, unsigned long size);
+
+/* In via_bandwidth.c */
+float viaBandwidthAvailable(ScrnInfoPtr pScrn);
+float viaBandwidthCrtcDemand(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+                             DisplayModePtr mode);
+int viaBandwidthOverlayCheck(xf86CrtcPtr crtc, int numOther, Bool hqv,
+                             unsigned srcW, unsigned srcH,
+                             unsigned dstW, unsigned dstH);
+Bool viaBandwidthIsTight(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+                         DisplayModePtr mode);
+void viaBandwidthCheckMode(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+                           DisplayModePtr mode);
 
 /* In via_xv.c */
 void viaInitVideo(ScreenPtr pScreen);
@@ -440,6 +591,17 @@ void VIAVidAdjustFrame(ScrnInfoPtr pScrn, int x, int y);
 /* In via_xv_overlay.c */
 void viaSetColorSpace(VIAPtr pVia, int hue, int saturation,
                         int brightness, int contrast, Bool reset);
+void viaWaitHQVSwFlip(VIAPtr pVia, unsigned long proReg);
+
+/* In via_xv_texture.c */
+Bool viaXvTextureSupported(ScrnInfoPtr pScrn);
+int viaXvTexturePutImage(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv,
+                         short src_x, short src_y, short drw_x, short drw_y,
+                         short src_w, short src_h, short drw_w, short drw_h,
+                         int id, unsigned char *buf, short width, short height,
+                         int *pitches, int *offsets,
+                         RegionPtr clipBoxes, DrawablePtr pDraw);
+void viaXvTextureFree(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv);
 
 /* In via_memcpy.c */
 typedef void (*vidCopyFunc)(unsigned char *, const unsigned char *,
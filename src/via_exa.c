@@ -38,6 +38,7 @@
 
 #include <GL/gl.h>
 #include <sys/mman.h>
+#include <math.h>
 
 #include "via_driver.h"
 #include "via_regs.h"
@@ -160,7 +161,7 @@ viaFlushDRIEnabled(ViaCommandBuffer *cb)
         cb->mode = 0;
         cb->has3dState = FALSE;
         while (tmpSize > 0) {
-            b.size = (tmpSize > VIA_DMASIZE) ? VIA_DMASIZE : tmpSize;
+            b.size = (tmpSize > VIA_DRI_DMASIZE) ? VIA_DRI_DMASIZE : tmpSize;
             tmpSize -= b.size;
             b.buf = tmp;
             tmp += b.size;
@@ -182,12 +183,18 @@ viaFlushDRIEnabled(ViaCommandBuffer *cb)
 /*
  * Initialize a command buffer. Some fields are currently not used since they
  * are intended for Unichrome Pro group A video commands.
+ *
+ * With DRI, the buffer is as large as a single DRM submission can be, so
+ * that every flush is one ioctl and there are as few flushes as possible.
  */
 static int
 viaSetupCBuffer(ScrnInfoPtr pScrn, ViaCommandBuffer *cb, unsigned size)
 {
 #ifdef HAVE_DRI
     VIAPtr pVia = VIAPTR(pScrn);
+
+    if (size == 0 && pVia->directRenderingType == DRI_1)
+        size = VIA_DRI_DMASIZE;
 #endif
 
     cb->pScrn = pScrn;
@@ -383,435 +390,1967 @@ viaExpandablePixel(int format)
             formatType == PICT_TYPE_ABGR || formatType == PICT_TYPE_ARGB);
 }
 
-#ifdef VIA_DEBUG_COMPOSITE
-void
-viaExaCompositePictDesc(PicturePtr pict, char *string, int n)
+/*
+ * Source-only pictures.
+ *
+ * Solid fills go through the one-pixel source path as a constant colour.
+ * Gradients are rendered by pixman, one band of at most
+ * VIA_GRADIENT_SLOT_SIZE bytes at a time, into a small VRAM cache and used
+ * as an ordinary texture. The cache is keyed by the gradient and the area
+ * rendered, so toolkits redrawing the same widget background only pay for
+ * the gradient once.
+ */
+Bool
+viaExaCheckSourcePict(PicturePtr pPict)
 {
-    char format[20];
-    char size[20];
+    switch (pPict->pSourcePict->type) {
+        case SourcePictTypeSolidFill:
+        case SourcePictTypeLinear:
+        case SourcePictTypeRadial:
+        case SourcePictTypeConical:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
 
-    if (!pict) {
-        snprintf(string, n, "None");
-        return;
+static CARD32
+viaExaHashBytes(CARD32 hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--)
+        hash = (hash ^ *p++) * 16777619U;
+    return hash;
+}
+
+static unsigned char *
+viaExaKeyPut(unsigned char *p, const void *data, size_t len)
+{
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/*
+ * Serialize everything the gradient pixels depend on into gradKey, and
+ * hash it into gradHash. Cache slots keep a copy of the key, so that a
+ * hash collision can't hand out another gradient.
+ */
+static Bool
+viaExaGradientKey(VIAPtr pVia, PicturePtr pPict)
+{
+    SourcePictPtr pSource = pPict->pSourcePict;
+    size_t stops = pSource->gradient.nstops *
+                   sizeof(*pSource->gradient.stops);
+    size_t size = sizeof(*pSource) + stops + sizeof(Bool) +
+                  sizeof(*pPict->transform) + sizeof(pPict->repeatType) +
+                  sizeof(pPict->filter);
+    Bool transform = (pPict->transform != NULL);
+    unsigned char *p;
+
+    if (size > pVia->gradKeySize) {
+        p = realloc(pVia->gradKey, size);
+        if (!p)
+            return FALSE;
+        pVia->gradKey = p;
+        pVia->gradKeySize = size;
     }
 
-    switch (pict->format) {
-        case PICT_x8r8g8b8:
-            snprintf(format, 20, "RGB8888");
-            break;
-        case PICT_a8r8g8b8:
-            snprintf(format, 20, "ARGB8888");
-            break;
-        case PICT_r5g6b5:
-            snprintf(format, 20, "RGB565  ");
+    p = viaExaKeyPut(pVia->gradKey, &pSource->type, sizeof(pSource->type));
+    switch (pSource->type) {
+        case SourcePictTypeLinear:
+            p = viaExaKeyPut(p, &pSource->linear.p1,
+                             sizeof(pSource->linear.p1));
+            p = viaExaKeyPut(p, &pSource->linear.p2,
+                             sizeof(pSource->linear.p2));
             break;
-        case PICT_x1r5g5b5:
-            snprintf(format, 20, "RGB555  ");
-            break;
-        case PICT_a8:
-            snprintf(format, 20, "A8      ");
-            break;
-        case PICT_a1:
-            snprintf(format, 20, "A1      ");
+        case SourcePictTypeRadial:
+            p = viaExaKeyPut(p, &pSource->radial.c1,
+                             sizeof(pSource->radial.c1));
+            p = viaExaKeyPut(p, &pSource->radial.c2,
+                             sizeof(pSource->radial.c2));
             break;
-        default:
-            snprintf(format, 20, "0x%x", (int)pict->format);
+        case SourcePictTypeConical:
+            p = viaExaKeyPut(p, &pSource->conical.center,
+                             sizeof(pSource->conical.center));
+            p = viaExaKeyPut(p, &pSource->conical.angle,
+                             sizeof(pSource->conical.angle));
             break;
     }
+    p = viaExaKeyPut(p, &pSource->gradient.nstops,
+                     sizeof(pSource->gradient.nstops));
+    p = viaExaKeyPut(p, pSource->gradient.stops, stops);
+    p = viaExaKeyPut(p, &transform, sizeof(transform));
+    if (transform)
+        p = viaExaKeyPut(p, pPict->transform, sizeof(*pPict->transform));
+    p = viaExaKeyPut(p, &pPict->repeatType, sizeof(pPict->repeatType));
+    p = viaExaKeyPut(p, &pPict->filter, sizeof(pPict->filter));
+
+    pVia->gradKeyLen = p - pVia->gradKey;
+    pVia->gradHash = viaExaHashBytes(2166136261U, pVia->gradKey,
+                                     pVia->gradKeyLen);
+    return TRUE;
+}
 
-    if (pict->pDrawable) {
-       snprintf(size, 20, "%dx%d%s", pict->pDrawable->width,
-                pict->pDrawable->height, pict->repeat ? " R" : "");
+static Bool
+viaExaGradientInit(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    int i;
 
-       snprintf(string, n, "0x%lx: fmt %s (%s)", (long)pict->pDrawable, format,
-                size);
+    if (pVia->gradBuffer)
+        return TRUE;
+
+    pVia->gradBuffer = drm_bo_alloc(pScrn,
+                                    VIA_GRADIENT_SLOTS * VIA_GRADIENT_SLOT_SIZE,
+                                    32, TTM_PL_FLAG_VRAM, VIA_BO_EXA);
+    if (!pVia->gradBuffer)
+        return FALSE;
+
+    if (!drm_bo_map(pScrn, pVia->gradBuffer)) {
+        drm_bo_free(pScrn, pVia->gradBuffer);
+        pVia->gradBuffer = NULL;
+        return FALSE;
+    }
+
+    for (i = 0; i < VIA_GRADIENT_SLOTS; i++) {
+        pVia->gradSlots[i].height = 0;
+        pVia->gradSlots[i].key = NULL;
+        pVia->gradSlots[i].keyLen = 0;
+        pVia->gradSlots[i].lastUse = 0;
+        pVia->gradSlots[i].sync = -1;
+        pVia->gradSlots[i].busy = FALSE;
     }
+    pVia->gradCount = 0;
+    return TRUE;
 }
 
-void
-viaExaPrintCompositeInfo(char *info, CARD8 op, PicturePtr pSrc, PicturePtr pMask,
-                        PicturePtr pDst)
+/*
+ * Set up the source of a composite for a picture without a drawable.
+ */
+Bool
+viaExaPrepareSourcePict(ScrnInfoPtr pScrn, PicturePtr pPict)
 {
-    char sop[20];
-    char srcdesc[40], maskdesc[40], dstdesc[40];
+    VIAPtr pVia = VIAPTR(pScrn);
 
-    switch (op) {
-	case PictOpClear:
-		sprintf(sop, "PictOpClear ");
-		break;
-	case PictOpSrc:
-		sprintf(sop, "PictOpSrc ");
-		break;
-	case PictOpDst:
-		sprintf(sop, "PictOpDst ");
-		break;
-	case PictOpOver:
-		sprintf(sop, "PictOpOver ");
-		break;
-	case PictOpOutReverse:
-		sprintf(sop, "PictOpOutReverse ");
-		break;
-	case PictOpAdd:
-		sprintf(sop, "PictOpAdd ");
-		break;
-	default:
-		sprintf(sop, "PictOp%d ", op);
+    if (pPict->pSourcePict->type == SourcePictTypeSolidFill) {
+        pVia->srcSolid = pPict->pSourcePict->solidFill.color;
+        pVia->srcP = &pVia->srcSolid;
+        pVia->srcFormat = PICT_a8r8g8b8;
+        return TRUE;
     }
 
-    viaExaCompositePictDesc(pSrc, srcdesc, 40);
-    viaExaCompositePictDesc(pMask, maskdesc, 40);
-    viaExaCompositePictDesc(pDst, dstdesc, 40);
+    if (!viaExaGradientInit(pScrn) || !viaExaGradientKey(pVia, pPict))
+        return FALSE;
 
-    ErrorF("Composite fallback: %s, \n"
-           "                    op %s, \n"
-           "                    src  %s, \n"
-           "                    mask %s, \n"
-           "                    dst  %s, \n", info, sop, srcdesc, maskdesc, dstdesc);
+    /* The pixman image is only created on the first cache miss. */
+    pVia->gradPict = pPict;
+    pVia->gradImage = NULL;
+    return TRUE;
 }
-#endif /* VIA_DEBUG_COMPOSITE */
 
 /*
- * Wait for acceleration engines idle. An expensive way to sync.
+ * Find or render the given area of the current gradient.
  */
-void
-viaAccelSync(ScrnInfoPtr pScrn)
+static ViaGradientSlot *
+viaExaGradientSlot(ScrnInfoPtr pScrn, int x, int y, int width, int height,
+                   unsigned pitch)
 {
     VIAPtr pVia = VIAPTR(pScrn);
-    int loop = 0;
+    ScreenPtr pScreen = pScrn->pScreen;
+    ViaGradientSlot *slot, *victim = pVia->gradSlots;
+    pixman_image_t *dst;
+    unsigned char *key;
+    int i, xoff = 0, yoff = 0;
+
+    for (i = 0; i < VIA_GRADIENT_SLOTS; i++) {
+        slot = pVia->gradSlots + i;
+        if (slot->height && slot->hash == pVia->gradHash &&
+            slot->x == x && slot->y == y &&
+            slot->width == width && slot->height == height &&
+            slot->keyLen == pVia->gradKeyLen &&
+            !memcmp(slot->key, pVia->gradKey, pVia->gradKeyLen))
+            goto found;
+        if (slot->lastUse < victim->lastUse)
+            victim = slot;
+    }
+    slot = victim;
 
-    mem_barrier();
+    /* Don't overwrite a slot the 3D engine may still be reading. */
+    if (slot->busy) {
+        int marker = pVia->exaDriverPtr->MarkSync(pScreen);
 
-    switch (pVia->Chipset) {
-        case VIA_VX800:
-        case VIA_VX855:
-        case VIA_VX900:
-            while ((VIAGETREG(VIA_REG_STATUS) &
-                    (VIA_CMD_RGTR_BUSY_H5 | VIA_2D_ENG_BUSY_H5 | VIA_3D_ENG_BUSY_H5))
-                   && (loop++ < MAXLOOP)) ;
-            break;
-        case VIA_P4M890:
-        case VIA_K8M890:
-        case VIA_P4M900:
-            while ((VIAGETREG(VIA_REG_STATUS) &
-                    (VIA_CMD_RGTR_BUSY | VIA_2D_ENG_BUSY | VIA_3D_ENG_BUSY))
-                   && (loop++ < MAXLOOP)) ;
-            break;
-        default:
-            while (!(VIAGETREG(VIA_REG_STATUS) & VIA_VR_QUEUE_EMPTY)
-                   && (loop++ < MAXLOOP)) ;
+        pVia->exaDriverPtr->WaitMarker(pScreen, marker);
+        for (i = 0; i < VIA_GRADIENT_SLOTS; i++) {
+            pVia->gradSlots[i].busy = FALSE;
+            pVia->gradSlots[i].sync = -1;
+        }
+    } else if (slot->sync >= 0) {
+        pVia->exaDriverPtr->WaitMarker(pScreen, slot->sync);
+    }
+    slot->sync = -1;
+    slot->height = 0;
 
-            while ((VIAGETREG(VIA_REG_STATUS) &
-                    (VIA_CMD_RGTR_BUSY | VIA_2D_ENG_BUSY | VIA_3D_ENG_BUSY))
-                   && (loop++ < MAXLOOP)) ;
-            break;
+    if (!pVia->gradImage) {
+        pVia->gradImage = image_from_pict(pVia->gradPict, FALSE, &xoff, &yoff);
+        if (!pVia->gradImage)
+            return NULL;
     }
+
+    if (slot->keyLen < pVia->gradKeyLen) {
+        key = realloc(slot->key, pVia->gradKeyLen);
+        if (!key)
+            return NULL;
+        slot->key = key;
+    }
+
+    dst = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
+                                   (uint32_t *) ((char *)
+                                   pVia->gradBuffer->ptr +
+                                   (slot - pVia->gradSlots) *
+                                   VIA_GRADIENT_SLOT_SIZE), pitch);
+    if (!dst)
+        return NULL;
+    pixman_image_composite(PIXMAN_OP_SRC, pVia->gradImage, NULL, dst,
+                           x + xoff, y + yoff, 0, 0, 0, 0, width, height);
+    pixman_image_unref(dst);
+
+    memcpy(slot->key, pVia->gradKey, pVia->gradKeyLen);
+    slot->keyLen = pVia->gradKeyLen;
+    slot->hash = pVia->gradHash;
+    slot->x = x;
+    slot->y = y;
+    slot->width = width;
+    slot->height = height;
+
+found:
+    slot->lastUse = ++pVia->gradCount;
+    slot->busy = TRUE;
+    return slot;
 }
 
 /*
- * Wait for the value to get blitted, or in the PCI case for engine idle.
+ * Composite a rectangle with the current gradient as source, one cache
+ * slot sized band at a time. Texture unit 0 is the gradient, the mask, if
+ * any, stays on unit 1 as set up by PrepareComposite.
  */
-static void
-viaAccelWaitMarker(ScreenPtr pScreen, int marker)
+void
+viaExaGradientComposite(ScrnInfoPtr pScrn, int srcX, int srcY,
+                        int maskX, int maskY, int dstX, int dstY,
+                        int width, int height)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     VIAPtr pVia = VIAPTR(pScrn);
-    CARD32 uMarker = marker;
+    Via3DState *v3d = &pVia->v3d;
+    unsigned pitch = ALIGN_TO(width << 2, 32);
+    int rows = VIA_GRADIENT_SLOT_SIZE / pitch;
+    ViaGradientSlot *slot;
+    CARD32 wOrder, hOrder;
+    int y, h;
+
+    viaOrder(width, &wOrder);
+
+    for (y = 0; y < height; y += rows) {
+        h = min(rows, height - y);
+        slot = viaExaGradientSlot(pScrn, srcX, srcY + y, width, h, pitch);
+        if (!slot) {
+            ErrorF("Unable to render gradient source picture.\n");
+            return;
+        }
 
-    if (pVia->agpDMA) {
-        while ((pVia->lastMarkerRead - uMarker) > (1 << 24))
-            pVia->lastMarkerRead = *(CARD32 *) pVia->markerBuf;
-    } else {
-        viaAccelSync(pScrn);
+        viaOrder(h, &hOrder);
+        v3d->setTexture(v3d, 0, pVia->gradBuffer->offset +
+                        (slot - pVia->gradSlots) * VIA_GRADIENT_SLOT_SIZE,
+                        pitch, TRUE, 1 << wOrder, 1 << hOrder, PICT_a8r8g8b8,
+                        via_single, via_single, pVia->gradMode, FALSE);
+        v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+        v3d->emitQuad(v3d, &pVia->cb, dstX, dstY + y, 0, 0, maskX, maskY + y,
+                      width, h);
     }
 }
 
-#ifdef HAVE_DRI
-static int
-viaAccelDMADownload(ScrnInfoPtr pScrn, unsigned long fbOffset,
-                    unsigned srcPitch, unsigned char *dst,
-                    unsigned dstPitch, unsigned w, unsigned h)
+/*
+ * Fence the gradient slots read by this composite and drop the gradient.
+ */
+void
+viaExaDoneSourcePict(ScrnInfoPtr pScrn)
 {
     VIAPtr pVia = VIAPTR(pScrn);
-    drm_via_dmablit_t blit[2], *curBlit;
-    unsigned char *sysAligned = NULL;
-    Bool doSync[2], useBounceBuffer;
-    unsigned pitch, numLines[2];
-    int curBuf, err, i, ret, blitHeight;
+    int marker, i;
 
-    ret = 0;
+    if (!pVia->gradPict)
+        return;
 
-    useBounceBuffer = (((unsigned long)dst & 15) || (dstPitch & 15));
-    doSync[0] = FALSE;
-    doSync[1] = FALSE;
-    curBuf = 1;
-    blitHeight = h;
-    pitch = dstPitch;
-    if (useBounceBuffer) {
-        pitch = ALIGN_TO(dstPitch, 16);
-        blitHeight = VIA_DMA_DL_SIZE / pitch;
+    marker = pVia->exaDriverPtr->MarkSync(pScrn->pScreen);
+    for (i = 0; i < VIA_GRADIENT_SLOTS; i++) {
+        if (pVia->gradSlots[i].busy) {
+            pVia->gradSlots[i].sync = marker;
+            pVia->gradSlots[i].busy = FALSE;
+        }
     }
 
-    while (doSync[0] || doSync[1] || h != 0) {
-        curBuf = 1 - curBuf;
-        curBlit = &blit[curBuf];
-        if (doSync[curBuf]) {
-
-            do {
-                err = drmCommandWrite(pVia->drmmode.fd, DRM_VIA_BLIT_SYNC,
-                                      &curBlit->sync, sizeof(curBlit->sync));
-            } while (err == -EAGAIN);
-
-            if (err)
-                return err;
-
-            doSync[curBuf] = FALSE;
-            if (useBounceBuffer) {
-                for (i = 0; i < numLines[curBuf]; ++i) {
-                    memcpy(dst, curBlit->mem_addr, w);
-                    dst += dstPitch;
-                    curBlit->mem_addr += pitch;
-                }
-            }
-        }
+    if (pVia->gradImage)
+        free_pixman_pict(pVia->gradPict, pVia->gradImage);
+    pVia->gradImage = NULL;
+    pVia->gradPict = NULL;
+}
 
-        if (h == 0)
-            continue;
+/*
+ * Transformed sources.
+ *
+ * Only affine transforms that keep the axes, i.e. scaling, flips and
+ * multiples of 90 degrees, are done on the 3D engine. The area of the
+ * source outside the picture must read as transparent, which the texture
+ * units cannot do, so the composite is clipped to where the source lies
+ * inside the picture instead. Operators that don't leave the destination
+ * alone where the source is transparent get the clipped away strips drawn
+ * with a transparent solid colour. RandR rotation composites with
+ * PictOpSrc and never has such strips.
+ */
+Bool
+viaExaCheckTransform(int op, PicturePtr pPict)
+{
+    PictTransformPtr t = pPict->transform;
 
-        curBlit->num_lines = (h > blitHeight) ? blitHeight : h;
-        h -= curBlit->num_lines;
-        numLines[curBuf] = curBlit->num_lines;
+    if (!t || !pPict->pDrawable)
+        return TRUE;
 
-        sysAligned =
-                (unsigned char *)pVia->dBounce + (curBuf * VIA_DMA_DL_SIZE);
-        sysAligned = (unsigned char *)
-                ALIGN_TO((unsigned long)sysAligned, 16);
+    /* One-pixel repeat pictures are a constant colour anyway. */
+    if (pPict->repeat && pPict->pDrawable->width == 1 &&
+        pPict->pDrawable->height == 1)
+        return TRUE;
 
-        curBlit->mem_addr = (useBounceBuffer) ? sysAligned : dst;
-        curBlit->line_length = w;
-        curBlit->mem_stride = pitch;
-        curBlit->fb_addr = fbOffset;
-        curBlit->fb_stride = srcPitch;
-        curBlit->to_fb = 0;
-        fbOffset += curBlit->num_lines * srcPitch;
+    if (pPict->repeat)
+        return FALSE;
 
-        do {
-            err = drmCommandWriteRead(pVia->drmmode.fd, DRM_VIA_DMA_BLIT, curBlit,
-                                      sizeof(*curBlit));
-        } while (err == -EAGAIN);
+    if (t->matrix[2][0] || t->matrix[2][1] ||
+        t->matrix[2][2] != pixman_fixed_1)
+        return FALSE;
 
-        if (err) {
-            ret = err;
-            h = 0;
-            continue;
-        }
+    if (!(t->matrix[0][1] == 0 && t->matrix[1][0] == 0 &&
+          t->matrix[0][0] && t->matrix[1][1]) &&
+        !(t->matrix[0][0] == 0 && t->matrix[1][1] == 0 &&
+          t->matrix[0][1] && t->matrix[1][0]))
+        return FALSE;
 
-        doSync[curBuf] = TRUE;
+    switch (pPict->filter) {
+        case PictFilterNearest:
+        case PictFilterBilinear:
+        case PictFilterFast:
+        case PictFilterGood:
+        case PictFilterBest:
+            break;
+        default:
+            return FALSE;
     }
 
-    return ret;
+    return TRUE;
 }
 
 /*
- * Use PCI DMA if we can. If the system alignments don't match, we're using
- * an aligned bounce buffer for pipelined PCI DMA and memcpy.
- * Throughput for large transfers is around 65 MB/s.
+ * Set up texture unit tex for a transformed source picture, and compute the
+ * area of composite source coordinates that maps inside the picture.
  */
-static Bool
-viaExaDownloadFromScreen(PixmapPtr pSrc, int x, int y, int w, int h,
-                         char *dst, int dst_pitch)
+void
+viaExaPrepareTransform(ScrnInfoPtr pScrn, int op, PicturePtr pPict,
+                       PixmapPtr pPix, int tex)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pSrc->drawable.pScreen);
-    unsigned wBytes = (pSrc->drawable.bitsPerPixel * w + 7) >> 3;
-    unsigned srcPitch = exaGetPixmapPitch(pSrc), srcOffset;
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    PictTransformPtr t = pPict->transform;
+    double a, b, c, d, e, f, det, x1, y1, x2, y2, tmp;
+    double offX = 0., offY = 0.;
+    float m[6];
+
+    /*
+     * EXA adds the window origin to the source coordinates before the
+     * transform should be applied, so take it out and add it back after.
+     */
+    if (pPict->pDrawable->type == DRAWABLE_WINDOW) {
+        offX = pPict->pDrawable->x;
+        offY = pPict->pDrawable->y;
+#ifdef COMPOSITE
+        offX -= pPix->screen_x;
+        offY -= pPix->screen_y;
+#endif
+    }
+
+    a = pixman_fixed_to_double(t->matrix[0][0]);
+    b = pixman_fixed_to_double(t->matrix[0][1]);
+    d = pixman_fixed_to_double(t->matrix[1][0]);
+    e = pixman_fixed_to_double(t->matrix[1][1]);
+    c = pixman_fixed_to_double(t->matrix[0][2]) + offX - a * offX - b * offY;
+    f = pixman_fixed_to_double(t->matrix[1][2]) + offY - d * offX - e * offY;
+
+    m[0] = a;
+    m[1] = b;
+    m[2] = c;
+    m[3] = d;
+    m[4] = e;
+    m[5] = f;
+    v3d->setTexTransform(v3d, tex, m);
+    v3d->setTexFilter(v3d, tex, pPict->filter != PictFilterNearest &&
+                      pPict->filter != PictFilterFast);
+
+    /* Map the corners of the picture back through the inverse transform. */
+    det = a * e - b * d;
+    x1 = offX - c;
+    y1 = offY - f;
+    x2 = offX + pPict->pDrawable->width - c;
+    y2 = offY + pPict->pDrawable->height - f;
+    tmp = (e * x1 - b * y1) / det;
+    y1 = (a * y1 - d * x1) / det;
+    x1 = tmp;
+    tmp = (e * x2 - b * y2) / det;
+    y2 = (a * y2 - d * x2) / det;
+    x2 = tmp;
+    if (x1 > x2) {
+        tmp = x1;
+        x1 = x2;
+        x2 = tmp;
+    }
+    if (y1 > y2) {
+        tmp = y1;
+        y1 = y2;
+        y2 = tmp;
+    }
+
+    /* Keep the pixels whose centers map inside. */
+    pVia->srcTransClip.x1 = max(ceil(x1 - 0.5), MINSHORT);
+    pVia->srcTransClip.y1 = max(ceil(y1 - 0.5), MINSHORT);
+    pVia->srcTransClip.x2 = min(floor(x2 - 0.5) + 1., MAXSHORT);
+    pVia->srcTransClip.y2 = min(floor(y2 - 0.5) + 1., MAXSHORT);
+    pVia->srcTransformed = TRUE;
+
+    switch (op) {
+        case PictOpOver:
+        case PictOpOverReverse:
+        case PictOpOutReverse:
+        case PictOpAtop:
+        case PictOpXor:
+        case PictOpAdd:
+            pVia->srcTransClear = FALSE;
+            break;
+        default:
+            pVia->srcTransClear = TRUE;
+            break;
+    }
+}
+
+/*
+ * Composite a rectangle with a transparent source, using the blend state
+ * of the current composite without its textures.
+ */
+static void
+viaExaTransparentRect(ScrnInfoPtr pScrn, int x, int y, int w, int h)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    int numTextures = v3d->numTextures;
+    CARD32 color = v3d->solidColor;
+    CARD32 alpha = v3d->solidAlpha;
+
+    if (w <= 0 || h <= 0)
+        return;
+
+    v3d->setFlags(v3d, 0, v3d->writeAlpha, v3d->writeColor, v3d->blend);
+    v3d->setDrawing(v3d, v3d->rop, v3d->planeMask, 0x00000000, 0x00);
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+    v3d->emitQuad(v3d, &pVia->cb, x, y, 0, 0, 0, 0, w, h);
+
+    v3d->setFlags(v3d, numTextures, v3d->writeAlpha, v3d->writeColor,
+                  v3d->blend);
+    v3d->setDrawing(v3d, v3d->rop, v3d->planeMask, color, alpha);
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+}
+
+/*
+ * Clip a composite rectangle with a transformed source to the area set up
+ * by viaExaPrepareTransform, drawing the strips clipped away if the
+ * operator needs it. Returns FALSE if nothing is left.
+ */
+Bool
+viaExaClipTransform(ScrnInfoPtr pScrn, int *srcX, int *srcY, int *maskX,
+                    int *maskY, int *dstX, int *dstY, int *width, int *height)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    int x1 = max(*srcX, pVia->srcTransClip.x1);
+    int y1 = max(*srcY, pVia->srcTransClip.y1);
+    int x2 = min(*srcX + *width, pVia->srcTransClip.x2);
+    int y2 = min(*srcY + *height, pVia->srcTransClip.y2);
+    int dx = *dstX - *srcX, dy = *dstY - *srcY;
+
+    if (x1 >= x2 || y1 >= y2) {
+        if (pVia->srcTransClear)
+            viaExaTransparentRect(pScrn, *dstX, *dstY, *width, *height);
+        return FALSE;
+    }
+
+    if (pVia->srcTransClear) {
+        viaExaTransparentRect(pScrn, *dstX, *dstY, *width, y1 - *srcY);
+        viaExaTransparentRect(pScrn, *dstX, y2 + dy, *width,
+                              *srcY + *height - y2);
+        viaExaTransparentRect(pScrn, *dstX, y1 + dy, x1 - *srcX, y2 - y1);
+        viaExaTransparentRect(pScrn, x2 + dx, y1 + dy, *srcX + *width - x2,
+                              y2 - y1);
+    }
+
+    *maskX += x1 - *srcX;
+    *dstX += x1 - *srcX;
+    *maskY += y1 - *srcY;
+    *dstY += y1 - *srcY;
+    *srcX = x1;
+    *srcY = y1;
+    *width = x2 - x1;
+    *height = y2 - y1;
+    return TRUE;
+}
+
+/*
+ * A8 destinations.
+ *
+ * The 3D engine cannot render to 8 bit surfaces, so an A8 pixmap is drawn
+ * as an ARGB8888 surface of a quarter of the width, in four passes. Pass k
+ * writes byte lane k only, selected with the plane mask, and samples the
+ * textures at every fourth pixel starting at k. The source colour is
+ * replaced by its alpha, so all four lanes compute the alpha result.
+ *
+ * Lanes 0 to 2 see the colour of a neighbouring pixel as their destination
+ * alpha, so only operators that don't read the destination alpha work.
+ */
+Bool
+viaExaCheckA8Dst(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture)
+{
+    switch (op) {
+        case PictOpClear:
+        case PictOpSrc:
+        case PictOpDst:
+        case PictOpOver:
+        case PictOpOutReverse:
+        case PictOpAdd:
+            break;
+        default:
+            return FALSE;
+    }
+
+    if (pSrcPicture->pDrawable) {
+        if (pSrcPicture->transform ||
+            !PICT_FORMAT_A(pSrcPicture->format))
+            return FALSE;
+    } else if (pSrcPicture->pSourcePict->type != SourcePictTypeSolidFill) {
+        return FALSE;
+    }
+
+    if (pMaskPicture && pMaskPicture->componentAlpha)
+        return FALSE;
+
+    return TRUE;
+}
+
+void
+viaExaCompositeA8(ScrnInfoPtr pScrn, int srcX, int srcY, int maskX,
+                  int maskY, int dstX, int dstY, int width, int height)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    float m[6] = { 4.f, 0.f, 0.f, 0.f, 1.f, 0.f };
+    CARD32 col, alpha = 0xFF;
+    int k, x1, x2;
+
+    if (pVia->srcP) {
+        viaPixelARGB8888(pVia->srcFormat, pVia->srcP, &col);
+        alpha = col >> 24;
+        srcX = maskX;
+        srcY = maskY;
+    }
+    col = alpha | (alpha << 8) | (alpha << 16);
+
+    for (k = 0; k < 4; k++) {
+        /* The ARGB pixels whose lane k is inside the rectangle. */
+        x1 = (dstX - k + 3) >> 2;
+        x2 = (dstX + width - k + 3) >> 2;
+        if (x2 <= x1)
+            continue;
+
+        v3d->setDrawing(v3d, 0x0c, 0xFF << (k << 3), col, alpha);
+        v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+
+        /* Hit the texel centers of every fourth pixel. */
+        m[2] = srcX - dstX + k - 1.5f;
+        v3d->setTexTransform(v3d, 0, m);
+        m[2] = maskX - dstX + k - 1.5f;
+        v3d->setTexTransform(v3d, 1, m);
+        v3d->emitQuad(v3d, &pVia->cb, x1, dstY, x1, srcY, x1, maskY,
+                      x2 - x1, height);
+    }
+}
+
+/*
+ * Large pixmaps.
+ *
+ * The 3D engine can't draw beyond 2047 in either direction. Destination
+ * rectangles are split at multiples of VIA_TILE, and each part is drawn
+ * with the destination base moved to the top left corner of its square,
+ * so that its coordinates start over at 0. These bases are aligned to at
+ * least 2 kB. Operations inside the first square, which is all of them on
+ * small pixmaps, don't touch the destination at all.
+ */
+void
+viaExaTileInit(ViaTileIter *t, int x, int y, int width, int height)
+{
+    t->x1 = x;
+    t->y1 = y;
+    t->x2 = x + width;
+    t->y2 = y + height;
+    t->w = 0;
+}
+
+/*
+ * Move to the next part, left to right and top to bottom. Returns FALSE
+ * when there are no more.
+ */
+Bool
+viaExaTileNext(ViaTileIter *t)
+{
+    if (!t->w) {
+        t->x = t->x1;
+        t->y = t->y1;
+    } else {
+        t->x += t->w;
+        if (t->x >= t->x2) {
+            t->x = t->x1;
+            t->y += t->h;
+        }
+    }
+
+    if (t->x >= t->x2 || t->y >= t->y2)
+        return FALSE;
+
+    t->w = min(t->x2, (t->x | (VIA_TILE - 1)) + 1) - t->x;
+    t->h = min(t->y2, (t->y | (VIA_TILE - 1)) + 1) - t->y;
+    return TRUE;
+}
+
+/*
+ * Set the 3D destination for an operation on pDst, starting in the first
+ * square. The clip rectangle is emitted with viaExaTile3DClip after the
+ * rest of the state.
+ */
+void
+viaExaTile3DSetup(ScrnInfoPtr pScrn, PixmapPtr pDst, int format, Bool a8)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    ViaTile3D *tile = &pVia->tile3D;
+
+    tile->offset = viaExaPixmapOffset(pDst);
+    tile->pitch = exaGetPixmapPitch(pDst);
+    tile->cpp = pDst->drawable.bitsPerPixel >> 3;
+    tile->format = format;
+    tile->width = pDst->drawable.width;
+    tile->height = pDst->drawable.height;
+    tile->a8 = a8;
+    tile->x = 0;
+    tile->y = 0;
+    pVia->v3d.setDestination(&pVia->v3d, tile->offset, tile->pitch, format);
+}
+
+void
+viaExaTile3DClip(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    ViaTile3D *tile = &pVia->tile3D;
+    int w = min(tile->width - tile->x, VIA_TILE);
+    int h = min(tile->height - tile->y, VIA_TILE);
+
+    if (tile->a8)
+        w = (w + 3) >> 2;
+    pVia->v3d.emitClipRect(&pVia->v3d, &pVia->cb, 0, 0, w, h);
+}
+
+/*
+ * Make (x, y) relative to its square, moving the 3D destination there
+ * first if it's drawing to another one. Queued quads are sent before.
+ */
+void
+viaExaTile3D(ScrnInfoPtr pScrn, int *x, int *y)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    ViaTile3D *tile = &pVia->tile3D;
+    Via3DState *v3d = &pVia->v3d;
+    int tx = *x & ~(VIA_TILE - 1);
+    int ty = *y & ~(VIA_TILE - 1);
+
+    *x -= tx;
+    *y -= ty;
+    if (tx == tile->x && ty == tile->y)
+        return;
+
+    tile->x = tx;
+    tile->y = ty;
+    v3d->setDestination(v3d, tile->offset + ty * tile->pitch +
+                        tx * tile->cpp, tile->pitch, tile->format);
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+    viaExaTile3DClip(pScrn);
+}
+
+/*
+ * EXA compacts its offscreen heap while the server is idle, by copying
+ * pixmaps into free space in front of them. Source and destination are
+ * then different pixmaps in overlapping memory, with the same pitch, and
+ * the copy direction has to follow their offsets rather than xdir/ydir.
+ */
+Bool
+viaExaCopyOverlap(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int *xdir,
+                  int *ydir)
+{
+    unsigned long srcOffset = viaExaPixmapOffset(pSrcPixmap);
+    unsigned long dstOffset = viaExaPixmapOffset(pDstPixmap);
+    unsigned long srcPitch = exaGetPixmapPitch(pSrcPixmap);
+    unsigned long dstPitch = exaGetPixmapPitch(pDstPixmap);
+
+    if (pSrcPixmap == pDstPixmap)
+        return TRUE;
+    if (srcOffset + srcPitch * pSrcPixmap->drawable.height <= dstOffset ||
+        dstOffset + dstPitch * pDstPixmap->drawable.height <= srcOffset)
+        return TRUE;
+
+    if (srcPitch != dstPitch)
+        return FALSE;
+
+    *xdir = *ydir = (dstOffset < srcOffset) ? 1 : -1;
+    return TRUE;
+}
+
+/*
+ * Copies between pixmaps of different depths.
+ *
+ * The 2D engine only copies between surfaces of the same depth, so these
+ * are drawn as textured quads on the 3D engine, which converts the pixel
+ * format on the way. Copies from the AGP pixmap pool go this way too.
+ * Copies to a lower depth are dithered if the ExaDither option is set.
+ */
+static Bool
+viaExaPixmapFormat(PixmapPtr pPix, int *format)
+{
+    switch (pPix->drawable.bitsPerPixel) {
+        case 16:
+            *format = (pPix->drawable.depth == 15) ?
+                PICT_x1r5g5b5 : PICT_r5g6b5;
+            return TRUE;
+        case 32:
+            *format = (pPix->drawable.depth == 32) ?
+                PICT_a8r8g8b8 : PICT_x8r8g8b8;
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+Bool
+viaExaPrepareCopy3D(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int alu,
+                    Pixel planeMask)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDstPixmap->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    CARD32 modeMask, width, height;
+    int srcFormat, dstFormat;
+    unsigned long offset;
+    Bool isAGP;
+
+    if (pVia->noComposite || alu != GXcopy ||
+        viaExaIsAGPPool(pDstPixmap))
+        return FALSE;
+
+    modeMask = (pDstPixmap->drawable.bitsPerPixel == 32) ?
+        0xFFFFFFFF : (1 << pDstPixmap->drawable.bitsPerPixel) - 1;
+    if ((planeMask & modeMask) != modeMask)
+        return FALSE;
+
+    if (!viaExaPixmapFormat(pSrcPixmap, &srcFormat) ||
+        !viaExaPixmapFormat(pDstPixmap, &dstFormat))
+        return FALSE;
+    if (!v3d->texSupported(srcFormat) || !v3d->dstSupported(dstFormat))
+        return FALSE;
+
+    /* Largest texture the 3D engine can sample. */
+    if (pSrcPixmap->drawable.width > VIA_TILE ||
+        pSrcPixmap->drawable.height > VIA_TILE)
+        return FALSE;
+
+    offset = viaExaPixmapOffset(pSrcPixmap);
+    isAGP = viaIsAGP(pVia, pSrcPixmap, &offset);
+    if (!isAGP && !viaExaIsOffscreen(pSrcPixmap))
+        return FALSE;
+
+    viaOrder(pSrcPixmap->drawable.width, &width);
+    viaOrder(pSrcPixmap->drawable.height, &height);
+
+    viaExaTile3DSetup(pScrn, pDstPixmap, dstFormat, FALSE);
+    v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0xFF);
+    v3d->setFlags(v3d, 1, TRUE, TRUE, FALSE);
+    if (!v3d->setTexture(v3d, 0, offset, exaGetPixmapPitch(pSrcPixmap),
+                         pVia->nPOT[0], 1 << width, 1 << height, srcFormat,
+                         via_single, via_single, via_src, isAGP))
+        return FALSE;
+    v3d->setDither(v3d, pVia->exaDither &&
+                   (pDstPixmap->drawable.depth < pSrcPixmap->drawable.depth));
+
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+    viaExaTile3DClip(pScrn);
+
+    pVia->copy3D = TRUE;
+    return TRUE;
+}
+
+void
+viaExaCopy3D(ScrnInfoPtr pScrn, int srcX, int srcY, int dstX, int dstY,
+             int width, int height)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    ViaTileIter tile;
+    int x, y;
+
+    viaExaTileInit(&tile, dstX, dstY, width, height);
+    while (viaExaTileNext(&tile)) {
+        x = tile.x;
+        y = tile.y;
+        viaExaTile3D(pScrn, &x, &y);
+        v3d->emitQuad(v3d, &pVia->cb, x, y, srcX + tile.x - dstX,
+                      srcY + tile.y - dstY, 0, 0, tile.w, tile.h);
+    }
+}
+
+void
+viaExaDoneCopy3D(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+
+    v3d->flushQuads(v3d, &pVia->cb);
+    v3d->setDither(v3d, FALSE);
+    pVia->copy3D = FALSE;
+}
+
+#ifdef VIA_DEBUG_COMPOSITE
+void
+viaExaCompositePictDesc(PicturePtr pict, char *string, int n)
+{
+    char format[20];
+    char size[20];
+
+    if (!pict) {
+        snprintf(string, n, "None");
+        return;
+    }
+
+    switch (pict->format) {
+        case PICT_x8r8g8b8:
+            snprintf(format, 20, "RGB8888");
+            break;
+        case PICT_a8r8g8b8:
+            snprintf(format, 20, "ARGB8888");
+            break;
+        case PICT_r5g6b5:
+            snprintf(format, 20, "RGB565  ");
+            break;
+        case PICT_x1r5g5b5:
+            snprintf(format, 20, "RGB555  ");
+            break;
+        case PICT_a8:
+            snprintf(format, 20, "A8      ");
+            break;
+        case PICT_a1:
+            snprintf(format, 20, "A1      ");
+            break;
+        default:
+            snprintf(format, 20, "0x%x", (int)pict->format);
+            break;
+    }
+
+    if (pict->pDrawable) {
+       snprintf(size, 20, "%dx%d%s", pict->pDrawable->width,
+                pict->pDrawable->height, pict->repeat ? " R" : "");
+
+       snprintf(string, n, "0x%lx: fmt %s (%s)", (long)pict->pDrawable, format,
+                size);
+    } else {
+       snprintf(string, n, "source picture, type %d",
+                pict->pSourcePict->type);
+    }
+}
+
+void
+viaExaPrintCompositeInfo(char *info, CARD8 op, PicturePtr pSrc, PicturePtr pMask,
+                        PicturePtr pDst)
+{
+    char sop[20];
+    char srcdesc[40], maskdesc[40], dstdesc[40];
+
+    switch (op) {
+	case PictOpClear:
+		sprintf(sop, "PictOpClear ");
+		break;
+	case PictOpSrc:
+		sprintf(sop, "PictOpSrc ");
+		break;
+	case PictOpDst:
+		sprintf(sop, "PictOpDst ");
+		break;
+	case PictOpOver:
+		sprintf(sop, "PictOpOver ");
+		break;
+	case PictOpOutReverse:
+		sprintf(sop, "PictOpOutReverse ");
+		break;
+	case PictOpAdd:
+		sprintf(sop, "PictOpAdd ");
+		break;
+	default:
+		sprintf(sop, "PictOp%d ", op);
+    }
+
+    viaExaCompositePictDesc(pSrc, srcdesc, 40);
+    viaExaCompositePictDesc(pMask, maskdesc, 40);
+    viaExaCompositePictDesc(pDst, dstdesc, 40);
+
+    ErrorF("Composite fallback: %s, \n"
+           "                    op %s, \n"
+           "                    src  %s, \n"
+           "                    mask %s, \n"
+           "                    dst  %s, \n", info, sop, srcdesc, maskdesc, dstdesc);
+}
+#endif /* VIA_DEBUG_COMPOSITE */
+
+/*
+ * Wait for acceleration engines idle. An expensive way to sync.
+ */
+void
+viaAccelSync(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    int loop = 0;
+
+    mem_barrier();
+
+    switch (pVia->Chipset) {
+        case VIA_VX800:
+        case VIA_VX855:
+        case VIA_VX900:
+            while ((VIAGETREG(VIA_REG_STATUS) &
+                    (VIA_CMD_RGTR_BUSY_H5 | VIA_2D_ENG_BUSY_H5 | VIA_3D_ENG_BUSY_H5))
+                   && (loop++ < MAXLOOP)) ;
+            break;
+        case VIA_P4M890:
+        case VIA_K8M890:
+        case VIA_P4M900:
+            while ((VIAGETREG(VIA_REG_STATUS) &
+                    (VIA_CMD_RGTR_BUSY | VIA_2D_ENG_BUSY | VIA_3D_ENG_BUSY))
+                   && (loop++ < MAXLOOP)) ;
+            break;
+        default:
+            while (!(VIAGETREG(VIA_REG_STATUS) & VIA_VR_QUEUE_EMPTY)
+                   && (loop++ < MAXLOOP)) ;
+
+            while ((VIAGETREG(VIA_REG_STATUS) &
+                    (VIA_CMD_RGTR_BUSY | VIA_2D_ENG_BUSY | VIA_3D_ENG_BUSY))
+                   && (loop++ < MAXLOOP)) ;
+            break;
+    }
+}
+
+/*
+ * Wait for the value to get blitted, or in the PCI case for engine idle.
+ */
+static void
+viaAccelWaitMarker(ScreenPtr pScreen, int marker)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    CARD32 uMarker = marker;
+
+    if (pVia->agpDMA) {
+        while ((pVia->lastMarkerRead - uMarker) > (1 << 24))
+            pVia->lastMarkerRead = *(CARD32 *) pVia->markerBuf;
+    } else {
+        viaAccelSync(pScrn);
+    }
+}
+
+#ifdef HAVE_DRI
+static int
+viaAccelDMADownload(ScrnInfoPtr pScrn, unsigned long fbOffset,
+                    unsigned srcPitch, unsigned char *dst,
+                    unsigned dstPitch, unsigned w, unsigned h)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    drm_via_dmablit_t blit[2], *curBlit;
+    unsigned char *sysAligned = NULL;
+    Bool doSync[2], useBounceBuffer;
+    unsigned pitch, numLines[2];
+    int curBuf, err, i, ret, blitHeight;
+
+    ret = 0;
+
+    useBounceBuffer = (((unsigned long)dst & 15) || (dstPitch & 15));
+    doSync[0] = FALSE;
+    doSync[1] = FALSE;
+    curBuf = 1;
+    blitHeight = h;
+    pitch = dstPitch;
+    if (useBounceBuffer) {
+        pitch = ALIGN_TO(dstPitch, 16);
+        blitHeight = VIA_DMA_DL_SIZE / pitch;
+    }
+
+    while (doSync[0] || doSync[1] || h != 0) {
+        curBuf = 1 - curBuf;
+        curBlit = &blit[curBuf];
+        if (doSync[curBuf]) {
+
+            do {
+                err = drmCommandWrite(pVia->drmmode.fd, DRM_VIA_BLIT_SYNC,
+                                      &curBlit->sync, sizeof(curBlit->sync));
+            } while (err == -EAGAIN);
+
+            if (err)
+                return err;
+
+            doSync[curBuf] = FALSE;
+            if (useBounceBuffer) {
+                for (i = 0; i < numLines[curBuf]; ++i) {
+                    memcpy(dst, curBlit->mem_addr, w);
+                    dst += dstPitch;
+                    curBlit->mem_addr += pitch;
+                }
+            }
+        }
+
+        if (h == 0)
+            continue;
+
+        curBlit->num_lines = (h > blitHeight) ? blitHeight : h;
+        h -= curBlit->num_lines;
+        numLines[curBuf] = curBlit->num_lines;
+
+        sysAligned =
+                (unsigned char *)pVia->dBounce + (curBuf * VIA_DMA_DL_SIZE);
+        sysAligned = (unsigned char *)
+                ALIGN_TO((unsigned long)sysAligned, 16);
+
+        curBlit->mem_addr = (useBounceBuffer) ? sysAligned : dst;
+        curBlit->line_length = w;
+        curBlit->mem_stride = pitch;
+        curBlit->fb_addr = fbOffset;
+        curBlit->fb_stride = srcPitch;
+        curBlit->to_fb = 0;
+        fbOffset += curBlit->num_lines * srcPitch;
+
+        do {
+            err = drmCommandWriteRead(pVia->drmmode.fd, DRM_VIA_DMA_BLIT, curBlit,
+                                      sizeof(*curBlit));
+        } while (err == -EAGAIN);
+
+        if (err) {
+            ret = err;
+            h = 0;
+            continue;
+        }
+
+        doSync[curBuf] = TRUE;
+    }
+
+    return ret;
+}
+
+/*
+ * Use PCI DMA if we can. If the system alignments don't match, we're using
+ * an aligned bounce buffer for pipelined PCI DMA and memcpy.
+ * Throughput for large transfers is around 65 MB/s.
+ */
+static Bool
+viaExaDownloadFromScreen(PixmapPtr pSrc, int x, int y, int w, int h,
+                         char *dst, int dst_pitch)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pSrc->drawable.pScreen);
+    unsigned wBytes = (pSrc->drawable.bitsPerPixel * w + 7) >> 3;
+    unsigned srcPitch = exaGetPixmapPitch(pSrc), srcOffset;
     char *bounceAligned = NULL;
     VIAPtr pVia = VIAPTR(pScrn);
-    unsigned totSize;
+    unsigned totSize;
+
+    if (!w || !h)
+        return TRUE;
+
+    /* Not in video memory; EXA reads it directly. */
+    if (viaExaIsAGPPool(pSrc))
+        return FALSE;
+
+    srcOffset = x * pSrc->drawable.bitsPerPixel;
+    if (srcOffset & 3)
+        return FALSE;
+    srcOffset = viaExaPixmapOffset(pSrc) + y * srcPitch + (srcOffset >> 3);
+
+    totSize = wBytes * h;
+
+    exaWaitSync(pScrn->pScreen);
+    if (totSize < VIA_MIN_DOWNLOAD) {
+        bounceAligned = (char *) drm_bo_map(pScrn, pVia->drmmode.front_bo) + srcOffset;
+
+        while (h--) {
+            memcpy(dst, bounceAligned, wBytes);
+            dst += dst_pitch;
+            bounceAligned += srcPitch;
+        }
+        return TRUE;
+    }
+
+    if (!pVia->directRenderingType)
+        return FALSE;
+
+    if ((srcPitch & 3) || (srcOffset & 3)) {
+        ErrorF("VIA EXA download src_pitch misaligned\n");
+        return FALSE;
+    }
+
+    if (viaAccelDMADownload(pScrn, srcOffset, srcPitch, (unsigned char *)dst,
+                            dst_pitch, wBytes, h))
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * DMA straight from system memory to the frame buffer, without a bounce
+ * copy. The kernel pins the pages for each blit, so the source has to meet
+ * the engine's alignment: 16 bytes for the address and the pitch. Two
+ * blits are kept in flight, and all are finished before returning, since
+ * the caller may reuse the source right away.
+ */
+static int
+viaAccelDMAUpload(ScrnInfoPtr pScrn, unsigned long fbOffset,
+                  unsigned dstPitch, unsigned char *src,
+                  unsigned srcPitch, unsigned w, unsigned h)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    drm_via_dmablit_t blit[2], *curBlit;
+    Bool doSync[2];
+    int curBuf, err, ret, blitHeight;
+
+    ret = 0;
+    doSync[0] = FALSE;
+    doSync[1] = FALSE;
+    curBuf = 1;
+
+    /* The kernel limits the lines and the memory pinned per blit. */
+    blitHeight = (2048 * 2048 * 4) / srcPitch;
+    if (blitHeight > 2048)
+        blitHeight = 2048;
+
+    while (doSync[0] || doSync[1] || h != 0) {
+        curBuf = 1 - curBuf;
+        curBlit = &blit[curBuf];
+        if (doSync[curBuf]) {
+
+            do {
+                err = drmCommandWrite(pVia->drmmode.fd, DRM_VIA_BLIT_SYNC,
+                                      &curBlit->sync, sizeof(curBlit->sync));
+            } while (err == -EAGAIN);
+
+            if (err && !ret)
+                ret = err;
+            doSync[curBuf] = FALSE;
+        }
+
+        if (h == 0)
+            continue;
+
+        curBlit->num_lines = (h > blitHeight) ? blitHeight : h;
+        h -= curBlit->num_lines;
+
+        curBlit->mem_addr = src;
+        curBlit->line_length = w;
+        curBlit->mem_stride = srcPitch;
+        curBlit->fb_addr = fbOffset;
+        curBlit->fb_stride = dstPitch;
+        curBlit->flags = 0;
+        curBlit->to_fb = 1;
+        fbOffset += curBlit->num_lines * dstPitch;
+        src += curBlit->num_lines * srcPitch;
+
+        do {
+            err = drmCommandWriteRead(pVia->drmmode.fd, DRM_VIA_DMA_BLIT, curBlit,
+                                      sizeof(*curBlit));
+        } while (err == -EAGAIN);
+
+        if (err) {
+            ret = err;
+            h = 0;
+            continue;
+        }
+
+        doSync[curBuf] = TRUE;
+    }
+
+    return ret;
+}
+
+/*
+ * Uploads from suitably aligned system memory, such as MIT-SHM segments,
+ * go to the frame buffer by DMA. Everything else is left to EXA's memcpy,
+ * which is as fast as a bounce copy followed by DMA.
+ */
+static Bool
+viaExaUploadToScreen(PixmapPtr pDst, int x, int y, int w, int h, char *src,
+                     int src_pitch)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    unsigned wBytes = (pDst->drawable.bitsPerPixel * w + 7) >> 3;
+    unsigned dstPitch = exaGetPixmapPitch(pDst), dstOffset;
+
+    if (!w || !h)
+        return TRUE;
+
+    /* Not in video memory; EXA writes it directly. */
+    if (viaExaIsAGPPool(pDst))
+        return FALSE;
+
+    if (wBytes * h < VIA_MIN_UPLOAD)
+        return FALSE;
+
+    /* The kernel also refuses strides more than two pages over the width. */
+    if (((unsigned long) src & 15) || (src_pitch & 15) ||
+        (src_pitch - wBytes > 2 * 4096))
+        return FALSE;
+
+    dstOffset = x * pDst->drawable.bitsPerPixel;
+    if (dstOffset & 31)
+        return FALSE;
+    dstOffset = viaExaPixmapOffset(pDst) + y * dstPitch + (dstOffset >> 3);
+    if (dstPitch & 3)
+        return FALSE;
+
+    exaWaitSync(pScrn->pScreen);
+    if (viaAccelDMAUpload(pScrn, dstOffset, dstPitch, (unsigned char *)src,
+                          src_pitch, wBytes, h))
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Upload to framebuffer memory using memcpy to AGP pipelined with a
+ * 3D engine texture operation from AGP to framebuffer. The AGP buffers (2)
+ * should be kept rather small for optimal pipelining.
+ */
+static Bool
+viaExaTexUploadToScreen(PixmapPtr pDst, int x, int y, int w, int h, char *src,
+                        int src_pitch)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    unsigned dstPitch = exaGetPixmapPitch(pDst), dstOffset;
+    unsigned wBytes = (w * pDst->drawable.bitsPerPixel + 7) >> 3;
+    int i, sync[2], yOffs, bufH, bufOffs, height, format;
+    CARD32 texWidth, texHeight, texPitch;
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    char *dst, *texAddr;
+    Bool buf;
 
     if (!w || !h)
         return TRUE;
 
-    srcOffset = x * pSrc->drawable.bitsPerPixel;
-    if (srcOffset & 3)
+    /* Not in video memory; EXA writes it directly. */
+    if (viaExaIsAGPPool(pDst))
         return FALSE;
-    srcOffset = exaGetPixmapOffset(pSrc) + y * srcPitch + (srcOffset >> 3);
 
-    totSize = wBytes * h;
+    if (wBytes * h < VIA_MIN_TEX_UPLOAD) {
+        dstOffset = x * pDst->drawable.bitsPerPixel;
+        if (dstOffset & 3)
+            return FALSE;
 
-    exaWaitSync(pScrn->pScreen);
-    if (totSize < VIA_MIN_DOWNLOAD) {
-        bounceAligned = (char *) drm_bo_map(pScrn, pVia->drmmode.front_bo) + srcOffset;
+        dst = (char *) drm_bo_map(pScrn, pVia->drmmode.front_bo) +
+                        (viaExaPixmapOffset(pDst) + y * dstPitch +
+                        (dstOffset >> 3));
+        exaWaitSync(pScrn->pScreen);
 
         while (h--) {
-            memcpy(dst, bounceAligned, wBytes);
-            dst += dst_pitch;
-            bounceAligned += srcPitch;
+            memcpy(dst, src, wBytes);
+            dst += dstPitch;
+            src += src_pitch;
+        }
+        return TRUE;
+    }
+
+    if (!pVia->texAGPBuffer->ptr)
+        return FALSE;
+
+    /* The blits below aren't split like other 3D operations. */
+    if (x + w > VIA_TILE || y + h > VIA_TILE)
+        return FALSE;
+
+    switch (pDst->drawable.bitsPerPixel) {
+        case 32:
+            format = PICT_a8r8g8b8;
+            break;
+        case 16:
+            format = PICT_r5g6b5;
+            break;
+        default:
+            return FALSE;
+    }
+
+    dstOffset = viaExaPixmapOffset(pDst);
+
+    if (pVia->nPOT[0]) {
+        texPitch = ALIGN_TO(wBytes, 32);
+        height = VIA_AGP_UPL_SIZE / texPitch;
+    } else {
+        viaOrder(wBytes, &texPitch);
+        if (texPitch < 3)
+            texPitch = 3;
+        height = VIA_AGP_UPL_SIZE >> texPitch;
+        texPitch = 1 << texPitch;
+    }
+
+    if (height > 1024)
+        height = 1024;
+    viaOrder(w, &texWidth);
+    texWidth = 1 << texWidth;
+
+    texHeight = height << 1;
+    bufOffs = texPitch * height;
+    texAddr = (char *) drm_bo_map(pScrn, pVia->texAGPBuffer);
+
+    v3d->setDestination(v3d, dstOffset, dstPitch, format);
+    v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0x00);
+    v3d->setFlags(v3d, 1, TRUE, TRUE, FALSE);
+    if (!v3d->setTexture(v3d, 0, (unsigned long) texAddr, texPitch,
+                         pVia->nPOT[0], texWidth, texHeight, format,
+                         via_single, via_single, via_src, TRUE))
+        return FALSE;
+
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+    v3d->emitClipRect(v3d, &pVia->cb, 0, 0, pDst->drawable.width,
+                      pDst->drawable.height);
+
+    buf = 1;
+    yOffs = 0;
+    sync[0] = -1;
+    sync[1] = -1;
+
+    while (h) {
+        buf = (buf) ? 0 : 1;
+        bufH = (h > height) ? height : h;
+        dst = texAddr + ((buf) ? bufOffs : 0);
+
+        if (sync[buf] >= 0)
+            pVia->exaDriverPtr->WaitMarker(pScrn->pScreen, sync[buf]);
+
+        for (i = 0; i < bufH; ++i) {
+            memcpy(dst, src, wBytes);
+            dst += texPitch;
+            src += src_pitch;
         }
+
+        v3d->emitQuad(v3d, &pVia->cb, x, y + yOffs, 0, (buf) ? height : 0, 0,
+                      0, w, bufH);
+
+        sync[buf] = pVia->exaDriverPtr->MarkSync(pScrn->pScreen);
+
+        h -= bufH;
+        yOffs += bufH;
+    }
+
+    if (sync[buf] >= 0)
+        pVia->exaDriverPtr->WaitMarker(pScrn->pScreen, sync[buf]);
+
+    return TRUE;
+}
+
+#endif /* HAVE_DRI */
+
+int
+viaEXAOffscreenAlloc(ScrnInfoPtr pScrn, struct buffer_object *obj,
+                        unsigned long size, unsigned long alignment)
+{
+    ExaOffscreenArea *pArea;
+    int newSize = size;
+    int newAlignment;
+    int ret = 0;
+
+    newAlignment = alignment;
+    pArea = exaOffscreenAlloc(pScrn->pScreen, newSize,
+                                newAlignment, TRUE, NULL, NULL);
+    if (!pArea) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    obj->offset = pArea->offset;
+    obj->handle = (unsigned long) pArea;
+    obj->domain = TTM_PL_FLAG_VRAM;
+    obj->size = newSize;
+
+exit:
+    return ret;
+}
+
+/*
+ * AGP pixmap pool.
+ *
+ * Glyph pictures and small pixmaps are written by the CPU and then only
+ * read by the 3D engine, so they are placed in the AGP scratch area. EXA
+ * sees them as offscreen, and there is no upload step: the CPU writes
+ * them directly through the write-combined mapping, and the texture units
+ * sample them from AGP. The 2D engine can't reach AGP memory, so fills
+ * and blits involving them and rendering into them fall back to the CPU.
+ */
+static Bool
+viaExaPoolOwns(VIAPtr pVia, void *ptr, unsigned long *offset)
+{
+    unsigned long offs;
+
+    if (!pVia->agpPool.size)
+        return FALSE;
+
+    offs = (unsigned long) ptr - (unsigned long) pVia->scratchAddr;
+    if (!viaHeapOwns(&pVia->agpPool, offs))
+        return FALSE;
+
+    if (offset)
+        *offset = offs;
+    return TRUE;
+}
+
+Bool
+viaExaIsAGPPool(PixmapPtr pPix)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPix->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    return viaExaPoolOwns(pVia, pVia->FBBase + viaExaPixmapOffset(pPix),
+                          NULL);
+}
+
+static Bool
+viaExaPixmapIsOffscreen(PixmapPtr pPix)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPix->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    ExaDriverPtr pExa = pVia->exaDriverPtr;
+    CARD8 *ptr = pPix->devPrivate.ptr;
+
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+    if (pVia->exaDriverPixmaps) {
+        struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
+
+        return priv && priv->offscreen;
+    }
+#endif
+
+    /* EXA passes the address of the offscreen copy if there is one. */
+    if (ptr >= pExa->memoryBase && ptr < pExa->memoryBase + pExa->memorySize)
         return TRUE;
+
+    return viaExaPoolOwns(pVia, ptr, NULL);
+}
+
+/*
+ * Pixmap memory is freed while the engines may still be using it. It is
+ * kept with the marker of the free on pixmapsFreed and only given back
+ * once the engines are past that marker, or after waiting for them when
+ * an allocation fails.
+ */
+static void
+viaExaFreedRelease(ScrnInfoPtr pScrn, struct via_pixmap *priv)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap *next;
+
+    for (; priv; priv = next) {
+        next = priv->next;
+        if (priv->bo) {
+            drm_bo_unmap(pScrn, priv->bo);
+            drm_bo_free(pScrn, priv->bo);
+        }
+        if (priv->block)
+            viaHeapFree(&pVia->agpPool, priv->block);
+        free(priv);
+    }
+}
+
+static Bool
+viaExaFreedReclaim(ScreenPtr pScreen, Bool wait)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap **link = &pVia->pixmapsFreed;
+    struct via_pixmap *priv;
+
+    if (!*link)
+        return FALSE;
+
+    if (wait) {
+        pVia->exaDriverPtr->WaitMarker(pScreen, (*link)->sync);
+    } else if (pVia->agpDMA) {
+        /* Newest first, once one has passed so have the rest. */
+        pVia->lastMarkerRead = *(CARD32 *) pVia->markerBuf;
+        while (*link &&
+               (pVia->lastMarkerRead - (CARD32) (*link)->sync) > (1 << 24))
+            link = &(*link)->next;
+    } else {
+        /* Without AGP DMA there is no marker to look at. */
+        return FALSE;
+    }
+
+    priv = *link;
+    *link = NULL;
+    viaExaFreedRelease(pScrn, priv);
+    return priv != NULL;
+}
+
+static void
+viaExaFreedAdd(ScreenPtr pScreen, struct via_pixmap *priv)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    priv->sync = pVia->exaDriverPtr->MarkSync(pScreen);
+    priv->prev = NULL;
+    priv->next = pVia->pixmapsFreed;
+    pVia->pixmapsFreed = priv;
+}
+
+static PixmapPtr
+viaExaCreatePixmap(ScreenPtr pScreen, int width, int height, int depth,
+                   unsigned usage_hint)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_heap_block *block;
+    PixmapPtr pPix = NULL;
+    int bpp = BitsPerPixel(depth);
+    int pitch = ((width * bpp + 7) / 8 + 31) & ~31;
+
+    pScreen->CreatePixmap = pVia->CreatePixmap;
+
+    if (width > 0 && height > 0 && depth >= 8 &&
+        (usage_hint == CREATE_PIXMAP_USAGE_GLYPH_PICTURE ||
+         (!usage_hint && pitch * height <= VIA_AGP_POOL_PIXMAP))) {
+
+        viaExaFreedReclaim(pScreen, FALSE);
+        block = viaHeapAlloc(&pVia->agpPool, pitch * height, 32);
+        if (!block && viaExaFreedReclaim(pScreen, TRUE))
+            block = viaHeapAlloc(&pVia->agpPool, pitch * height, 32);
+        if (block) {
+            pPix = (*pScreen->CreatePixmap) (pScreen, 0, 0, depth,
+                                             usage_hint);
+            if (pPix)
+                (*pScreen->ModifyPixmapHeader) (pPix, width, height, depth,
+                                                bpp, pitch,
+                                                pVia->scratchAddr +
+                                                block->offset);
+            else
+                viaHeapFree(&pVia->agpPool, block);
+        } else {
+            pVia->agpPool.fallbacks++;
+        }
+    }
+
+    if (!pPix)
+        pPix = (*pScreen->CreatePixmap) (pScreen, width, height, depth,
+                                         usage_hint);
+
+    pScreen->CreatePixmap = viaExaCreatePixmap;
+    return pPix;
+}
+
+static Bool
+viaExaDestroyPixmap(PixmapPtr pPix)
+{
+    ScreenPtr pScreen = pPix->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_heap_block *block = NULL;
+    struct via_pixmap *priv;
+    unsigned long offset;
+    Bool ret;
+
+    if (pPix->refcnt == 1 &&
+        viaExaPoolOwns(pVia, pVia->FBBase + viaExaPixmapOffset(pPix),
+                       &offset))
+        block = viaHeapFind(&pVia->agpPool, offset);
+
+    pScreen->DestroyPixmap = pVia->DestroyPixmap;
+    ret = (*pScreen->DestroyPixmap) (pPix);
+    pScreen->DestroyPixmap = viaExaDestroyPixmap;
+
+    if (block) {
+        priv = calloc(1, sizeof(*priv));
+        if (priv) {
+            priv->block = block;
+            viaExaFreedAdd(pScreen, priv);
+        } else {
+            pVia->exaDriverPtr->WaitMarker(pScreen,
+                    pVia->exaDriverPtr->MarkSync(pScreen));
+            viaHeapFree(&pVia->agpPool, block);
+        }
+    }
+
+    return ret;
+}
+
+static void
+viaExaPoolInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (!pVia->scratchAddr ||
+        !viaHeapInit(&pVia->agpPool, 0, pVia->scratchBuffer->size))
+        return;
+
+    /* Driver pixmaps are put in the pool by viaExaDriverCreatePixmap. */
+    if (pVia->exaDriverPixmaps) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Using the EXA scratch area as AGP pixmap pool.\n");
+        return;
     }
 
-    if (!pVia->directRenderingType)
-        return FALSE;
+    pVia->exaDriverPtr->PixmapIsOffscreen = viaExaPixmapIsOffscreen;
+    pVia->CreatePixmap = pScreen->CreatePixmap;
+    pScreen->CreatePixmap = viaExaCreatePixmap;
+    pVia->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = viaExaDestroyPixmap;
 
-    if ((srcPitch & 3) || (srcOffset & 3)) {
-        ErrorF("VIA EXA download src_pitch misaligned\n");
-        return FALSE;
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "Using the EXA scratch area as AGP pixmap pool.\n");
+}
+
+static void
+viaExaPoolFini(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (!pVia->agpPool.size)
+        return;
+
+    if (!pVia->exaDriverPixmaps) {
+        pScreen->CreatePixmap = pVia->CreatePixmap;
+        pScreen->DestroyPixmap = pVia->DestroyPixmap;
+        pVia->exaDriverPtr->PixmapIsOffscreen = NULL;
     }
+    viaHeapReport(pScrn, &pVia->agpPool, "AGP pixmap pool", X_INFO);
+    viaHeapDestroy(&pVia->agpPool);
+}
 
-    if (viaAccelDMADownload(pScrn, srcOffset, srcPitch, (unsigned char *)dst,
-                            dst_pitch, wBytes, h))
-        return FALSE;
+/*
+ * Driver allocated pixmaps.
+ *
+ * With EXA_HANDLES_PIXMAPS, EXA leaves the pixmap memory to us and never
+ * migrates pixmaps. On these chipsets video memory is carved out of system
+ * memory, so the copies EXA makes when it moves pixmaps in and out of
+ * video memory buy nothing. Pixmaps are allocated once, in the AGP pixmap
+ * pool or in video memory, and the CPU accesses them in place. Only when
+ * both are full do they end up in system memory, where EXA falls back to
+ * software for them.
+ */
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+static int
+viaExaCompactOrder(const void *a, const void *b)
+{
+    const struct via_pixmap *pa = *(struct via_pixmap * const *) a;
+    const struct via_pixmap *pb = *(struct via_pixmap * const *) b;
 
-    return TRUE;
+    return pa->bo->offset < pb->bo->offset ? 1 : -1;
 }
 
 /*
- * Upload to framebuffer memory using memcpy to AGP pipelined with a
- * 3D engine texture operation from AGP to framebuffer. The AGP buffers (2)
- * should be kept rather small for optimal pipelining.
+ * Pixmap heap compaction.
+ *
+ * Freed pixmaps leave holes in the pixmap heap, until a large pixmap no
+ * longer fits even though there is enough free memory. Then the pixmaps
+ * are moved down into the holes with the 2D engine, highest first, so
+ * that the free memory gathers at the top. Pixmaps under CPU access stay
+ * where they are, and so do the front buffer and the rotation shadows,
+ * which are scanned out.
  */
 static Bool
-viaExaTexUploadToScreen(PixmapPtr pDst, int x, int y, int w, int h, char *src,
-                        int src_pitch)
+viaExaCompact(ScreenPtr pScreen, unsigned long size)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
-    unsigned dstPitch = exaGetPixmapPitch(pDst), dstOffset;
-    unsigned wBytes = (w * pDst->drawable.bitsPerPixel + 7) >> 3;
-    int i, sync[2], yOffs, bufH, bufOffs, height, format;
-    CARD32 texWidth, texHeight, texPitch;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     VIAPtr pVia = VIAPTR(pScrn);
-    Via3DState *v3d = &pVia->v3d;
-    char *dst, *texAddr;
-    Bool buf;
-
-    if (!w || !h)
-        return TRUE;
+    struct via_heap *heap = &pVia->pixmapHeap;
+    struct via_pixmap **order, *priv;
+    unsigned long oldOffset;
+    unsigned moved = 0, num = 0, i;
 
-    if (wBytes * h < VIA_MIN_TEX_UPLOAD) {
-        dstOffset = x * pDst->drawable.bitsPerPixel;
-        if (dstOffset & 3)
-            return FALSE;
+    if (!heap->size || heap->size - heap->used < size)
+        return FALSE;
 
-        dst = (char *) drm_bo_map(pScrn, pVia->drmmode.front_bo) +
-                        (exaGetPixmapOffset(pDst) + y * dstPitch +
-                        (dstOffset >> 3));
-        exaWaitSync(pScrn->pScreen);
+    for (priv = pVia->pixmaps; priv; priv = priv->next)
+        if (priv->bo)
+            num++;
+    if (!num)
+        return FALSE;
+    order = malloc(num * sizeof(*order));
+    if (!order)
+        return FALSE;
+    num = 0;
+    for (priv = pVia->pixmaps; priv; priv = priv->next)
+        if (priv->bo && !priv->access && priv->offset == priv->bo->offset)
+            order[num++] = priv;
+    qsort(order, num, sizeof(*order), viaExaCompactOrder);
 
-        while (h--) {
-            memcpy(dst, src, wBytes);
-            dst += dstPitch;
-            src += src_pitch;
+    /*
+     * The engines run the copies in order, so a hole left by one move can
+     * take the next one.
+     */
+    for (i = 0; i < num; i++) {
+        priv = order[i];
+        if (!viaVRAMHeapMove(pScrn, priv->bo, &oldOffset))
+            continue;
+        switch (pVia->Chipset) {
+        case VIA_VX800:
+        case VIA_VX855:
+        case VIA_VX900:
+            viaAccelMove_H6(pScrn, oldOffset, priv->bo->offset,
+                            priv->bo->size);
+            break;
+        default:
+            viaAccelMove_H2(pScrn, oldOffset, priv->bo->offset,
+                            priv->bo->size);
+            break;
         }
-        return TRUE;
+        priv->ptr = pVia->FBBase + priv->bo->offset;
+        priv->offset = priv->bo->offset;
+        moved++;
     }
+    free(order);
 
-    if (!pVia->texAGPBuffer->ptr)
+    if (!moved)
         return FALSE;
 
-    switch (pDst->drawable.bitsPerPixel) {
-        case 32:
-            format = PICT_a8r8g8b8;
-            break;
-        case 16:
-            format = PICT_r5g6b5;
-            break;
-        default:
-            return FALSE;
+    /* Nothing may use the old places before the copies are done. */
+    pVia->exaDriverPtr->WaitMarker(pScreen,
+            pVia->exaDriverPtr->MarkSync(pScreen));
+    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                     "Compacted the pixmap heap, %u pixmaps moved.\n",
+                     moved));
+    return TRUE;
+}
+
+static void *
+viaExaDriverCreatePixmap(ScreenPtr pScreen, int width, int height,
+                         int depth, int usage_hint, int bitsPerPixel,
+                         int *new_pitch)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap *priv;
+    int pitch = ((width * bitsPerPixel + 7) / 8 + 31) & ~31;
+    unsigned long size = pitch * height;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return NULL;
+
+    /* The screen pixmap and the like get their memory later. */
+    if (width <= 0 || height <= 0) {
+        *new_pitch = pitch;
+        goto link;
     }
 
-    dstOffset = exaGetPixmapOffset(pDst);
+    /* The engines can't use bitmaps, they stay in system memory. */
+    if (bitsPerPixel < 8)
+        goto sys;
+
+    viaExaFreedReclaim(pScreen, FALSE);
+
+    if (pVia->agpPool.size &&
+        (usage_hint == CREATE_PIXMAP_USAGE_GLYPH_PICTURE ||
+         (!usage_hint && size <= VIA_AGP_POOL_PIXMAP))) {
+        priv->block = viaHeapAlloc(&pVia->agpPool, size, 32);
+        if (!priv->block && viaExaFreedReclaim(pScreen, TRUE))
+            priv->block = viaHeapAlloc(&pVia->agpPool, size, 32);
+        if (priv->block) {
+            priv->ptr = pVia->scratchAddr + priv->block->offset;
+            priv->offscreen = TRUE;
+        } else {
+            pVia->agpPool.fallbacks++;
+        }
+    }
 
-    if (pVia->nPOT[0]) {
-        texPitch = ALIGN_TO(wBytes, 32);
-        height = VIA_AGP_UPL_SIZE / texPitch;
-    } else {
-        viaOrder(wBytes, &texPitch);
-        if (texPitch < 3)
-            texPitch = 3;
-        height = VIA_AGP_UPL_SIZE >> texPitch;
-        texPitch = 1 << texPitch;
+    if (!priv->ptr) {
+        priv->bo = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_VRAM,
+                                VIA_BO_PIXMAP);
+        if (!priv->bo && viaExaFreedReclaim(pScreen, TRUE))
+            priv->bo = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_VRAM,
+                                    VIA_BO_PIXMAP);
+        if (!priv->bo && viaExaCompact(pScreen, size))
+            priv->bo = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_VRAM,
+                                    VIA_BO_PIXMAP);
+        if (priv->bo) {
+            priv->ptr = drm_bo_map(pScrn, priv->bo);
+            if (priv->ptr) {
+                priv->offscreen = TRUE;
+            } else {
+                drm_bo_free(pScrn, priv->bo);
+                priv->bo = NULL;
+            }
+        }
     }
 
-    if (height > 1024)
-        height = 1024;
-    viaOrder(w, &texWidth);
-    texWidth = 1 << texWidth;
+sys:
+    if (!priv->ptr) {
+        priv->sys = malloc(size);
+        if (!priv->sys) {
+            free(priv);
+            return NULL;
+        }
+        priv->ptr = priv->sys;
+    }
 
-    texHeight = height << 1;
-    bufOffs = texPitch * height;
-    texAddr = (char *) drm_bo_map(pScrn, pVia->texAGPBuffer);
+    priv->offset = (CARD8 *) priv->ptr - pVia->FBBase;
+    *new_pitch = pitch;
 
-    v3d->setDestination(v3d, dstOffset, dstPitch, format);
-    v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0x00);
-    v3d->setFlags(v3d, 1, TRUE, TRUE, FALSE);
-    if (!v3d->setTexture(v3d, 0, (unsigned long) texAddr, texPitch,
-                         pVia->nPOT[0], texWidth, texHeight, format,
-                         via_single, via_single, via_src, TRUE))
-        return FALSE;
+link:
+    priv->next = pVia->pixmaps;
+    if (priv->next)
+        priv->next->prev = priv;
+    pVia->pixmaps = priv;
+    return priv;
+}
 
-    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
-    v3d->emitClipRect(v3d, &pVia->cb, 0, 0, pDst->drawable.width,
-                      pDst->drawable.height);
+static void
+viaExaDriverDestroyPixmap(ScreenPtr pScreen, void *driverPriv)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap *priv = driverPriv;
 
-    buf = 1;
-    yOffs = 0;
-    sync[0] = -1;
-    sync[1] = -1;
+    if (!priv)
+        return;
 
-    while (h) {
-        buf = (buf) ? 0 : 1;
-        bufH = (h > height) ? height : h;
-        dst = texAddr + ((buf) ? bufOffs : 0);
+    free(priv->sys);
+    priv->sys = NULL;
+
+    if (priv->prev)
+        priv->prev->next = priv->next;
+    else
+        pVia->pixmaps = priv->next;
+    if (priv->next)
+        priv->next->prev = priv->prev;
+
+    /* Pixmaps destroyed after viaExitAccel have nothing left to free. */
+    if (priv->bo || priv->block)
+        viaExaFreedAdd(pScreen, priv);
+    else
+        free(priv);
+}
 
-        if (sync[buf] >= 0)
-            pVia->exaDriverPtr->WaitMarker(pScrn->pScreen, sync[buf]);
+/*
+ * Called with the memory of pixmaps allocated elsewhere, like the front
+ * buffer, and by EXA right after viaExaDriverCreatePixmap.
+ */
+static Bool
+viaExaModifyPixmapHeader(PixmapPtr pPix, int width, int height, int depth,
+                         int bitsPerPixel, int devKind, pointer pPixData)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPix->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
+    CARD8 *ptr = pPixData;
 
-        for (i = 0; i < bufH; ++i) {
-            memcpy(dst, src, wBytes);
-            dst += texPitch;
-            src += src_pitch;
-        }
+    if (!priv)
+        return FALSE;
 
-        v3d->emitQuad(v3d, &pVia->cb, x, y + yOffs, 0, (buf) ? height : 0, 0,
-                      0, w, bufH);
+    if (ptr) {
+        priv->ptr = ptr;
+        priv->offset = ptr - pVia->FBBase;
+        priv->offscreen =
+            (ptr >= pVia->FBBase &&
+             ptr < pVia->FBBase + pVia->videoRambytes) ||
+            viaExaPoolOwns(pVia, ptr, NULL);
+    } else if (priv->sys) {
+        /* EXA takes this as the system memory copy. */
+        pPix->devPrivate.ptr = priv->sys;
+        pPix->devKind = devKind > 0 ? devKind : pPix->devKind;
+    }
 
-        sync[buf] = pVia->exaDriverPtr->MarkSync(pScrn->pScreen);
+    /* Let miModifyPixmapHeader fill in the rest. */
+    return FALSE;
+}
 
-        h -= bufH;
-        yOffs += bufH;
-    }
+static Bool
+viaExaDriverPrepareAccess(PixmapPtr pPix, int index)
+{
+    struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
 
-    if (sync[buf] >= 0)
-        pVia->exaDriverPtr->WaitMarker(pScrn->pScreen, sync[buf]);
+    if (!priv || !priv->ptr)
+        return FALSE;
 
+    pPix->devPrivate.ptr = priv->ptr;
+    priv->access++;
     return TRUE;
 }
 
-#endif /* HAVE_DRI */
+static void
+viaExaDriverFinishAccess(PixmapPtr pPix, int index)
+{
+    struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
 
-int
-viaEXAOffscreenAlloc(ScrnInfoPtr pScrn, struct buffer_object *obj,
-                        unsigned long size, unsigned long alignment)
+    if (priv && priv->access)
+        priv->access--;
+}
+
+/*
+ * Release the memory of all pixmaps, EXA destroys the last of them only
+ * after viaExitAccel.
+ */
+static void
+viaExaDriverPixmapsFini(ScrnInfoPtr pScrn)
 {
-    ExaOffscreenArea *pArea;
-    int newSize = size;
-    int newAlignment;
-    int ret = 0;
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_pixmap *priv;
 
-    newAlignment = alignment;
-    pArea = exaOffscreenAlloc(pScrn->pScreen, newSize,
-                                newAlignment, TRUE, NULL, NULL);
-    if (!pArea) {
-        ret = -ENOMEM;
-        goto exit;
+    for (priv = pVia->pixmaps; priv; priv = priv->next) {
+        if (priv->bo) {
+            drm_bo_unmap(pScrn, priv->bo);
+            drm_bo_free(pScrn, priv->bo);
+            priv->bo = NULL;
+        }
+        if (priv->block) {
+            viaHeapFree(&pVia->agpPool, priv->block);
+            priv->block = NULL;
+        }
+        if (!priv->sys) {
+            priv->ptr = NULL;
+            priv->offscreen = FALSE;
+        }
     }
+}
+#endif /* VIA_EXA_DRIVER_PIXMAPS */
 
-    obj->offset = pArea->offset;
-    obj->handle = (unsigned long) pArea;
-    obj->domain = TTM_PL_FLAG_VRAM;
-    obj->size = newSize;
+/*
+ * Offset of a pixmap from FBBase. Pool pixmaps get an offset into the AGP
+ * mapping, like EXA gives them.
+ */
+unsigned long
+viaExaPixmapOffset(PixmapPtr pPix)
+{
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPix->drawable.pScreen);
 
-exit:
-    return ret;
+    if (VIAPTR(pScrn)->exaDriverPixmaps) {
+        struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
+
+        return priv ? priv->offset : 0;
+    }
+#endif
+    return exaGetPixmapOffset(pPix);
 }
 
 Bool
@@ -819,9 +2358,14 @@ viaIsAGP(VIAPtr pVia, PixmapPtr pPix, unsigned long *offset)
 {
 #ifdef HAVE_DRI
     unsigned long offs;
+    void *ptr = pPix->devPrivate.ptr;
+
+    /* Pool pixmaps need not have devPrivate.ptr set outside access. */
+    if (viaExaIsAGPPool(pPix))
+        ptr = pVia->FBBase + viaExaPixmapOffset(pPix);
 
     if (pVia->directRenderingType && !pVia->IsPCI) {
-        offs = ((unsigned long)pPix->devPrivate.ptr
+        offs = ((unsigned long)ptr
                 - (unsigned long)pVia->agpMappedAddr);
 
         if ((offs - pVia->scratchOffset) < pVia->agpSize) {
@@ -842,6 +2386,14 @@ viaExaIsOffscreen(PixmapPtr pPix)
     uint8_t* front_bo;
     Bool ret;
 
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+    if (pVia->exaDriverPixmaps) {
+        struct via_pixmap *priv = exaGetPixmapDriverPrivate(pPix);
+
+        return priv && priv->offscreen && !priv->block;
+    }
+#endif
+
     front_bo = drm_bo_map(pScrn, pVia->drmmode.front_bo);
     addr_size = (uint8_t*)pPix->devPrivate.ptr -
                                             (unsigned long)front_bo;
@@ -850,6 +2402,154 @@ viaExaIsOffscreen(PixmapPtr pPix)
     return ret;
 }
 
+/*
+ * Composite calibration.
+ *
+ * Time VIA_CAL_OPS source-over composites of two sizes on the 3D engine and
+ * with pixman, fit cost = perOp + perPixel * pixels to both, and set the
+ * size below which composites are left to software to where the two lines
+ * cross. Software fallbacks on real pixmaps also pay for migration, so this
+ * errs on the side of software.
+ */
+#define VIA_CAL_SIZE  32
+#define VIA_CAL_PITCH (VIA_CAL_SIZE * 4)
+#define VIA_CAL_OPS   128
+#define VIA_CAL_SMALL 4
+
+static CARD64
+viaExaTimeComposite3D(ScrnInfoPtr pScrn, struct buffer_object *bo, int size)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    ExaDriverPtr pExa = pVia->exaDriverPtr;
+    unsigned long dstOffset = bo->offset + VIA_CAL_PITCH * VIA_CAL_SIZE;
+    CARD64 start;
+    int i;
+
+    pExa->WaitMarker(pScrn->pScreen, pExa->MarkSync(pScrn->pScreen));
+    start = GetTimeInMicros();
+
+    /* The same work as PrepareComposite, Composite and DoneComposite. */
+    for (i = 0; i < VIA_CAL_OPS; i++) {
+        v3d->setDestination(v3d, dstOffset, VIA_CAL_PITCH, PICT_a8r8g8b8);
+        v3d->setCompositeOperator(v3d, PictOpOver, FALSE);
+        v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0xFF);
+        v3d->setTexture(v3d, 0, bo->offset, VIA_CAL_PITCH, pVia->nPOT[0],
+                        VIA_CAL_SIZE, VIA_CAL_SIZE, PICT_a8r8g8b8,
+                        via_repeat, via_repeat, via_src, FALSE);
+        v3d->setFlags(v3d, 1, FALSE, TRUE, TRUE);
+        v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+        v3d->emitClipRect(v3d, &pVia->cb, 0, 0, VIA_CAL_SIZE, VIA_CAL_SIZE);
+        v3d->emitQuad(v3d, &pVia->cb, 0, 0, 0, 0, 0, 0, size, size);
+        v3d->flushQuads(v3d, &pVia->cb);
+    }
+
+    pExa->WaitMarker(pScrn->pScreen, pExa->MarkSync(pScrn->pScreen));
+    return GetTimeInMicros() - start;
+}
+
+static CARD64
+viaExaTimeCompositeSW(CARD32 *bits, int size)
+{
+    pixman_image_t *src, *dst;
+    CARD64 start, time;
+    int i;
+
+    src = pixman_image_create_bits(PIXMAN_a8r8g8b8, VIA_CAL_SIZE,
+                                   VIA_CAL_SIZE, bits, VIA_CAL_PITCH);
+    dst = pixman_image_create_bits(PIXMAN_a8r8g8b8, VIA_CAL_SIZE,
+                                   VIA_CAL_SIZE, bits +
+                                   VIA_CAL_SIZE * VIA_CAL_SIZE,
+                                   VIA_CAL_PITCH);
+    if (!src || !dst) {
+        time = 0;
+        goto out;
+    }
+
+    start = GetTimeInMicros();
+    for (i = 0; i < VIA_CAL_OPS; i++)
+        pixman_image_composite(PIXMAN_OP_OVER, src, NULL, dst,
+                               0, 0, 0, 0, 0, 0, size, size);
+    time = GetTimeInMicros() - start;
+
+out:
+    if (src)
+        pixman_image_unref(src);
+    if (dst)
+        pixman_image_unref(dst);
+    return time;
+}
+
+static void
+viaExaCalibrateComposite(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    const int n1 = VIA_CAL_SMALL * VIA_CAL_SMALL;
+    const int n2 = VIA_CAL_SIZE * VIA_CAL_SIZE;
+    struct buffer_object *bo;
+    CARD32 *bits;
+    double hwPerOp, hwPerPixel, swPerOp, swPerPixel, cross;
+    CARD64 hw1, hw2, sw1, sw2;
+    int i;
+
+    bo = drm_bo_alloc(pScrn, 2 * VIA_CAL_PITCH * VIA_CAL_SIZE, 32,
+                      TTM_PL_FLAG_VRAM, VIA_BO_TEMP);
+    if (!bo)
+        return;
+
+    bits = drm_bo_map(pScrn, bo);
+    if (!bits) {
+        drm_bo_free(pScrn, bo);
+        return;
+    }
+
+    /* Translucent source, so that neither side can skip the blending. */
+    for (i = 0; i < 2 * VIA_CAL_SIZE * VIA_CAL_SIZE; i++)
+        bits[i] = 0x80406080;
+
+    hw1 = viaExaTimeComposite3D(pScrn, bo, VIA_CAL_SMALL);
+    hw2 = viaExaTimeComposite3D(pScrn, bo, VIA_CAL_SIZE);
+    drm_bo_unmap(pScrn, bo);
+    drm_bo_free(pScrn, bo);
+
+    bits = malloc(2 * VIA_CAL_PITCH * VIA_CAL_SIZE);
+    if (!bits)
+        return;
+    for (i = 0; i < 2 * VIA_CAL_SIZE * VIA_CAL_SIZE; i++)
+        bits[i] = 0x80406080;
+    sw1 = viaExaTimeCompositeSW(bits, VIA_CAL_SMALL);
+    sw2 = viaExaTimeCompositeSW(bits, VIA_CAL_SIZE);
+    free(bits);
+
+    if (!hw1 || !hw2 || !sw1 || !sw2)
+        return;
+
+    hwPerPixel = ((double) hw2 - (double) hw1) / (n2 - n1);
+    hwPerOp = hw1 - hwPerPixel * n1;
+    swPerPixel = ((double) sw2 - (double) sw1) / (n2 - n1);
+    swPerOp = sw1 - swPerPixel * n1;
+
+    if (hwPerOp <= swPerOp)
+        cross = 0.;
+    else if (swPerPixel > hwPerPixel)
+        cross = (hwPerOp - swPerOp) / (swPerPixel - hwPerPixel);
+    else
+        cross = VIA_MIN_COMPOSITE * 4;
+
+    if (cross > VIA_MIN_COMPOSITE * 4)
+        cross = VIA_MIN_COMPOSITE * 4;
+    pVia->minComposite = (int) cross;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "[EXA] Composites of less than %d pixels are done "
+               "in software.\n", pVia->minComposite);
+    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                     "[EXA] Composite cost in usec per op and per pixel: "
+                     "3D %f %f, software %f %f.\n",
+                     hwPerOp / VIA_CAL_OPS, hwPerPixel / VIA_CAL_OPS,
+                     swPerOp / VIA_CAL_OPS, swPerPixel / VIA_CAL_OPS));
+}
+
 Bool
 viaInitExa(ScreenPtr pScreen)
 {
@@ -876,6 +2576,10 @@ viaInitExa(ScreenPtr pScreen)
         return FALSE;
     }
 
+    /* EXA may still have used it after viaExitAccel last generation. */
+    free(pVia->exaDriverPtr);
+    pVia->exaDriverPtr = NULL;
+
     pExa = exaDriverAlloc();
     if (!pExa) {
         return FALSE;
@@ -890,6 +2594,23 @@ viaInitExa(ScreenPtr pScreen)
     pExa->pixmapPitchAlign = 16;
     pExa->flags = EXA_OFFSCREEN_PIXMAPS |
             (pVia->nPOT[1] ? 0 : EXA_OFFSCREEN_ALIGN_POT);
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+    if (pVia->exaDriverPixmaps) {
+        pVia->pixmaps = NULL;
+        pExa->flags = EXA_OFFSCREEN_PIXMAPS | EXA_HANDLES_PIXMAPS |
+                      EXA_SUPPORTS_PREPARE_AUX;
+        pExa->CreatePixmap2 = viaExaDriverCreatePixmap;
+        pExa->DestroyPixmap = viaExaDriverDestroyPixmap;
+        pExa->ModifyPixmapHeader = viaExaModifyPixmapHeader;
+        pExa->PixmapIsOffscreen = viaExaPixmapIsOffscreen;
+        pExa->PrepareAccess = viaExaDriverPrepareAccess;
+        pExa->FinishAccess = viaExaDriverFinishAccess;
+    }
+#endif
+#ifdef EXA_SUPPORTS_OFFSCREEN_OVERLAPS
+    /* The 2D engine can do it, see viaExaCopyOverlap. */
+    pExa->flags |= EXA_SUPPORTS_OFFSCREEN_OVERLAPS;
+#endif
 
 
     /*  HW Limitation are described here:
@@ -907,9 +2628,12 @@ viaInitExa(ScreenPtr pScreen)
      *     Pitch: ((1 << 10) - 1)*32 = 32736
      *     Clip Rectangle: Color Window, 12bits. As Spec saied: 0 - 2048
      *                     Scissor is the same as color window.
+     *
+     *  The 3D limits are worked around by splitting, see viaExaTile3D.
+     *  VIA_EXA_MAX pixels at 32 bpp keep the pitch below 16383.
      */
-    pExa->maxX = 2047;
-    pExa->maxY = 2047;
+    pExa->maxX = VIA_EXA_MAX;
+    pExa->maxY = VIA_EXA_MAX;
     pExa->WaitMarker = viaAccelWaitMarker;
 
     switch (pVia->Chipset) {
@@ -946,7 +2670,10 @@ viaInitExa(ScreenPtr pScreen)
             pExa->UploadToScreen = NULL; //viaExaTexUploadToScreen;
             break;
         default:
-            pExa->UploadToScreen = NULL; //viaExaUploadToScreen;
+#ifdef linux
+            if ((pVia->drmVerMajor == 2) && (pVia->drmVerMinor >= 8))
+                pExa->UploadToScreen = viaExaUploadToScreen;
+#endif /* linux */
             break;
         }
     }
@@ -960,13 +2687,13 @@ viaInitExa(ScreenPtr pScreen)
             pExa->CheckComposite = viaExaCheckComposite_H6;
             pExa->PrepareComposite = viaExaPrepareComposite_H6;
             pExa->Composite = viaExaComposite_H6;
-            pExa->DoneComposite = viaExaDoneSolidCopy_H6;
+            pExa->DoneComposite = viaExaDoneComposite_H6;
             break;
         default:
             pExa->CheckComposite = viaExaCheckComposite_H2;
             pExa->PrepareComposite = viaExaPrepareComposite_H2;
             pExa->Composite = viaExaComposite_H2;
-            pExa->DoneComposite = viaExaDoneSolidCopy_H2;
+            pExa->DoneComposite = viaExaDoneComposite_H2;
             break;
         }
     } else {
@@ -980,6 +2707,7 @@ viaInitExa(ScreenPtr pScreen)
     }
 
     pVia->exaDriverPtr = pExa;
+    pVia->minComposite = VIA_MIN_COMPOSITE;
     viaInit3DState(&pVia->v3d);
     xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                 "[EXA] Enabled EXA acceleration.\n");
@@ -1009,7 +2737,8 @@ viaFinishInitAccel(ScreenPtr pScreen)
             if (pVia->exaDriverPtr->UploadToScreen == viaExaTexUploadToScreen) {
                 size = VIA_AGP_UPL_SIZE * 2;
 
-                pVia->texAGPBuffer = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_TT);
+                pVia->texAGPBuffer = drm_bo_alloc(pScrn, size, 32,
+                                                  TTM_PL_FLAG_TT, VIA_BO_EXA);
                 if (pVia->texAGPBuffer) {
                     xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                                "Allocated %u kiB of AGP memory for "
@@ -1020,7 +2749,8 @@ viaFinishInitAccel(ScreenPtr pScreen)
             }
 
             size = pVia->exaScratchSize * 1024;
-            pVia->scratchBuffer = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_TT);
+            pVia->scratchBuffer = drm_bo_alloc(pScrn, size, 32,
+                                               TTM_PL_FLAG_TT, VIA_BO_EXA);
             if (pVia->scratchBuffer) {
                 xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                            "Allocated %u kiB of AGP memory for "
@@ -1028,13 +2758,15 @@ viaFinishInitAccel(ScreenPtr pScreen)
                 pVia->scratchOffset =
                         (pVia->scratchBuffer->offset + 31) & ~31;
                 pVia->scratchAddr = drm_bo_map(pScrn, pVia->scratchBuffer);
+                viaExaPoolInit(pScreen);
             }
         }
     }
 #endif /* HAVE_DRI */
     if (!pVia->scratchAddr && pVia->useEXA) {
         size = pVia->exaScratchSize * 1024 + 32;
-        pVia->scratchBuffer = drm_bo_alloc(pScrn, size, 32, TTM_PL_FLAG_SYSTEM);
+        pVia->scratchBuffer = drm_bo_alloc(pScrn, size, 32,
+                                           TTM_PL_FLAG_SYSTEM, VIA_BO_EXA);
 
         if (pVia->scratchBuffer) {
             xf86DrvMsg(pScrn->scrnIndex, X_INFO,
@@ -1045,6 +2777,9 @@ viaFinishInitAccel(ScreenPtr pScreen)
         }
     }
     memset(pVia->markerBuf, 0, pVia->exa_sync_bo->size);
+
+    if (pVia->useEXA && pVia->exaDriverPtr->CheckComposite)
+        viaExaCalibrateComposite(pScrn);
 }
 
 /*
@@ -1055,11 +2790,20 @@ viaExitAccel(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     VIAPtr pVia = VIAPTR(pScrn);
+    int i;
 
     viaAccelSync(pScrn);
     viaTearDownCBuffer(&pVia->cb);
 
     if (pVia->useEXA) {
+        /* The engines are idle, nothing freed is in use any more. */
+        viaExaFreedRelease(pScrn, pVia->pixmapsFreed);
+        pVia->pixmapsFreed = NULL;
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+        if (pVia->exaDriverPixmaps)
+            viaExaDriverPixmapsFini(pScrn);
+#endif
+        viaExaPoolFini(pScreen);
 #ifdef HAVE_DRI
         if (pVia->directRenderingType == DRI_1) {
             if (pVia->texAGPBuffer) {
@@ -1079,6 +2823,16 @@ viaExitAccel(ScreenPtr pScreen)
             drm_bo_free(pScrn, pVia->scratchBuffer);
             pVia->scratchBuffer = NULL;
         }
+        if (pVia->gradBuffer) {
+            drm_bo_unmap(pScrn, pVia->gradBuffer);
+            drm_bo_free(pScrn, pVia->gradBuffer);
+            pVia->gradBuffer = NULL;
+            for (i = 0; i < VIA_GRADIENT_SLOTS; i++)
+                free(pVia->gradSlots[i].key);
+        }
+        free(pVia->gradKey);
+        pVia->gradKey = NULL;
+        pVia->gradKeySize = 0;
         if (pVia->vq_bo) {
             drm_bo_unmap(pScrn, pVia->vq_bo);
             drm_bo_free(pScrn, pVia->vq_bo);
@@ -1090,8 +2844,11 @@ viaExitAccel(ScreenPtr pScreen)
         if (pVia->exaDriverPtr) {
             exaDriverFini(pScreen);
         }
-        free(pVia->exaDriverPtr);
-        pVia->exaDriverPtr = NULL;
+        /* EXA calls our DestroyPixmap until its own CloseScreen. */
+        if (!pVia->exaDriverPixmaps) {
+            free(pVia->exaDriverPtr);
+            pVia->exaDriverPtr = NULL;
+        }
         return;
     }
 }
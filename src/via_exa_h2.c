@@ -114,6 +114,9 @@ viaAccelMarkSync_H2(ScreenPtr pScreen)
 
     RING_VARS;
 
+    /* The marker must come after any queued 3D quads. */
+    pVia->v3d.flushQuads(&pVia->v3d, cb);
+
     ++pVia->curMarker;
 
     /* Wrap around without affecting the sign bit. */
@@ -135,6 +138,52 @@ viaAccelMarkSync_H2(ScreenPtr pScreen)
     return pVia->curMarker;
 }
 
+/*
+ * Copy size bytes of video memory, for the pixmap heap compaction. The
+ * memory is copied as 32 bpp lines of VIA_MOVE_PITCH bytes.
+ */
+void
+viaAccelMove_H2(ScrnInfoPtr pScrn, unsigned long srcOffset,
+                unsigned long dstOffset, unsigned long size)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    unsigned width, lines;
+
+    RING_VARS;
+
+    /* Queued 3D quads may still draw to the memory. */
+    pVia->v3d.flushQuads(&pVia->v3d, cb);
+
+    while (size) {
+        width = VIA_MOVE_PITCH >> 2;
+        lines = size / VIA_MOVE_PITCH;
+        if (lines > VIA_MOVE_LINES)
+            lines = VIA_MOVE_LINES;
+        if (!lines) {
+            width = size >> 2;
+            lines = 1;
+        }
+
+        BEGIN_RING(18);
+        OUT_RING_H1(VIA_REG_KEYCONTROL, 0x00);
+        OUT_RING_H1(VIA_REG_GEMODE, VIA_GEM_32bpp);
+        OUT_RING_H1(VIA_REG_SRCBASE, srcOffset >> 3);
+        OUT_RING_H1(VIA_REG_DSTBASE, dstOffset >> 3);
+        OUT_RING_H1(VIA_REG_PITCH, VIA_PITCH_ENABLE |
+                    (VIA_MOVE_PITCH >> 3) << 16 |
+                    (VIA_MOVE_PITCH >> 3));
+        OUT_RING_H1(VIA_REG_SRCPOS, 0);
+        OUT_RING_H1(VIA_REG_DSTPOS, 0);
+        OUT_RING_H1(VIA_REG_DIMENSION, ((lines - 1) << 16) | (width - 1));
+        OUT_RING_H1(VIA_REG_GECMD, VIA_GEC_BLT | VIAACCELCOPYROP(GXcopy));
+        ADVANCE_RING;
+
+        srcOffset += lines * width * 4;
+        dstOffset += lines * width * 4;
+        size -= lines * width * 4;
+    }
+}
+
 /*
  * Exa functions. It is assumed that EXA does not exceed the blitter limits.
  */
@@ -145,6 +194,9 @@ viaExaPrepareSolid_H2(PixmapPtr pPixmap, int alu, Pixel planeMask, Pixel fg)
     VIAPtr pVia = VIAPTR(pScrn);
     ViaTwodContext *tdc = &pVia->td;
 
+    if (viaExaIsAGPPool(pPixmap))
+        return FALSE;
+
     if (exaGetPixmapPitch(pPixmap) & 7)
         return FALSE;
 
@@ -167,7 +219,7 @@ void
 viaExaSolid_H2(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
-    CARD32 dstOffset = exaGetPixmapOffset(pPixmap);
+    CARD32 dstOffset = viaExaPixmapOffset(pPixmap);
     CARD32 dstPitch = exaGetPixmapPitch(pPixmap);
     int w = x2 - x1, h = y2 - y1;
     VIAPtr pVia = VIAPTR(pScrn);
@@ -190,6 +242,25 @@ viaExaSolid_H2(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
 void
 viaExaDoneSolidCopy_H2(PixmapPtr pPixmap)
 {
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pPixmap->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (pVia->copy3D)
+        viaExaDoneCopy3D(pScrn);
+}
+
+/*
+ * Submit the quads queued by the composite operation.
+ */
+void
+viaExaDoneComposite_H2(PixmapPtr pDst)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+
+    v3d->flushQuads(v3d, &pVia->cb);
+    viaExaDoneSourcePict(pScrn);
 }
 
 Bool
@@ -200,7 +271,15 @@ viaExaPrepareCopy_H2(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir,
     VIAPtr pVia = VIAPTR(pScrn);
     ViaTwodContext *tdc = &pVia->td;
 
-    if (pSrcPixmap->drawable.bitsPerPixel != pDstPixmap->drawable.bitsPerPixel)
+    /* The 2D engine can't read AGP memory, but the 3D engine can. */
+    if (pSrcPixmap->drawable.bitsPerPixel !=
+        pDstPixmap->drawable.bitsPerPixel || viaExaIsAGPPool(pSrcPixmap))
+        return viaExaPrepareCopy3D(pSrcPixmap, pDstPixmap, alu, planeMask);
+
+    if (viaExaIsAGPPool(pDstPixmap))
+        return FALSE;
+
+    if (!viaExaCopyOverlap(pSrcPixmap, pDstPixmap, &xdir, &ydir))
         return FALSE;
 
     if ((tdc->srcPitch = exaGetPixmapPitch(pSrcPixmap)) & 3)
@@ -209,7 +288,7 @@ viaExaPrepareCopy_H2(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int xdir,
     if (exaGetPixmapPitch(pDstPixmap) & 7)
         return FALSE;
 
-    tdc->srcOffset = exaGetPixmapOffset(pSrcPixmap);
+    tdc->srcOffset = viaExaPixmapOffset(pSrcPixmap);
 
     tdc->cmd = VIA_GEC_BLT | VIAACCELCOPYROP(alu);
     if (xdir < 0)
@@ -232,7 +311,7 @@ viaExaCopy_H2(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY,
                 int width, int height)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pDstPixmap->drawable.pScreen);
-    CARD32 dstOffset = exaGetPixmapOffset(pDstPixmap), val;
+    CARD32 dstOffset = viaExaPixmapOffset(pDstPixmap), val;
     CARD32 dstPitch = exaGetPixmapPitch(pDstPixmap);
     VIAPtr pVia = VIAPTR(pScrn);
     ViaTwodContext *tdc = &pVia->td;
@@ -242,6 +321,11 @@ viaExaCopy_H2(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY,
     if (!width || !height)
         return;
 
+    if (pVia->copy3D) {
+        viaExaCopy3D(pScrn, srcX, srcY, dstX, dstY, width, height);
+        return;
+    }
+
     if (tdc->cmd & VIA_GEC_DECY) {
         srcY += height - 1;
         dstY += height - 1;
@@ -274,26 +358,33 @@ viaExaCheckComposite_H2(int op, PicturePtr pSrcPicture,
     VIAPtr pVia = VIAPTR(pScrn);
     Via3DState *v3d = &pVia->v3d;
 
-    if (!pSrcPicture->pDrawable)
+    if (!pSrcPicture->pDrawable && !viaExaCheckSourcePict(pSrcPicture))
+        return FALSE;
+    if (pMaskPicture && !pMaskPicture->pDrawable)
+        return FALSE;
+    if (!viaExaCheckTransform(op, pSrcPicture))
+        return FALSE;
+    if (pMaskPicture && pMaskPicture->transform)
         return FALSE;
 
-    /* Reject small composites early. They are done much faster in software. */
-    if (!pSrcPicture->repeat &&
+    /* Reject composites too small to be faster on the 3D engine. */
+    if (pSrcPicture->pDrawable && !pSrcPicture->repeat &&
         pSrcPicture->pDrawable->width *
-        pSrcPicture->pDrawable->height < VIA_MIN_COMPOSITE)
+        pSrcPicture->pDrawable->height < pVia->minComposite)
         return FALSE;
 
     if (pMaskPicture && pMaskPicture->pDrawable &&
         !pMaskPicture->repeat &&
         pMaskPicture->pDrawable->width *
-        pMaskPicture->pDrawable->height < VIA_MIN_COMPOSITE)
+        pMaskPicture->pDrawable->height < pVia->minComposite)
         return FALSE;
 
     if (pMaskPicture && pMaskPicture->repeat &&
         pMaskPicture->repeatType != RepeatNormal)
         return FALSE;
 
-    if (pMaskPicture && pMaskPicture->componentAlpha) {
+    if (pMaskPicture && pMaskPicture->componentAlpha &&
+        !v3d->opSupportedCA(op)) {
 #ifdef VIA_DEBUG_COMPOSITE
         viaExaPrintCompositeInfo("Component Alpha operation", op,  pSrcPicture, pMaskPicture, pDstPicture);
 #endif
@@ -308,13 +399,13 @@ viaExaCheckComposite_H2(int op, PicturePtr pSrcPicture,
     }
 
     /*
-     * FIXME: A8 destination formats are currently not supported and do not
-     * seem supported by the hardware, although there are some leftover
-     * register settings apparent in the via_3d_reg.h file. We need to fix this
-     * (if important), by using component ARGB8888 operations with bitmask.
+     * A8 destinations are not supported by the hardware, but are emulated
+     * with byte lanes of an ARGB8888 surface, see viaExaCheckA8Dst.
      */
 
-    if (!v3d->dstSupported(pDstPicture->format)) {
+    if (!v3d->dstSupported(pDstPicture->format) &&
+        !(pDstPicture->format == PICT_a8 &&
+          viaExaCheckA8Dst(op, pSrcPicture, pMaskPicture))) {
 #ifdef VIA_DEBUG_COMPOSITE
         viaExaPrintCompositeInfo(" Destination format not supported", op, pSrcPicture, pMaskPicture, pDstPicture);
 #endif
@@ -347,25 +438,22 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
     VIAPtr pVia = VIAPTR(pScrn);
     Via3DState *v3d = &pVia->v3d;
     int curTex = 0;
-    ViaTexBlendingModes srcMode;
+    ViaTexBlendingModes srcMode, maskMode;
+    ViaTextureModes srcWrap;
     Bool isAGP;
     unsigned long offset;
 
-    /* Workaround: EXA crash with new libcairo2 on a VIA VX800 (#298) */
-    /* TODO Add real source only pictures */
-    if (!pSrc) {
-	    ErrorF("pSrc is NULL\n");
-	    return FALSE;
-	}
+    if (viaExaIsAGPPool(pDst))
+        return FALSE;
 
-    v3d->setDestination(v3d, exaGetPixmapOffset(pDst),
-                        exaGetPixmapPitch(pDst), pDstPicture->format);
-    v3d->setCompositeOperator(v3d, op);
+    pVia->dstA8 = (pDstPicture->format == PICT_a8);
+    viaExaTile3DSetup(pScrn, pDst,
+                      (pVia->dstA8) ? PICT_a8r8g8b8 : pDstPicture->format,
+                      pVia->dstA8);
+    v3d->setCompositeOperator(v3d, op, pMaskPicture &&
+                              pMaskPicture->componentAlpha);
     v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0xFF);
 
-    viaOrder(pSrc->drawable.width, &width);
-    viaOrder(pSrc->drawable.height, &height);
-
     /*
      * For one-pixel repeat mask pictures we avoid using multitexturing by
      * modifying the src's texture blending equation and feed the pixel
@@ -382,8 +470,12 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
         pVia->maskP = pMask->devPrivate.ptr;
         pVia->maskFormat = pMaskPicture->format;
         pVia->componentAlpha = pMaskPicture->componentAlpha;
-        srcMode = ((pMaskPicture->componentAlpha)
-                   ? via_src_onepix_comp_mask : via_src_onepix_mask);
+        if (!pMaskPicture->componentAlpha)
+            srcMode = via_src_onepix_mask;
+        else if (op == PictOpOutReverse)
+            srcMode = via_src_onepix_comp_mask_alpha;
+        else
+            srcMode = via_src_onepix_comp_mask;
     }
 
     /*
@@ -392,7 +484,13 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
      */
 
     pVia->srcP = NULL;
-    if (pSrcPicture && pSrcPicture->repeat
+    pVia->gradPict = NULL;
+    pVia->srcTransformed = FALSE;
+    if (!pSrcPicture->pDrawable) {
+        /* Source-only picture: a solid colour or a gradient. */
+        if (!viaExaPrepareSourcePict(pScrn, pSrcPicture))
+            return FALSE;
+    } else if (pSrcPicture->repeat
         && (pSrcPicture->pDrawable->height == 1)
         && (pSrcPicture->pDrawable->width == 1)
         && viaExpandablePixel(pSrcPicture->format)) {
@@ -407,22 +505,52 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
         return FALSE;
     }
 
-    if (!pVia->srcP) {
-        offset = exaGetPixmapOffset(pSrc);
+    if (pVia->dstA8) {
+        if (srcMode == via_src)
+            srcMode = via_src_alpha;
+        else if (srcMode == via_src_onepix_mask)
+            srcMode = via_src_onepix_comp_mask_alpha;
+    }
+
+    if (pVia->gradPict) {
+        /* The texture is set up band by band in Composite. */
+        pVia->gradMode = srcMode;
+        curTex++;
+    } else if (!pVia->srcP) {
+        /* Transformed sources must not wrap, see viaExaCheckTransform. */
+        srcWrap = (pSrcPicture->transform) ? via_clamp : via_repeat;
+        /* Largest texture the 3D engine can sample. */
+        if (pSrc->drawable.width > VIA_TILE ||
+            pSrc->drawable.height > VIA_TILE)
+            return FALSE;
+        viaOrder(pSrc->drawable.width, &width);
+        viaOrder(pSrc->drawable.height, &height);
+        offset = viaExaPixmapOffset(pSrc);
         isAGP = viaIsAGP(pVia, pSrc, &offset);
         if (!isAGP && !viaExaIsOffscreen(pSrc))
             return FALSE;
         if (!v3d->setTexture(v3d, curTex, offset,
                              exaGetPixmapPitch(pSrc), pVia->nPOT[curTex],
                              1 << width, 1 << height, pSrcPicture->format,
-                             via_repeat, via_repeat, srcMode, isAGP)) {
+                             srcWrap, srcWrap, srcMode, isAGP)) {
             return FALSE;
         }
+        if (pSrcPicture->transform)
+            viaExaPrepareTransform(pScrn, op, pSrcPicture, pSrc, curTex);
         curTex++;
     }
 
     if (pMaskPicture && !pVia->maskP) {
-        offset = exaGetPixmapOffset(pMask);
+        if (!pMaskPicture->componentAlpha)
+            maskMode = via_mask;
+        else if (op == PictOpOutReverse)
+            maskMode = via_comp_mask_alpha;
+        else
+            maskMode = via_comp_mask;
+        if (pMask->drawable.width > VIA_TILE ||
+            pMask->drawable.height > VIA_TILE)
+            return FALSE;
+        offset = viaExaPixmapOffset(pMask);
         isAGP = viaIsAGP(pVia, pMask, &offset);
         if (!isAGP && !viaExaIsOffscreen(pMask))
             return FALSE;
@@ -432,8 +560,7 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
                              exaGetPixmapPitch(pMask), pVia->nPOT[curTex],
                              1 << width, 1 << height, pMaskPicture->format,
                              via_repeat, via_repeat,
-                             ((pMaskPicture->componentAlpha)
-                              ? via_comp_mask : via_mask), isAGP)) {
+                             maskMode, isAGP)) {
             return FALSE;
         }
         curTex++;
@@ -441,25 +568,39 @@ viaExaPrepareComposite_H2(int op, PicturePtr pSrcPicture,
 
     v3d->setFlags(v3d, curTex, FALSE, TRUE, TRUE);
     v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
-    v3d->emitClipRect(v3d, &pVia->cb, 0, 0, pDst->drawable.width,
-                      pDst->drawable.height);
+    viaExaTile3DClip(pScrn);
 
     return TRUE;
 }
 
-void
-viaExaComposite_H2(PixmapPtr pDst, int srcX, int srcY, int maskX, int maskY,
-                    int dstX, int dstY, int width, int height)
+static void
+viaExaCompositeTile_H2(PixmapPtr pDst, int srcX, int srcY, int maskX,
+                       int maskY, int dstX, int dstY, int width, int height)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
     VIAPtr pVia = VIAPTR(pScrn);
     Via3DState *v3d = &pVia->v3d;
     CARD32 col;
 
+    if (pVia->srcTransformed &&
+        !viaExaClipTransform(pScrn, &srcX, &srcY, &maskX, &maskY,
+                             &dstX, &dstY, &width, &height))
+        return;
+
     if (pVia->maskP) {
         viaPixelARGB8888(pVia->maskFormat, pVia->maskP, &col);
         v3d->setTexBlendCol(v3d, 0, pVia->componentAlpha, col);
     }
+    if (pVia->dstA8) {
+        viaExaCompositeA8(pScrn, srcX, srcY, maskX, maskY,
+                          dstX, dstY, width, height);
+        return;
+    }
+    if (pVia->gradPict) {
+        viaExaGradientComposite(pScrn, srcX, srcY, maskX, maskY,
+                                dstX, dstY, width, height);
+        return;
+    }
     if (pVia->srcP) {
         viaPixelARGB8888(pVia->srcFormat, pVia->srcP, &col);
         v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, col & 0x00FFFFFF, col >> 24);
@@ -474,6 +615,28 @@ viaExaComposite_H2(PixmapPtr pDst, int srcX, int srcY, int maskX, int maskY,
                   width, height);
 }
 
+/*
+ * Draw each part in its own VIA_TILE square of large destinations.
+ */
+void
+viaExaComposite_H2(PixmapPtr pDst, int srcX, int srcY, int maskX, int maskY,
+                    int dstX, int dstY, int width, int height)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->drawable.pScreen);
+    ViaTileIter tile;
+    int x, y;
+
+    viaExaTileInit(&tile, dstX, dstY, width, height);
+    while (viaExaTileNext(&tile)) {
+        x = tile.x;
+        y = tile.y;
+        viaExaTile3D(pScrn, &x, &y);
+        viaExaCompositeTile_H2(pDst, srcX + tile.x - dstX,
+                               srcY + tile.y - dstY, maskX + tile.x - dstX,
+                               maskY + tile.y - dstY, x, y, tile.w, tile.h);
+    }
+}
+
 void
 viaAccelTextureBlit(ScrnInfoPtr pScrn, unsigned long srcOffset,
                     unsigned srcPitch, unsigned w, unsigned h, unsigned srcX,
@@ -497,4 +660,5 @@ viaAccelTextureBlit(ScrnInfoPtr pScrn, unsigned long srcOffset,
     v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
     v3d->emitClipRect(v3d, &pVia->cb, dstX, dstY, w, h);
     v3d->emitQuad(v3d, &pVia->cb, dstX, dstY, srcX, srcY, 0, 0, w, h);
+    v3d->flushQuads(v3d, &pVia->cb);
 }
@@ -58,6 +58,8 @@ typedef struct {
     drmModeCrtcPtr mode_crtc;
 #endif
     struct buffer_object *cursor_bo;
+    struct buffer_object *rotate_bo;
+    unsigned rotate_pitch;
     unsigned rotate_fb_id;
     int index;
 } drmmode_crtc_private_rec, *drmmode_crtc_private_ptr;
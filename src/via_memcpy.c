@@ -566,7 +566,8 @@ viaVidCopyInit(const char *copyType, ScreenPtr pScreen)
      * Allocate an area of offscreen FB memory, (buf1), a simulated video
      * player buffer (buf2) and a pool of uninitialized "video" data (buf3).
      */
-    tmpFbBuffer = drm_bo_alloc(pScrn, alignSize, 32, TTM_PL_FLAG_VRAM);
+    tmpFbBuffer = drm_bo_alloc(pScrn, alignSize, 32,
+                               TTM_PL_FLAG_VRAM, VIA_BO_TEMP);
     if (!tmpFbBuffer)
         return libc_YUV42X;
     if (NULL == (buf2 = (unsigned char *)malloc(testSize))) {
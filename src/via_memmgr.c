@@ -24,6 +24,7 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <signal.h>
 #include <sys/mman.h>
 
 #include "xf86.h"
@@ -70,14 +71,736 @@ exit:
     return ret;
 }
 
+/*
+ * Range heap.
+ *
+ * A best-fit allocator over a range of offsets, with coalescing of
+ * neighbouring free blocks so that freed buffers merge back into large
+ * blocks. The blocks are kept in a list sorted by offset.
+ */
+Bool
+viaHeapInit(struct via_heap *heap, unsigned long start, unsigned long size)
+{
+    memset(heap, 0, sizeof(*heap));
+
+    heap->blocks = calloc(1, sizeof(struct via_heap_block));
+    if (!heap->blocks)
+        return FALSE;
+
+    heap->start = start;
+    heap->size = size;
+    heap->blocks->offset = start;
+    heap->blocks->size = size;
+    heap->blocks->free = TRUE;
+    return TRUE;
+}
+
+void
+viaHeapDestroy(struct via_heap *heap)
+{
+    struct via_heap_block *block;
+
+    while ((block = heap->blocks)) {
+        heap->blocks = block->next;
+        free(block);
+    }
+    heap->size = 0;
+}
+
+Bool
+viaHeapOwns(struct via_heap *heap, unsigned long offset)
+{
+    return (heap->size && offset >= heap->start &&
+            offset < heap->start + heap->size);
+}
+
+/*
+ * Best fit below limit.
+ */
+static struct via_heap_block *
+viaHeapAllocRange(struct via_heap *heap, unsigned long size,
+                  unsigned long alignment, unsigned long limit)
+{
+    struct via_heap_block *block, *best = NULL, *split;
+    unsigned long offset, bestOffset = 0, waste, bestWaste = ~0UL;
+
+    if (alignment < VIA_HEAP_GRAIN)
+        alignment = VIA_HEAP_GRAIN;
+    size = (size + VIA_HEAP_GRAIN - 1) & ~(VIA_HEAP_GRAIN - 1);
+
+    /* Best fit, counting the padding needed for the alignment. */
+    for (block = heap->blocks; block; block = block->next) {
+        if (!block->free)
+            continue;
+        offset = (block->offset + alignment - 1) / alignment * alignment;
+        if (offset + size > block->offset + block->size ||
+            offset + size > limit)
+            continue;
+        waste = block->size - size;
+        if (waste < bestWaste) {
+            best = block;
+            bestOffset = offset;
+            bestWaste = waste;
+            if (!waste)
+                break;
+        }
+    }
+
+    if (!best)
+        return NULL;
+
+    /* Leave the padding in front as a free block of its own. */
+    if (bestOffset > best->offset) {
+        split = calloc(1, sizeof(*split));
+        if (!split)
+            return NULL;
+        split->offset = best->offset;
+        split->size = bestOffset - best->offset;
+        split->free = TRUE;
+        split->prev = best->prev;
+        split->next = best;
+        if (best->prev)
+            best->prev->next = split;
+        else
+            heap->blocks = split;
+        best->prev = split;
+        best->offset = bestOffset;
+        best->size -= split->size;
+    }
+
+    /* And the rest behind it. */
+    if (best->size > size) {
+        split = calloc(1, sizeof(*split));
+        if (!split)
+            return NULL;
+        split->offset = best->offset + size;
+        split->size = best->size - size;
+        split->free = TRUE;
+        split->prev = best;
+        split->next = best->next;
+        if (best->next)
+            best->next->prev = split;
+        best->next = split;
+        best->size = size;
+    }
+
+    best->free = FALSE;
+    heap->used += best->size;
+    if (heap->used > heap->peak)
+        heap->peak = heap->used;
+
+    return best;
+}
+
+struct via_heap_block *
+viaHeapAlloc(struct via_heap *heap, unsigned long size,
+             unsigned long alignment)
+{
+    if (!heap->size)
+        return NULL;
+
+    heap->allocs++;
+    return viaHeapAllocRange(heap, size, alignment, ~0UL);
+}
+
+static void
+viaHeapMerge(struct via_heap_block *block)
+{
+    struct via_heap_block *next = block->next;
+
+    block->size += next->size;
+    block->next = next->next;
+    if (next->next)
+        next->next->prev = block;
+    free(next);
+}
+
+void
+viaHeapFree(struct via_heap *heap, struct via_heap_block *block)
+{
+    block->free = TRUE;
+    heap->used -= block->size;
+
+    if (block->next && block->next->free)
+        viaHeapMerge(block);
+    if (block->prev && block->prev->free)
+        viaHeapMerge(block->prev);
+}
+
+/*
+ * The allocated block at offset, or NULL.
+ */
+struct via_heap_block *
+viaHeapFind(struct via_heap *heap, unsigned long offset)
+{
+    struct via_heap_block *block;
+
+    for (block = heap->blocks; block; block = block->next)
+        if (block->offset == offset)
+            return block->free ? NULL : block;
+
+    return NULL;
+}
+
+void
+viaHeapReport(ScrnInfoPtr pScrn, struct via_heap *heap, const char *name,
+              MessageType type)
+{
+    struct via_heap_block *block;
+    unsigned long largest = 0;
+    unsigned numFree = 0;
+
+    if (!heap->size)
+        return;
+
+    for (block = heap->blocks; block; block = block->next) {
+        if (!block->free)
+            continue;
+        numFree++;
+        if (block->size > largest)
+            largest = block->size;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, type,
+                "%s: %lu of %lu KB used (peak %lu KB), "
+                "%u free blocks, largest %lu KB.\n",
+                name, heap->used >> 10, heap->size >> 10, heap->peak >> 10,
+                numFree, largest >> 10);
+    xf86DrvMsg(pScrn->scrnIndex, type,
+                "%s: %u allocations, %u fell back elsewhere, "
+                "%u failed, %u moved.\n",
+                name, heap->allocs, heap->fallbacks, heap->failures,
+                heap->moves);
+}
+
+/*
+ * Driver VRAM heap.
+ *
+ * Without DRI, buffers used to come from the EXA or the offscreen manager
+ * heap, where long-lived locked buffers like Xv surfaces end up scattered
+ * between pixmaps and split the free space. They now come from a heap of
+ * their own at the end of video memory. The pixmap heap is left to EXA,
+ * which compacts it by moving pixmaps with the 2D engine while the server
+ * is idle. When the driver heap is full, allocations still fall back to
+ * the old allocators. The driver heap itself is never compacted, as the
+ * engines keep the addresses of the buffers in it.
+ *
+ * With driver allocated EXA pixmaps, EXA has no heap. The pixmaps, the
+ * front buffer and the rotation shadows get a pixmap heap of their own
+ * over the rest of the free video memory, so that the driver buffers
+ * still stay out of their way. Driver buffers fall back to the pixmap
+ * heap, but pixmaps never go to the driver heap. When a pixmap does not
+ * fit, via_exa.c compacts the pixmap heap with viaVRAMHeapMove.
+ */
+void
+viaVRAMHeapInit(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    unsigned long offscreen, size;
+
+    memset(&pVia->vramHeap, 0, sizeof(pVia->vramHeap));
+    memset(&pVia->pixmapHeap, 0, sizeof(pVia->pixmapHeap));
+
+    offscreen = pVia->FBFreeEnd - pScrn->virtualY * pVia->Bpl;
+    size = offscreen / 4;
+    if (size > VIA_HEAP_MAX)
+        size = VIA_HEAP_MAX;
+    size &= ~(VIA_HEAP_GRAIN - 1);
+    if (size < VIA_HEAP_MIN || size > offscreen / 2) {
+        /* Driver pixmaps need a heap, they share this one then. */
+        if (pVia->exaDriverPixmaps) {
+            size = (pVia->FBFreeEnd - pVia->FBFreeStart) &
+                   ~(VIA_HEAP_GRAIN - 1);
+        } else {
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                        "Too little video memory for a driver heap.\n");
+            return;
+        }
+    }
+
+    if (!viaHeapInit(&pVia->vramHeap, pVia->FBFreeEnd - size, size))
+        return;
+    pVia->FBFreeEnd -= size;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                "Using %lu KB at 0x%lx for the driver heap.\n",
+                size >> 10, pVia->vramHeap.start);
+
+    if (!pVia->exaDriverPixmaps)
+        return;
+
+    size = (pVia->FBFreeEnd - pVia->FBFreeStart) & ~(VIA_HEAP_GRAIN - 1);
+    if (size && viaHeapInit(&pVia->pixmapHeap, pVia->FBFreeStart, size))
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                    "Using %lu KB at 0x%lx for the pixmap heap.\n",
+                    size >> 10, pVia->pixmapHeap.start);
+}
+
+void
+viaVRAMHeapFini(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (pVia->pixmapHeap.size) {
+        viaHeapReport(pScrn, &pVia->pixmapHeap, "Pixmap heap", X_INFO);
+        viaHeapDestroy(&pVia->pixmapHeap);
+    }
+
+    if (!pVia->vramHeap.size)
+        return;
+
+    viaHeapReport(pScrn, &pVia->vramHeap, "Driver heap", X_INFO);
+    pVia->FBFreeEnd += pVia->vramHeap.size;
+    viaHeapDestroy(&pVia->vramHeap);
+}
+
+static int
+viaVRAMHeapAlloc(struct via_heap *heap, struct buffer_object *obj,
+                 unsigned long size, unsigned long alignment)
+{
+    struct via_heap_block *block;
+
+    block = viaHeapAlloc(heap, size, alignment);
+    if (!block)
+        return -ENOMEM;
+
+    obj->offset = block->offset;
+    obj->handle = (unsigned long) block;
+    obj->domain = TTM_PL_FLAG_VRAM;
+    obj->size = block->size;
+    return 0;
+}
+
+/*
+ * Move a pixmap heap buffer down into the best fitting hole below it. The
+ * caller copies the contents from *oldOffset before anything else can be
+ * put in the old place.
+ */
+Bool
+viaVRAMHeapMove(ScrnInfoPtr pScrn, struct buffer_object *obj,
+                unsigned long *oldOffset)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_heap *heap = &pVia->pixmapHeap;
+    struct via_heap_block *block;
+
+    if (pVia->directRenderingType != DRI_NONE ||
+        obj->domain != TTM_PL_FLAG_VRAM || !viaHeapOwns(heap, obj->offset))
+        return FALSE;
+
+    block = viaHeapAllocRange(heap, obj->size, VIA_HEAP_GRAIN, obj->offset);
+    if (!block)
+        return FALSE;
+
+    *oldOffset = obj->offset;
+    viaHeapFree(heap, (struct via_heap_block *) obj->handle);
+    obj->offset = block->offset;
+    obj->handle = (unsigned long) block;
+    if (obj->ptr)
+        obj->ptr = pVia->FBBase + obj->offset;
+    heap->moves++;
+    return TRUE;
+}
+
+/*
+ * Buffer object reuse cache.
+ *
+ * With DRI, every allocation and free is a round trip to the kernel, and
+ * buffers such as Xv surfaces are freed and allocated again with the same
+ * size all the time. Freed buffers are therefore kept in power-of-two size
+ * buckets per domain, and handed out again to allocations that fit. Cached
+ * buffers are given back to the kernel by a timer when they are unused for
+ * VIA_BO_CACHE_AGE ms, when the cache grows over its limit, and when the
+ * kernel runs out of memory. The limit is kept small, since under DRI1 the
+ * cached video memory is taken from what the 3D driver can get.
+ */
+static struct via_bo_cache *
+viaBOCache(VIAPtr pVia, int domain)
+{
+    if (pVia->directRenderingType == DRI_NONE)
+        return NULL;
+
+    switch (domain) {
+    case TTM_PL_FLAG_VRAM:
+        return &pVia->boCache[0];
+    case TTM_PL_FLAG_TT:
+        return &pVia->boCache[1];
+    default:
+        return NULL;
+    }
+}
+
+static int
+viaBOCacheBucket(unsigned long size)
+{
+    int i;
+
+    for (i = 0; i < VIA_BO_CACHE_BUCKETS; i++)
+        if (size <= (4096UL << i))
+            return i;
+
+    return -1;
+}
+
+static void drm_bo_release(ScrnInfoPtr pScrn, struct buffer_object *obj);
+
+/*
+ * Give back the cached buffers older than age ms, all of them for age 0.
+ */
+static void
+viaBOCacheTrim(ScrnInfoPtr pScrn, struct via_bo_cache *cache, CARD32 age)
+{
+    CARD32 now = GetTimeInMillis();
+    struct buffer_object **prev, *obj;
+    int i;
+
+    for (i = 0; i < VIA_BO_CACHE_BUCKETS; i++) {
+        /* The lists are sorted newest first. */
+        prev = &cache->bucket[i];
+        while ((obj = *prev) && (now - obj->freed) < age)
+            prev = &obj->next;
+
+        *prev = NULL;
+        while (obj) {
+            struct buffer_object *next = obj->next;
+
+            cache->size -= obj->size;
+            drm_bo_release(pScrn, obj);
+            obj = next;
+        }
+    }
+}
+
+static unsigned long
+viaBOCacheMax(VIAPtr pVia, int domain)
+{
+    unsigned long size;
+
+    if (domain == TTM_PL_FLAG_TT)
+        size = pVia->agpSize;
+    else if (pVia->driSize)
+        size = pVia->driSize;
+    else
+        size = (pVia->FBFreeEnd - pVia->FBFreeStart) >> 2;
+
+    return min(size / VIA_BO_CACHE_SHARE, VIA_BO_CACHE_MAX);
+}
+
+static CARD32
+viaBOCacheTimer(OsTimerPtr timer, CARD32 now, void *arg)
+{
+    ScrnInfoPtr pScrn = arg;
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    viaBOCacheTrim(pScrn, &pVia->boCache[0], VIA_BO_CACHE_AGE);
+    viaBOCacheTrim(pScrn, &pVia->boCache[1], VIA_BO_CACHE_AGE);
+
+    /* Stop once the caches are empty, allocations restart it. */
+    if (!pVia->boCache[0].size && !pVia->boCache[1].size)
+        return 0;
+    return VIA_BO_CACHE_AGE;
+}
+
+static struct buffer_object *
+viaBOCacheGet(ScrnInfoPtr pScrn, unsigned long size,
+              unsigned long alignment, int domain)
+{
+    struct via_bo_cache *cache = viaBOCache(VIAPTR(pScrn), domain);
+    struct buffer_object **prev, *obj;
+    int i = viaBOCacheBucket(size);
+
+    if (!cache || i < 0)
+        return NULL;
+
+    for (prev = &cache->bucket[i]; (obj = *prev); prev = &obj->next) {
+        if (obj->size < size)
+            continue;
+        if (alignment > 1 && (obj->offset % alignment))
+            continue;
+
+        *prev = obj->next;
+        obj->next = NULL;
+        cache->size -= obj->size;
+        DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                            "Reusing %lu bytes at 0x%lx for a %lu byte "
+                            "allocation.\n",
+                            obj->size, obj->offset, size));
+        return obj;
+    }
+
+    return NULL;
+}
+
+static Bool
+viaBOCachePut(ScrnInfoPtr pScrn, struct buffer_object *obj)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_bo_cache *cache = viaBOCache(pVia, obj->domain);
+    unsigned long max = viaBOCacheMax(pVia, obj->domain);
+    int i = viaBOCacheBucket(obj->size);
+
+    if (!cache || i < 0)
+        return FALSE;
+
+    if (cache->size + obj->size > max) {
+        viaBOCacheTrim(pScrn, cache, VIA_BO_CACHE_AGE);
+        if (cache->size + obj->size > max)
+            return FALSE;
+    }
+
+    if (!pVia->boCache[0].size && !pVia->boCache[1].size)
+        pVia->boCacheTimer = TimerSet(pVia->boCacheTimer, 0,
+                                      VIA_BO_CACHE_AGE, viaBOCacheTimer,
+                                      pScrn);
+
+    if (obj->ptr)
+        drm_bo_unmap(pScrn, obj);
+
+    obj->freed = GetTimeInMillis();
+    obj->next = cache->bucket[i];
+    cache->bucket[i] = obj;
+    cache->size += obj->size;
+    return TRUE;
+}
+
+/*
+ * Give back all cached buffers, before the memory manager goes away.
+ */
+void
+drm_bo_cache_purge(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (pVia->boCacheTimer) {
+        TimerFree(pVia->boCacheTimer);
+        pVia->boCacheTimer = NULL;
+    }
+
+    viaBOCacheTrim(pScrn, &pVia->boCache[0], 0);
+    viaBOCacheTrim(pScrn, &pVia->boCache[1], 0);
+}
+
+/*
+ * Memory statistics.
+ *
+ * Every buffer object is tagged with what it is used for, and the bytes
+ * and buffers allocated now and at most are kept per domain and purpose.
+ * Buffers sitting in the reuse cache do not count as allocated. The
+ * statistics are written to the log when the server gets SIGUSR2, and
+ * whatever is still allocated when the screen closes is reported as
+ * leaked.
+ */
+static const char *viaBOPurposeName[VIA_BO_PURPOSES] = {
+    [VIA_BO_OTHER]  = "Other",
+    [VIA_BO_FRONT]  = "Front buffer",
+    [VIA_BO_CURSOR] = "Cursors",
+    [VIA_BO_ROTATE] = "Rotation shadows",
+    [VIA_BO_XV]     = "Xv surfaces",
+    [VIA_BO_XVMC]   = "XvMC surfaces",
+    [VIA_BO_EXA]    = "EXA scratch",
+    [VIA_BO_PIXMAP] = "Pixmaps",
+    [VIA_BO_DRI]    = "DRI offscreen",
+    [VIA_BO_VQ]     = "Virtual queue",
+    [VIA_BO_SYNC]   = "Sync markers",
+    [VIA_BO_TEMP]   = "Temporary"
+};
+
+static const char *viaBODomainName[VIA_BO_DOMAINS] = {
+    "VRAM", "AGP", "System memory"
+};
+
+/* Counted up by the SIGUSR2 handler, and checked by every screen. */
+static volatile sig_atomic_t viaMemStatsRequests;
+static OsSigHandlerPtr viaMemStatsOldSignal;
+
+static int
+viaBODomainIndex(int domain)
+{
+    switch (domain) {
+    case TTM_PL_FLAG_VRAM:
+        return 0;
+    case TTM_PL_FLAG_TT:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+static void
+viaBOStatsAdd(struct via_bo_stats *stats, unsigned long size)
+{
+    stats->live += size;
+    stats->count++;
+    if (stats->live > stats->peak)
+        stats->peak = stats->live;
+}
+
+static void
+viaBOStatsRemove(struct via_bo_stats *stats, unsigned long size)
+{
+    stats->live -= size;
+    stats->count--;
+}
+
+static void
+viaBOAccount(VIAPtr pVia, struct buffer_object *obj, Bool alloc)
+{
+    struct via_mem_stats *stats = &pVia->memStats;
+    int i = viaBODomainIndex(obj->domain);
+
+    if (alloc) {
+        viaBOStatsAdd(&stats->total[i], obj->size);
+        viaBOStatsAdd(&stats->purpose[i][obj->purpose], obj->size);
+    } else {
+        viaBOStatsRemove(&stats->total[i], obj->size);
+        viaBOStatsRemove(&stats->purpose[i][obj->purpose], obj->size);
+    }
+}
+
+/*
+ * Log the memory statistics, or with leaks set, only what is still
+ * allocated.
+ */
+void
+viaMemStatsReport(ScrnInfoPtr pScrn, MessageType type, Bool leaks)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    struct via_mem_stats *stats = &pVia->memStats;
+    int i, j;
+
+    for (i = 0; i < VIA_BO_DOMAINS; i++) {
+        struct via_bo_stats *total = &stats->total[i];
+
+        if (leaks) {
+            if (!total->count)
+                continue;
+            xf86DrvMsg(pScrn->scrnIndex, type,
+                        "%s: %lu KB in %u buffers still allocated.\n",
+                        viaBODomainName[i], total->live >> 10,
+                        total->count);
+        } else {
+            if (!total->peak && !stats->failed[i])
+                continue;
+            xf86DrvMsg(pScrn->scrnIndex, type,
+                        "%s: %lu KB in %u buffers, peak %lu KB, "
+                        "%lu KB cached, %u failed allocations.\n",
+                        viaBODomainName[i], total->live >> 10,
+                        total->count, total->peak >> 10,
+                        (i < 2) ? pVia->boCache[i].size >> 10 : 0,
+                        stats->failed[i]);
+        }
+
+        for (j = 0; j < VIA_BO_PURPOSES; j++) {
+            struct via_bo_stats *purpose = &stats->purpose[i][j];
+
+            if (leaks ? !purpose->count : !purpose->peak)
+                continue;
+            xf86DrvMsg(pScrn->scrnIndex, type,
+                        "    %s: %lu KB in %u buffers, peak %lu KB.\n",
+                        viaBOPurposeName[j], purpose->live >> 10,
+                        purpose->count, purpose->peak >> 10);
+        }
+    }
+
+    if (leaks)
+        return;
+
+    if (pVia->vramHeap.size)
+        viaHeapReport(pScrn, &pVia->vramHeap, "Driver heap", type);
+    if (pVia->pixmapHeap.size)
+        viaHeapReport(pScrn, &pVia->pixmapHeap, "Pixmap heap", type);
+    if (pVia->agpPool.size)
+        viaHeapReport(pScrn, &pVia->agpPool, "AGP pixmap pool", type);
+}
+
+static void
+viaMemStatsSignal(int signo)
+{
+    viaMemStatsRequests++;
+}
+
+static CARD32
+viaMemStatsTimer(OsTimerPtr timer, CARD32 now, void *arg)
+{
+    ScrnInfoPtr pScrn = arg;
+    VIAPtr pVia = VIAPTR(pScrn);
+    unsigned requests = viaMemStatsRequests;
+
+    if (pVia->memStats.request != requests) {
+        pVia->memStats.request = requests;
+        viaMemStatsReport(pScrn, X_INFO, FALSE);
+    }
+
+    return VIA_MEM_STATS_POLL;
+}
+
+void
+viaMemStatsInit(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    OsSigHandlerPtr old;
+
+    /*
+     * SIGUSR1 is taken by the server for VT switching and for telling its
+     * parent that it is ready. SIGUSR2 is normally free, but don't take it
+     * over from anyone else.
+     */
+    old = OsSignal(SIGUSR2, viaMemStatsSignal);
+    if (old != SIG_IGN && old != SIG_DFL && old != viaMemStatsSignal) {
+        OsSignal(SIGUSR2, old);
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                    "SIGUSR2 is already handled, memory statistics "
+                    "can't be requested.\n");
+        return;
+    }
+    if (old != viaMemStatsSignal)
+        viaMemStatsOldSignal = old;
+
+    pVia->memStats.signal = TRUE;
+    pVia->memStats.request = viaMemStatsRequests;
+    pVia->memStats.timer = TimerSet(pVia->memStats.timer, 0,
+                                    VIA_MEM_STATS_POLL, viaMemStatsTimer,
+                                    pScrn);
+}
+
+void
+viaMemStatsFini(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (pVia->memStats.timer) {
+        TimerFree(pVia->memStats.timer);
+        pVia->memStats.timer = NULL;
+    }
+
+    if (pVia->memStats.signal) {
+        OsSignal(SIGUSR2, viaMemStatsOldSignal);
+        pVia->memStats.signal = FALSE;
+    }
+
+    viaMemStatsReport(pScrn, X_WARNING, TRUE);
+}
+
 struct buffer_object *
 drm_bo_alloc(ScrnInfoPtr pScrn, unsigned long size,
-                unsigned long alignment, int domain)
+                unsigned long alignment, int domain, int purpose)
 {
     struct buffer_object *obj = NULL;
     VIAPtr pVia = VIAPTR(pScrn);
+    struct via_heap *heap = &pVia->vramHeap;
+    Bool purged = FALSE;
     int ret = 0;
 
+    if (purpose < 0 || purpose >= VIA_BO_PURPOSES)
+        purpose = VIA_BO_OTHER;
+
+    obj = viaBOCacheGet(pScrn, size, alignment, domain);
+    if (obj) {
+        obj->purpose = purpose;
+        viaBOAccount(pVia, obj, TRUE);
+        return obj;
+    }
+
     obj = xnfcalloc(1, sizeof(*obj));
     if (!obj) {
         DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -86,11 +809,45 @@ drm_bo_alloc(ScrnInfoPtr pScrn, unsigned long size,
         goto exit;
     }
 
+retry:
     switch (domain) {
     case TTM_PL_FLAG_TT:
     case TTM_PL_FLAG_VRAM:
         if (pVia->directRenderingType == DRI_NONE) {
-            if (!pVia->useEXA) {
+            /*
+             * Rotation shadows are rendered to like pixmaps. Classic EXA
+             * only accelerates pixmaps inside its own heap, so they skip
+             * the driver heap there.
+             */
+            if ((purpose == VIA_BO_PIXMAP || purpose == VIA_BO_FRONT ||
+                 purpose == VIA_BO_ROTATE) && pVia->pixmapHeap.size)
+                heap = &pVia->pixmapHeap;
+            if (purpose == VIA_BO_ROTATE && pVia->useEXA &&
+                !pVia->exaDriverPixmaps) {
+                ret = -ENOMEM;
+            } else {
+                ret = viaVRAMHeapAlloc(heap, obj, size, alignment);
+                if (!ret) {
+                    DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                                        "%lu bytes of driver heap memory "
+                                        "allocated at 0x%lx.\n",
+                                        obj->size, obj->offset));
+                    break;
+                }
+                /* Report the first time the heap runs out. */
+                if (heap->size && !heap->fallbacks++)
+                    viaHeapReport(pScrn, heap,
+                                  heap == &pVia->pixmapHeap ?
+                                  "Pixmap heap" : "Driver heap", X_WARNING);
+            }
+
+            if (pVia->exaDriverPixmaps) {
+                ret = -ENOMEM;
+                if (heap == &pVia->vramHeap && pVia->pixmapHeap.size) {
+                    heap = &pVia->pixmapHeap;
+                    ret = viaVRAMHeapAlloc(heap, obj, size, alignment);
+                }
+            } else if (!pVia->useEXA) {
                 ret = viaOffScreenLinear(pScrn, obj,
                                             size, alignment);
                 if (ret) {
@@ -180,7 +937,19 @@ drm_bo_alloc(ScrnInfoPtr pScrn, unsigned long size,
         break;
     }
 
+    /* Out of memory: give back what the cache holds and try again. */
+    if (ret && ret != -ENXIO && !purged && viaBOCache(pVia, domain) &&
+        viaBOCache(pVia, domain)->size) {
+        viaBOCacheTrim(pScrn, viaBOCache(pVia, domain), 0);
+        purged = TRUE;
+        ret = 0;
+        goto retry;
+    }
+
     if (ret) {
+        pVia->memStats.failed[viaBODomainIndex(domain)]++;
+        if (pVia->directRenderingType == DRI_NONE)
+            heap->failures++;
         DEBUG(xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                             "DRM memory allocation failed.\n"
                             "Error Code: %d\n", ret));
@@ -189,6 +958,9 @@ drm_bo_alloc(ScrnInfoPtr pScrn, unsigned long size,
         goto exit;
     }
 
+    obj->purpose = purpose;
+    viaBOAccount(pVia, obj, TRUE);
+
 exit:
      return obj;
 }
@@ -237,6 +1009,17 @@ drm_bo_unmap(ScrnInfoPtr pScrn, struct buffer_object *obj)
 
 void
 drm_bo_free(ScrnInfoPtr pScrn, struct buffer_object *obj)
+{
+    if (!obj)
+        return;
+
+    viaBOAccount(VIAPTR(pScrn), obj, FALSE);
+    if (!viaBOCachePut(pScrn, obj))
+        drm_bo_release(pScrn, obj);
+}
+
+static void
+drm_bo_release(ScrnInfoPtr pScrn, struct buffer_object *obj)
 {
     VIAPtr pVia = VIAPTR(pScrn);
 
@@ -246,7 +1029,13 @@ drm_bo_free(ScrnInfoPtr pScrn, struct buffer_object *obj)
         case TTM_PL_FLAG_VRAM:
         case TTM_PL_FLAG_TT:
             if (pVia->directRenderingType == DRI_NONE) {
-                if (!pVia->useEXA) {
+                if (viaHeapOwns(&pVia->vramHeap, obj->offset)) {
+                    viaHeapFree(&pVia->vramHeap,
+                                (struct via_heap_block *) obj->handle);
+                } else if (viaHeapOwns(&pVia->pixmapHeap, obj->offset)) {
+                    viaHeapFree(&pVia->pixmapHeap,
+                                (struct via_heap_block *) obj->handle);
+                } else if (!pVia->useEXA) {
                     FBLinearPtr linear = (FBLinearPtr) obj->handle;
 
                     xf86FreeOffscreenLinear(linear);
@@ -29,6 +29,34 @@
 #define TTM_PL_FLAG_TT		2
 #define TTM_PL_FLAG_VRAM	4
 
+/* What a buffer object is used for, for the memory statistics. */
+enum via_bo_purpose {
+    VIA_BO_OTHER = 0,
+    VIA_BO_FRONT,
+    VIA_BO_CURSOR,
+    VIA_BO_ROTATE,
+    VIA_BO_XV,
+    VIA_BO_XVMC,
+    VIA_BO_EXA,
+    VIA_BO_PIXMAP,
+    VIA_BO_DRI,
+    VIA_BO_VQ,
+    VIA_BO_SYNC,
+    VIA_BO_TEMP,
+    VIA_BO_PURPOSES
+};
+
+/* VRAM, AGP and system memory. */
+#define VIA_BO_DOMAINS		3
+
+/* Reuse cache buckets, for sizes up to 4 kB << (VIA_BO_CACHE_BUCKETS - 1). */
+#define VIA_BO_CACHE_BUCKETS	14
+/* Cached buffers unused for this long (ms) are given back. */
+#define VIA_BO_CACHE_AGE	2000
+/* Most memory kept cached per domain: a share of what DRI gets, in bytes. */
+#define VIA_BO_CACHE_SHARE	16
+#define VIA_BO_CACHE_MAX	(4 * 1024 * 1024)
+
 struct buffer_object {
     off_t           map_offset;
     unsigned long   handle;
@@ -37,14 +65,86 @@ struct buffer_object {
     unsigned long   size;
     void            *ptr;
     int             domain;
+    int             purpose;            /* enum via_bo_purpose */
+    struct buffer_object *next;         /* In the reuse cache */
+    CARD32          freed;              /* When it entered the cache */
+};
+
+struct via_bo_stats {
+    unsigned long   live;               /* Bytes allocated now */
+    unsigned long   peak;
+    unsigned        count;              /* Buffers allocated now */
+};
+
+struct via_mem_stats {
+    struct via_bo_stats total[VIA_BO_DOMAINS];
+    struct via_bo_stats purpose[VIA_BO_DOMAINS][VIA_BO_PURPOSES];
+    unsigned        failed[VIA_BO_DOMAINS];
+    OsTimerPtr      timer;
+    unsigned        request;
+    Bool            signal;             /* We installed the SIGUSR2 handler */
+};
+
+struct via_bo_cache {
+    struct buffer_object *bucket[VIA_BO_CACHE_BUCKETS];
+    unsigned long   size;
+};
+
+/* How often (ms) to check for a SIGUSR2 memory statistics request. */
+#define VIA_MEM_STATS_POLL	1000
+
+/* Granularity of the range heaps. */
+#define VIA_HEAP_GRAIN		32
+/* Limits of the driver VRAM heap size. */
+#define VIA_HEAP_MIN		(4 * 1024 * 1024)
+#define VIA_HEAP_MAX		(16 * 1024 * 1024)
+
+struct via_heap_block {
+    unsigned long   offset;
+    unsigned long   size;
+    Bool            free;
+    struct via_heap_block *prev;        /* Sorted by offset */
+    struct via_heap_block *next;
+};
+
+struct via_heap {
+    struct via_heap_block *blocks;
+    unsigned long   start;
+    unsigned long   size;
+    unsigned long   used;
+    unsigned long   peak;
+    unsigned        allocs;
+    unsigned        fallbacks;
+    unsigned        failures;
+    unsigned        moves;              /* By the compaction */
 };
 
 
 struct buffer_object *
 drm_bo_alloc(ScrnInfoPtr pScrn, unsigned long size,
-                unsigned long alignment, int domain);
+                unsigned long alignment, int domain, int purpose);
 void *drm_bo_map(ScrnInfoPtr pScrn, struct buffer_object *obj);
 void drm_bo_unmap(ScrnInfoPtr pScrn, struct buffer_object *obj);
 void drm_bo_free(ScrnInfoPtr pScrn, struct buffer_object *);
+void drm_bo_cache_purge(ScrnInfoPtr pScrn);
+void viaMemStatsReport(ScrnInfoPtr pScrn, MessageType type, Bool leaks);
+void viaMemStatsInit(ScrnInfoPtr pScrn);
+void viaMemStatsFini(ScrnInfoPtr pScrn);
+Bool viaHeapInit(struct via_heap *heap, unsigned long start,
+                 unsigned long size);
+void viaHeapDestroy(struct via_heap *heap);
+Bool viaHeapOwns(struct via_heap *heap, unsigned long offset);
+struct via_heap_block *viaHeapAlloc(struct via_heap *heap,
+                                    unsigned long size,
+                                    unsigned long alignment);
+void viaHeapFree(struct via_heap *heap, struct via_heap_block *block);
+struct via_heap_block *viaHeapFind(struct via_heap *heap,
+                                   unsigned long offset);
+void viaHeapReport(ScrnInfoPtr pScrn, struct via_heap *heap,
+                   const char *name, MessageType type);
+void viaVRAMHeapInit(ScrnInfoPtr pScrn);
+void viaVRAMHeapFini(ScrnInfoPtr pScrn);
+Bool viaVRAMHeapMove(ScrnInfoPtr pScrn, struct buffer_object *obj,
+                     unsigned long *oldOffset);
 
 #endif
@@ -44,6 +44,8 @@ typedef enum
     OPTION_NOACCEL,
     OPTION_EXA_NOCOMPOSITE,
     OPTION_EXA_SCRATCH_SIZE,
+    OPTION_EXA_DITHER,
+    OPTION_EXA_DRIVER_PIXMAPS,
     OPTION_SWCURSOR,
     OPTION_SHADOW_FB,
     OPTION_ROTATION_TYPE,
@@ -71,6 +73,8 @@ static OptionInfoRec VIAOptions[] = {
     {OPTION_NOACCEL,             "NoAccel",          OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_EXA_NOCOMPOSITE,     "ExaNoComposite",   OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_EXA_SCRATCH_SIZE,    "ExaScratchSize",   OPTV_INTEGER, {0}, FALSE},
+    {OPTION_EXA_DITHER,          "ExaDither",        OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_EXA_DRIVER_PIXMAPS,  "ExaDriverPixmaps", OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_SWCURSOR,            "SWCursor",         OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_SHADOW_FB,           "ShadowFB",         OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_ROTATION_TYPE,       "RotationType",     OPTV_ANYSTR,  {0}, FALSE},
@@ -110,6 +114,8 @@ viaSetupDefaultOptions(ScrnInfoPtr pScrn)
     pVia->noComposite = FALSE;
     pVia->useEXA = TRUE;
     pVia->exaScratchSize = VIA_SCRATCH_SIZE / 1024;
+    pVia->exaDither = FALSE;
+    pVia->exaDriverPixmaps = FALSE;
     pVia->drmmode.hwcursor = TRUE;
     pVia->VQEnable = TRUE;
     pVia->DRIIrqEnable = TRUE;
@@ -423,8 +429,9 @@ viaProcessOptions(ScrnInfoPtr pScrn)
     xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, VIAOptions);
 
     /*
-     * When rotating, switch shadow frame buffer on and acceleration
-     * off.
+     * SWRandR rotation switches shadow frame buffer on and acceleration
+     * off. HWRandR rotates each CRTC through its own shadow, updated by
+     * the 3D engine.
      */
     if ((s = xf86GetOptValString(VIAOptions, OPTION_ROTATION_TYPE))) {
         if (!xf86NameCmp(s, "SWRandR")) {
@@ -436,13 +443,11 @@ viaProcessOptions(ScrnInfoPtr pScrn)
                         "Rotating screen RandR enabled, "
                         "acceleration disabled\n");
         } else if (!xf86NameCmp(s, "HWRandR")) {
-            pVia->shadowFB = TRUE;
-            pVia->NoAccel = TRUE;
             pVia->RandRRotation = TRUE;
             pVia->rotate = RR_Rotate_0;
             xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
-                        "Hardware accelerated rotating screen is not "
-                        "implemented. Using SW RandR.\n");
+                        "Rotating screen RandR enabled, "
+                        "acceleration enabled\n");
         } else {
             xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
                         "\"%s\" is not a valid"
@@ -549,6 +554,25 @@ viaProcessOptions(ScrnInfoPtr pScrn)
             xf86DrvMsg(pScrn->scrnIndex, from,
                         "EXA scratch area size is %d KB.\n",
                         pVia->exaScratchSize);
+
+            from = xf86GetOptValBool(VIAOptions,
+                                        OPTION_EXA_DITHER,
+                                        &pVia->exaDither) ?
+                    X_CONFIG : X_DEFAULT;
+            xf86DrvMsg(pScrn->scrnIndex, from,
+                        "EXA dithering of depth reducing copies %s.\n",
+                        pVia->exaDither ? "enabled" : "disabled");
+
+#ifdef VIA_EXA_DRIVER_PIXMAPS
+            pVia->exaDriverPixmaps = TRUE;
+            from = xf86GetOptValBool(VIAOptions,
+                                        OPTION_EXA_DRIVER_PIXMAPS,
+                                        &pVia->exaDriverPixmaps) ?
+                    X_CONFIG : X_DEFAULT;
+            xf86DrvMsg(pScrn->scrnIndex, from,
+                        "EXA driver managed pixmaps %s.\n",
+                        pVia->exaDriverPixmaps ? "enabled" : "disabled");
+#endif
         }
     }
 
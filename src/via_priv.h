@@ -157,6 +157,15 @@ typedef struct  {
     Bool MPEG_ON;
     Bool SWVideo_ON;
 
+/* Stream uses the other overlay engine (second Xv port) */
+    Bool altEngine;
+/* Frame shown by V1/V3 when the stream does not go through the HQV */
+    unsigned long dwDisplayAddr;
+
+/* Vblank waits: CRTC the overlay is on, and whether the DRM ioctl failed */
+    int vblankCrtc;
+    Bool vblankIrqBroken;
+
 /*To solve the bandwidth issue */
     unsigned long   gdwUseExtendedFIFO;
 
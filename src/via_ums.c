@@ -657,7 +657,8 @@ viaUMSAccelInit(ScrnInfoPtr pScrn)
                         "Entered %s.\n", __func__));
 
     pVia->VQStart = 0;
-    pVia->vq_bo = drm_bo_alloc(pScrn, VIA_VQ_SIZE, 16, TTM_PL_FLAG_VRAM);
+    pVia->vq_bo = drm_bo_alloc(pScrn, VIA_VQ_SIZE, 16,
+                               TTM_PL_FLAG_VRAM, VIA_BO_VQ);
     if (!pVia->vq_bo)
         goto err;
 
@@ -673,7 +674,8 @@ viaUMSAccelInit(ScrnInfoPtr pScrn)
     viaInitialize3DEngine(pScrn);
 
     /* Sync marker space. */
-    pVia->exa_sync_bo = drm_bo_alloc(pScrn, 32, 32, TTM_PL_FLAG_VRAM);
+    pVia->exa_sync_bo = drm_bo_alloc(pScrn, 32, 32,
+                                     TTM_PL_FLAG_VRAM, VIA_BO_SYNC);
     if (!pVia->exa_sync_bo)
         goto err;
 
@@ -851,6 +853,8 @@ viaUMSScreenInit(ScrnInfoPtr pScrn)
                         "Entered %s.\n", __func__));
 
     if (pVia->directRenderingType == DRI_NONE) {
+        viaVRAMHeapInit(pScrn);
+
         if (!pVia->useEXA) {
             if (!viaInitFB(pScrn)) {
                 ret = FALSE;
@@ -53,6 +53,8 @@
  */
 #define OFF_DELAY       200           /* milliseconds */
 #define FREE_DELAY      60000
+#define FIELD_POLL      2             /* milliseconds */
+#define FIELD_TIMEOUT   100
 #define PARAMSIZE       1024
 #define SLICESIZE       65536
 #define OFF_TIMER       0x01
@@ -113,7 +115,7 @@ static void nv12Blit(unsigned char *nv12Chroma,
     unsigned width, unsigned srcPitch, unsigned dstPitch, unsigned lines);
 
 static Atom xvBrightness, xvContrast, xvColorKey, xvHue, xvSaturation,
-    xvAutoPaint;
+    xvAutoPaint, xvDeinterlace;
 
 /*
  *  S T R U C T S
@@ -137,7 +139,7 @@ static XF86VideoFormatRec FormatsG[NUM_FORMATS_G] = {
     {24, DirectColor}
 };
 
-#define NUM_ATTRIBUTES_G 6
+#define NUM_ATTRIBUTES_G 7
 
 static char attributeXvColorkey[] = { "XV_COLORKEY" };
 static char attributeXvBrightness[] = { "XV_BRIGHTNESS" };
@@ -146,6 +148,7 @@ static char attributeXvSaturation[] = { "XV_SATURATION" };
 static char attributeXvHue[] = { "XV_HUE" };
 static char attributeXvAutopaintColorkey[] =
                                         { "XV_AUTOPAINT_COLORKEY" };
+static char attributeXvDeinterlace[] = { "XV_DEINTERLACE" };
 
 static XF86AttributeRec AttributesG[NUM_ATTRIBUTES_G] = {
     {XvSettable | XvGettable,      0,  (1 << 24) - 1,          attributeXvColorkey},
@@ -153,7 +156,8 @@ static XF86AttributeRec AttributesG[NUM_ATTRIBUTES_G] = {
     {XvSettable | XvGettable,      0,          20000,          attributeXvContrast},
     {XvSettable | XvGettable,      0,          20000,          attributeXvSaturation},
     {XvSettable | XvGettable,   -180,            180,                 attributeXvHue},
-    {XvSettable | XvGettable,      0,              1,   attributeXvAutopaintColorkey}
+    {XvSettable | XvGettable,      0,              1,   attributeXvAutopaintColorkey},
+    {XvSettable | XvGettable,      0,              2,          attributeXvDeinterlace}
 };
 
 #define NUM_IMAGES_G 7
@@ -243,13 +247,17 @@ static XF86ImageRec ImagesG[NUM_IMAGES_G] = {
 
 };
 
+/* The YUV formats at the start of ImagesG. */
+#define NUM_IMAGES_TEXTURE 3
+
 static const char *XvAdaptorName[XV_ADAPT_NUM] = {
-    "XV_SWOV"
+    "XV_SWOV",
+    "XV_TEXTURE"
 };
 
 static XF86VideoAdaptorPtr viaAdaptPtr[XV_ADAPT_NUM];
 static XF86VideoAdaptorPtr *allAdaptors;
-static unsigned numAdaptPort[XV_ADAPT_NUM] = { 1 };
+static unsigned numAdaptPort[XV_ADAPT_NUM] = { 1, VIA_MAX_XV_TEXTURE_PORTS };
 
 /*
  *  F U N C T I O N
@@ -257,154 +265,43 @@ static unsigned numAdaptPort[XV_ADAPT_NUM] = { 1 };
 
 /*
  *   Decide if the mode support video overlay. This depends on the bandwidth
- *   of the mode and the type of RAM available.
+ *   of the active modes, the size of the video and the type of RAM available.
  */
 
 static Bool
-DecideOverlaySupport(xf86CrtcPtr crtc)
+DecideOverlaySupport(xf86CrtcPtr crtc, viaPortPrivPtr pPriv,
+                     short src_w, short src_h, short drw_w, short drw_h)
 {
-    DisplayModePtr mode = &crtc->desiredMode;
     ScrnInfoPtr pScrn = crtc->scrn;
     VIAPtr pVia = VIAPTR(pScrn);
+    viaPortPrivPtr ports;
+    int i, numOther = 0, decimate;
 
 #ifdef HAVE_DEBUG
     if (pVia->disableXvBWCheck)
         return TRUE;
 #endif
 
-    /* Small trick here. We keep the height in 16's of lines and width in 32's
-     * to avoid numeric overflow */
-
-    if (pVia->ChipId != PCI_CHIP_VT3205 &&
-        pVia->ChipId != PCI_CHIP_VT3204 &&
-        pVia->ChipId != PCI_CHIP_VT3259 &&
-        pVia->ChipId != PCI_CHIP_VT3314 &&
-        pVia->ChipId != PCI_CHIP_VT3327 &&
-        pVia->ChipId != PCI_CHIP_VT3336 &&
-        pVia->ChipId != PCI_CHIP_VT3409 &&
-        pVia->ChipId != PCI_CHIP_VT3410 &&
-        pVia->ChipId != PCI_CHIP_VT3364 &&
-        pVia->ChipId != PCI_CHIP_VT3324 &&
-        pVia->ChipId != PCI_CHIP_VT3353) {
-        CARD32 bandwidth = (mode->HDisplay >> 4) * (mode->VDisplay >> 5) *
-                            pScrn->bitsPerPixel * mode->VRefresh;
-
-        switch (pVia->MemClk) {
-        case VIA_MEM_SDR100:           /* No overlay without DDR */
-        case VIA_MEM_SDR133:
-            return FALSE;
-        case VIA_MEM_DDR200:
-            /* Basic limit for DDR200 is about this */
-            if (bandwidth > 1800000)
-                return FALSE;
-            /* But we have constraints at higher than 800x600 */
-            if (mode->HDisplay > 800) {
-                if (pScrn->bitsPerPixel != 8)
-                    return FALSE;
-                if (mode->VDisplay > 768)
-                    return FALSE;
-                if (mode->VRefresh > 60)
-                    return FALSE;
-            }
-            return TRUE;
-        case 0:               /*      FIXME: Why does my CLE266 report 0? */
-        case VIA_MEM_DDR266:
-            if (bandwidth > 7901250)
-                return FALSE;
-            return TRUE;
-        }
-        return FALSE;
-
-    } else {
-        unsigned width, height, refresh, dClock;
-        float mClock, memEfficiency, needBandWidth, totalBandWidth;
-
-        switch (pVia->MemClk) {
-            case VIA_MEM_SDR100:
-                mClock = 50;           /*HW base on 128 bit */
-                memEfficiency = (float)SINGLE_3205_100;
-                break;
-            case VIA_MEM_SDR133:
-                mClock = 66.5;
-                memEfficiency = (float)SINGLE_3205_100;
-                break;
-            case VIA_MEM_DDR200:
-                mClock = 100;
-                memEfficiency = (float)SINGLE_3205_100;
-                break;
-            case VIA_MEM_DDR266:
-                mClock = 133;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR333:
-                mClock = 166;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR400:
-                mClock = 200;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR533:
-                mClock = 266;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR667:
-                mClock = 333;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR800:
-                mClock = 400;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            case VIA_MEM_DDR1066:
-                mClock = 533;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-            default:
-                ErrorF("Unknown DRAM Type!\n");
-                mClock = 166;
-                memEfficiency = (float)SINGLE_3205_133;
-                break;
-        }
-
-        width = mode->HDisplay;
-        height = mode->VDisplay;
-        refresh = mode->VRefresh;
-
-        if (refresh==0) {
-            refresh=60;
-            ErrorF("Unable to fetch vertical refresh value, needed for bandwidth calculation.\n");
-        }
+    /* Admit a stream only if it fits next to the other visible ones. */
+    ports = (viaPortPrivPtr) viaAdaptPtr[XV_ADAPT_SWOV]->pPortPrivates->ptr;
+    for (i = 0; i < numAdaptPort[XV_ADAPT_SWOV]; i++)
+        if ((&ports[i] != pPriv) && (ports[i].VideoStatus & VIDEO_SWOV_ON))
+            numOther++;
+
+    decimate = viaBandwidthOverlayCheck(crtc, numOther,
+                                        (pVia->swov.gdwVideoFlagSW &
+                                         VIDEO_HQV_INUSE) != 0,
+                                        src_w, src_h,
+                                        drw_w, drw_h);
+    if (decimate == 1)
+        return TRUE;
 
-        /*
-         * Approximative, VERY conservative formula in some cases.
-         * This formula and the one below are derived analyzing the
-         * tables present in VIA's own drivers. They may reject the over-
-         * lay in some cases where VIA's driver don't.
-         */
-        dClock = (width * height * refresh) / 680000;
-        if (dClock) {
-            needBandWidth =
-                (float)(((pScrn->bitsPerPixel >> 3) + VIDEO_BPP) * dClock);
-            totalBandWidth = (float)(mClock * 16. * memEfficiency);
-
-            DBG_DD(ErrorF(" via_xv.c : cBitsPerPel= %d : \n",
-                pScrn->bitsPerPixel));
-            DBG_DD(ErrorF(" via_xv.c : Video_Bpp= %d : \n", VIDEO_BPP));
-            DBG_DD(ErrorF(" via_xv.c : refresh = %d : \n", refresh));
-            DBG_DD(ErrorF(" via_xv.c : dClock= %d : \n", dClock));
-            DBG_DD(ErrorF(" via_xv.c : mClk= %f : \n", mClock));
-            DBG_DD(ErrorF(" via_xv.c : memEfficiency= %f : \n",
-                memEfficiency));
-            if (needBandWidth < totalBandWidth)
-                return TRUE;
-            ErrorF(" via_xv.c : needBandwidth= %f : \n",
-                needBandWidth);
-            ErrorF(" via_xv.c : totalBandwidth= %f : \n",
-                totalBandWidth);
-        }
-        return FALSE;
-    }
+    /* Only suggest once, the caller reports the error itself. */
+    if (decimate && pPriv->xvErr != xve_bandwidth)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "[Xv] Not enough memory bandwidth for a %dx%d video; "
+                   "a %dx%d source would fit.\n", src_w, src_h,
+                   src_w / decimate, src_h / decimate);
     return FALSE;
 }
 
@@ -431,6 +328,54 @@ viaXvError(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv, XvError error)
             pPriv->xv_portnum, viaXvErrMsg[error]);
 }
 
+/*
+ * Make pPriv the port the overlay code works on.  Each port has its own
+ * copy of the overlay state; the state shared by all ports is carried over.
+ */
+static void
+viaXvSelectPort(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    viaPortPrivPtr pOld = pVia->xvActivePort;
+
+    if (pOld == pPriv)
+        return;
+
+    if (pOld) {
+        pOld->swov = pVia->swov;
+        pOld->VideoStatus = pVia->VideoStatus;
+        pOld->dwFrameNum = pVia->dwFrameNum;
+        pOld->old_dwUseExtendedFIFO = pVia->old_dwUseExtendedFIFO;
+    }
+
+    pPriv->swov.gdwAlphaEnabled = pVia->swov.gdwAlphaEnabled;
+    pPriv->swov.panning_x = pVia->swov.panning_x;
+    pPriv->swov.panning_y = pVia->swov.panning_y;
+    pPriv->swov.maxWInterp = pVia->swov.maxWInterp;
+    pPriv->swov.maxHInterp = pVia->swov.maxHInterp;
+
+    pVia->swov = pPriv->swov;
+    pVia->VideoStatus = pPriv->VideoStatus;
+    pVia->dwFrameNum = pPriv->dwFrameNum;
+    pVia->old_dwUseExtendedFIFO = pPriv->old_dwUseExtendedFIFO;
+    pVia->xvActivePort = pPriv;
+}
+
+/*
+ * Hide the overlay of pPriv, and not whichever port was active last.
+ */
+void
+viaXvHidePort(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    viaXvSelectPort(pScrn, pPriv);
+
+    /* An idle second port must not turn off the first port's engine. */
+    if (!pVia->swov.altEngine || (pVia->VideoStatus & VIDEO_SWOV_ON))
+        ViaOverlayHide(pScrn);
+}
+
 static void
 viaResetVideo(ScrnInfoPtr pScrn)
 {
@@ -589,8 +534,12 @@ viaExitVideo(ScrnInfoPtr pScrn)
             free(curAdapt);
         }
     }
+    pVia->xvActivePort = NULL;
     if (allAdaptors)
         free(allAdaptors);
+
+    free(pVia->VidRegBuffer);
+    pVia->VidRegBuffer = NULL;
 }
 
 void
@@ -681,23 +630,39 @@ static unsigned
 viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-    int i, j, usedPorts, numPorts;
+    VIAPtr pVia = VIAPTR(pScrn);
+    int i, j, usedPorts, numPorts, numAdapt;
     viaPortPrivPtr pPriv;
     DevUnion *pdevUnion;
 
     DBG_DD(ErrorF(" via_xv.c : viaSetupAdaptors (viaSetupImageVideo): \n"));
 
+    /* One overlay port per engine. The P4M800 Pro only has V3. */
+    numAdaptPort[XV_ADAPT_SWOV] =
+            (pVia->ChipId == PCI_CHIP_VT3314) ? 1 : VIA_MAX_XV_PORTS;
+
     xvBrightness = MAKE_ATOM("XV_BRIGHTNESS");
     xvContrast = MAKE_ATOM("XV_CONTRAST");
     xvColorKey = MAKE_ATOM("XV_COLORKEY");
     xvHue = MAKE_ATOM("XV_HUE");
     xvSaturation = MAKE_ATOM("XV_SATURATION");
     xvAutoPaint = MAKE_ATOM("XV_AUTOPAINT_COLORKEY");
+    xvDeinterlace = MAKE_ATOM("XV_DEINTERLACE");
 
     *adaptors = NULL;
     usedPorts = 0;
 
-    for (i = 0; i < XV_ADAPT_NUM; i++) {
+    /* Textured video needs the 3D engine, and comes last. */
+    numAdapt = XV_ADAPT_NUM;
+    viaAdaptPtr[XV_ADAPT_TEXTURE] = NULL;
+    if (!viaXvTextureSupported(pScrn))
+        numAdapt = XV_ADAPT_TEXTURE;
+    else
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "[Xv] Enabling textured video with %d ports.\n",
+                   numAdaptPort[XV_ADAPT_TEXTURE]);
+
+    for (i = 0; i < numAdapt; i++) {
         if (!(viaAdaptPtr[i] = xf86XVAllocateVideoAdaptorRec(pScrn)))
             return 0;
         numPorts = numAdaptPort[i];
@@ -711,10 +676,9 @@ viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
             XvVideoMask | XvStillMask;
             viaAdaptPtr[i]->flags =
             VIDEO_OVERLAID_IMAGES | VIDEO_CLIP_TO_VIEWPORT;
-        } else {
-            viaAdaptPtr[i]->type = XvInputMask | XvWindowMask | XvVideoMask;
-            viaAdaptPtr[i]->flags =
-            VIDEO_OVERLAID_IMAGES | VIDEO_CLIP_TO_VIEWPORT;
+        } else { /* 3D engine, draws into the window */
+            viaAdaptPtr[i]->type = XvInputMask | XvWindowMask | XvImageMask;
+            viaAdaptPtr[i]->flags = 0;
         }
         viaAdaptPtr[i]->name = XvAdaptorName[i];
         viaAdaptPtr[i]->nEncodings = 1;
@@ -722,14 +686,18 @@ viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
         viaAdaptPtr[i]->nFormats = sizeof(FormatsG) / sizeof(FormatsG[0]);
         viaAdaptPtr[i]->pFormats = FormatsG;
 
-        /* The adapter can handle 1 port simultaneously */
         viaAdaptPtr[i]->nPorts = numPorts;
         viaAdaptPtr[i]->pPortPrivates = pdevUnion;
         viaAdaptPtr[i]->pPortPrivates->ptr = (pointer) pPriv;
-        viaAdaptPtr[i]->nAttributes = NUM_ATTRIBUTES_G;
-        viaAdaptPtr[i]->pAttributes = AttributesG;
-
-        viaAdaptPtr[i]->nImages = NUM_IMAGES_G;
+        if (i == XV_ADAPT_SWOV) {
+            viaAdaptPtr[i]->nAttributes = NUM_ATTRIBUTES_G;
+            viaAdaptPtr[i]->pAttributes = AttributesG;
+            viaAdaptPtr[i]->nImages = NUM_IMAGES_G;
+        } else {
+            viaAdaptPtr[i]->nAttributes = 0;
+            viaAdaptPtr[i]->pAttributes = NULL;
+            viaAdaptPtr[i]->nImages = NUM_IMAGES_TEXTURE;
+        }
         viaAdaptPtr[i]->pImages = ImagesG;
         viaAdaptPtr[i]->PutVideo = NULL;
         viaAdaptPtr[i]->StopVideo = viaStopVideo;
@@ -740,6 +708,7 @@ viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
         viaAdaptPtr[i]->ReputImage = NULL;
         viaAdaptPtr[i]->QueryImageAttributes = viaQueryImageAttributes;
         for (j = 0; j < numPorts; ++j) {
+            pdevUnion[j].ptr = (pointer) &pPriv[j];
             pPriv[j].dmaBounceBuffer = NULL;
             pPriv[j].dmaBounceStride = 0;
             pPriv[j].dmaBounceLines = 0;
@@ -750,8 +719,15 @@ viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
             pPriv[j].contrast = 10000;
             pPriv[j].hue = 0;
             pPriv[j].FourCC = 0;
+            pPriv[j].xv_adaptor = i;
             pPriv[j].xv_portnum = j + usedPorts;
             pPriv[j].xvErr = xve_none;
+            pPriv[j].swov = pVia->swov;
+            pPriv[j].swov.altEngine = (j != 0);
+            pPriv[j].deinterlace = VIA_DEINTERLACE_WEAVE;
+            pPriv[j].pScrn = pScrn;
+            pPriv[j].fieldTimer = NULL;
+            pPriv[j].texBuf = NULL;
 
 #ifdef X_USE_REGION_NULL
             REGION_NULL(pScreen, &pPriv[j].clip);
@@ -761,14 +737,17 @@ viaSetupAdaptors(ScreenPtr pScreen, XF86VideoAdaptorPtr ** adaptors)
         }
         usedPorts += j;
 
+        if (i == XV_ADAPT_SWOV) {
+            pVia->xvActivePort = &pPriv[0];
 #ifdef HAVE_DRI
-        viaXvMCInitXv(pScrn, viaAdaptPtr[i]);
+            viaXvMCInitXv(pScrn, viaAdaptPtr[i]);
 #endif
+        }
 
     } /* End of for */
     viaResetVideo(pScrn);
     *adaptors = viaAdaptPtr;
-    return XV_ADAPT_NUM;
+    return numAdapt;
 }
 
 static void
@@ -779,10 +758,22 @@ viaStopVideo(ScrnInfoPtr pScrn, pointer data, Bool exit)
 
     DBG_DD(ErrorF(" via_xv.c : viaStopVideo: exit=%d\n", exit));
 
+    if (pPriv->xv_adaptor == XV_ADAPT_TEXTURE) {
+        REGION_EMPTY(pScrn->pScreen, &pPriv->clip);
+        if (exit)
+            viaXvTextureFree(pScrn, pPriv);
+        return;
+    }
+
+    viaXvSelectPort(pScrn, pPriv);
+
     REGION_EMPTY(pScrn->pScreen, &pPriv->clip);
-    ViaOverlayHide(pScrn);
+    TimerCancel(pPriv->fieldTimer);
+    viaXvHidePort(pScrn, pPriv);
     if (exit) {
         ViaSwovSurfaceDestroy(pScrn, pPriv);
+        TimerFree(pPriv->fieldTimer);
+        pPriv->fieldTimer = NULL;
         if (pPriv->dmaBounceBuffer)
             free(pPriv->dmaBounceBuffer);
         pPriv->dmaBounceBuffer = 0;
@@ -807,6 +798,9 @@ viaSetPortAttribute(ScrnInfoPtr pScrn,
 
     DBG_DD(ErrorF(" via_xv.c : viaSetPortAttribute : \n"));
 
+    if (pPriv->xv_adaptor != XV_ADAPT_SWOV)
+        return BadMatch;
+
     /* Color Key */
     if (attribute == xvColorKey) {
         DBG_DD(ErrorF("  V4L Disable  xvColorKey = %08lx\n", value));
@@ -814,14 +808,27 @@ viaSetPortAttribute(ScrnInfoPtr pScrn,
         pPriv->colorKey = value;
         /* All assume color depth is 16 */
         value &= 0x00FFFFFF;
-        viaVidEng->color_key = value;
-        viaVidEng->snd_color_key = value;
+        /*
+         * Both are V1's key, on the first and on the second display. The
+         * second port's V3 key is set on its next overlay update.
+         */
+        if (!pPriv->swov.altEngine) {
+            viaVidEng->color_key = value;
+            viaVidEng->snd_color_key = value;
+        }
         REGION_EMPTY(pScrn->pScreen, &pPriv->clip);
         DBG_DD(ErrorF("  V4L Disable done  xvColorKey = %08lx\n", value));
 
     } else if (attribute == xvAutoPaint) {
         pPriv->autoPaint = value;
         DBG_DD(ErrorF("       xvAutoPaint = %08lx\n", value));
+    } else if (attribute == xvDeinterlace) {
+        if ((value < VIA_DEINTERLACE_WEAVE) || (value > VIA_DEINTERLACE_FIELD))
+            return BadValue;
+        pPriv->deinterlace = value;
+        /* Force an overlay update on the next frame. */
+        REGION_EMPTY(pScrn->pScreen, &pPriv->clip);
+        DBG_DD(ErrorF("       xvDeinterlace = %08ld\n", value));
         /* Color Control */
     } else if (attribute == xvBrightness ||
             attribute == xvContrast ||
@@ -867,12 +874,18 @@ viaGetPortAttribute(ScrnInfoPtr pScrn,
                     pPriv->xv_portnum, attribute));
 
     *value = 0;
+    if (pPriv->xv_adaptor != XV_ADAPT_SWOV)
+        return BadMatch;
+
     if (attribute == xvColorKey) {
         *value = (INT32) pPriv->colorKey;
         DBG_DD(ErrorF(" via_xv.c :    ColorKey 0x%lx\n", pPriv->colorKey));
     } else if (attribute == xvAutoPaint) {
         *value = (INT32) pPriv->autoPaint;
         DBG_DD(ErrorF("    AutoPaint = %08ld\n", *value));
+    } else if (attribute == xvDeinterlace) {
+        *value = (INT32) pPriv->deinterlace;
+        DBG_DD(ErrorF("    Deinterlace = %08ld\n", *value));
         /* Color Control */
     } else if (attribute == xvBrightness ||
             attribute == xvContrast ||
@@ -924,7 +937,13 @@ Flip(VIAPtr pVia, viaPortPrivPtr pPriv, int fourcc,
         unsigned long DisplayBufferIndex)
 {
     unsigned long proReg = 0;
-    unsigned count = 50000;
+
+    /* Without the HQV, the next overlay update picks up the new frame. */
+    if (!(pVia->swov.gdwVideoFlagSW & VIDEO_HQV_INUSE)) {
+        pVia->swov.dwDisplayAddr =
+                pVia->swov.SWDevice.dwSWPhysicalAddr[DisplayBufferIndex];
+        return;
+    }
 
     if (pVia->ChipId == PCI_CHIP_VT3259
         && !(pVia->swov.gdwVideoFlagSW & VIDEO_1_INUSE))
@@ -936,8 +955,7 @@ Flip(VIAPtr pVia, viaPortPrivPtr pPriv, int fourcc,
         case FOURCC_RV15:
         case FOURCC_RV16:
         case FOURCC_RV32:
-            while ((VIAGETREG(HQV_CONTROL + proReg) & HQV_SW_FLIP)
-                    && --count);
+            viaWaitHQVSwFlip(pVia, proReg);
             VIASETREG(HQV_SRC_STARTADDR_Y + proReg,
                 pVia->swov.SWDevice.dwSWPhysicalAddr[DisplayBufferIndex]);
             VIASETREG(HQV_CONTROL + proReg, (VIAGETREG(HQV_CONTROL + proReg) & ~HQV_FLIP_ODD) | HQV_SW_FLIP | HQV_FLIP_STATUS);
@@ -945,8 +963,7 @@ Flip(VIAPtr pVia, viaPortPrivPtr pPriv, int fourcc,
         case FOURCC_YV12:
         case FOURCC_I420:
         default:
-            while ((VIAGETREG(HQV_CONTROL + proReg) & HQV_SW_FLIP)
-                    && --count);
+            viaWaitHQVSwFlip(pVia, proReg);
             VIASETREG(HQV_SRC_STARTADDR_Y + proReg,
                 pVia->swov.SWDevice.dwSWPhysicalAddr[DisplayBufferIndex]);
             if (pVia->VideoEngine == VIDEO_ENGINE_CME) {
@@ -963,6 +980,70 @@ Flip(VIAPtr pVia, viaPortPrivPtr pPriv, int fourcc,
     }
 }
 
+/*
+ * Queue the bottom field of the frame the HQV is displaying, once the flip
+ * to its top field has been taken. Returns FALSE if it has not been yet.
+ */
+static Bool
+FlipOddField(VIAPtr pVia)
+{
+    unsigned long proReg = 0;
+
+    if (pVia->ChipId == PCI_CHIP_VT3259
+        && !(pVia->swov.gdwVideoFlagSW & VIDEO_1_INUSE))
+        proReg = PRO_HQV1_OFFSET;
+
+    /* The HQV clears the flip request at the vertical blank it flips in. */
+    if (VIAGETREG(HQV_CONTROL + proReg) & HQV_SW_FLIP)
+        return FALSE;
+
+    VIASETREG(HQV_CONTROL + proReg, VIAGETREG(HQV_CONTROL + proReg) |
+              HQV_FLIP_ODD | HQV_SW_FLIP | HQV_FLIP_STATUS);
+    return TRUE;
+}
+
+static CARD32
+viaXvFieldTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    viaPortPrivPtr pPriv = (viaPortPrivPtr) arg;
+    ScrnInfoPtr pScrn = pPriv->pScrn;
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    if (!pScrn->vtSema)
+        return 0;
+
+    viaXvSelectPort(pScrn, pPriv);
+    if (!(pVia->VideoStatus & VIDEO_SWOV_ON) || FlipOddField(pVia))
+        return 0;
+
+    /* Don't poll forever for a flip that is not taken, e.g. when off. */
+    if (now - pPriv->lastFrameTime > FIELD_TIMEOUT)
+        return 0;
+    return FIELD_POLL;
+}
+
+/*
+ * When bob deinterlacing, Flip() queues the top field of the new frame,
+ * which the HQV shows from the next vertical blank on. The bottom field is
+ * queued as soon as that flip has been taken, so that it follows at the
+ * vertical blank after, and stays up until the next frame. The HQV flip
+ * status is polled from a timer so that the server does not block on it.
+ */
+static void
+viaXvScheduleField(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    pPriv->lastFrameTime = GetTimeInMillis();
+
+    if ((pPriv->deinterlace != VIA_DEINTERLACE_BOB)
+        || !(pVia->swov.gdwVideoFlagSW & VIDEO_HQV_INUSE))
+        return;
+
+    pPriv->fieldTimer = TimerSet(pPriv->fieldTimer, 0, FIELD_POLL,
+                                 viaXvFieldTimer, pPriv);
+}
+
 /*
  * Slow and dirty. NV12 blit.
  */
@@ -1166,15 +1247,26 @@ viaPutImage(ScrnInfoPtr pScrn,
             drw_y, drw_w, drw_h);
 # endif
 
-    /* Find out which CRTC the surface will belong to */
-    crtc = window_belongs_to_crtc(pScrn, drw_x, drw_y, drw_w, drw_h);
-    if (!crtc) {
-        DBG_DD(ErrorF(" via_xv.c : No usable CRTC\n"));
-        viaXvError(pScrn, pPriv, xve_adaptor);
-        return BadAlloc;
-    }
-
     switch (pPriv->xv_adaptor) {
+        case XV_ADAPT_TEXTURE:
+        {
+            int pitches[3], offsets[3];
+            unsigned short w = width, h = height;
+
+            DBG_DD(ErrorF(" via_xv.c :              : Textured video! \n"));
+            viaQueryImageAttributes(pScrn, id, &w, &h, pitches, offsets);
+            retCode = viaXvTexturePutImage(pScrn, pPriv, src_x, src_y,
+                                           drw_x, drw_y, src_w, src_h,
+                                           drw_w, drw_h, id, buf,
+                                           width, height, pitches, offsets,
+                                           clipBoxes, pDraw);
+            if (retCode != Success) {
+                viaXvError(pScrn, pPriv, (retCode == BadAlloc) ?
+                           xve_mem : xve_general);
+                return retCode;
+            }
+            break;
+        }
         case XV_ADAPT_SWOV:
         {
             DDUPDATEOVERLAY UpdateOverlay_Video;
@@ -1183,6 +1275,16 @@ viaPutImage(ScrnInfoPtr pScrn,
             int dstPitch;
             unsigned long dwUseExtendedFIFO = 0;
 
+            viaXvSelectPort(pScrn, pPriv);
+
+            /* Find out which CRTC the surface will belong to */
+            crtc = window_belongs_to_crtc(pScrn, drw_x, drw_y, drw_w, drw_h);
+            if (!crtc) {
+                DBG_DD(ErrorF(" via_xv.c : No usable CRTC\n"));
+                viaXvError(pScrn, pPriv, xve_adaptor);
+                return BadAlloc;
+            }
+
             DBG_DD(ErrorF(" via_xv.c :              : S/W Overlay! \n"));
             /*  Allocate video memory(CreateSurface),
              *  add codes to judge if need to re-create surface
@@ -1257,7 +1359,8 @@ viaPutImage(ScrnInfoPtr pScrn,
             }
 
             /* If there is bandwidth issue, block the H/W overlay */
-            if (!(DecideOverlaySupport(crtc))) {
+            if (!(DecideOverlaySupport(crtc, pPriv, src_w, src_h,
+                                        drw_w, drw_h))) {
                 DBG_DD(ErrorF
                         (" via_xv.c : Xv Overlay rejected due to insufficient "
                                 "memory bandwidth.\n"));
@@ -1279,6 +1382,8 @@ viaPutImage(ScrnInfoPtr pScrn,
             lpUpdateOverlay->DstBottom = drw_y + drw_h;
 
             lpUpdateOverlay->dwFlags = DDOVER_KEYDEST;
+            if (pPriv->deinterlace != VIA_DEINTERLACE_WEAVE)
+                lpUpdateOverlay->dwFlags |= DDOVER_BOB;
 
             if (pScrn->bitsPerPixel == 8) {
                 lpUpdateOverlay->dwColorSpaceLowValue = pPriv->colorKey & 0xff;
@@ -1298,6 +1403,7 @@ viaPutImage(ScrnInfoPtr pScrn,
 
                 DBG_DD(ErrorF("             : Flip\n"));
                 Flip(pVia, pPriv, id, pVia->dwFrameNum & 1);
+                viaXvScheduleField(pScrn, pPriv);
             }
 
             pVia->dwFrameNum++;
@@ -1309,7 +1415,8 @@ viaPutImage(ScrnInfoPtr pScrn,
                     && (pPriv->old_src_x == src_x) && (pPriv->old_src_y == src_y)
                     && (pPriv->old_src_w == src_w) && (pPriv->old_src_h == src_h)
                     && (pVia->old_dwUseExtendedFIFO == dwUseExtendedFIFO)
-                    && (pVia->VideoStatus & VIDEO_SWOV_ON) &&
+                    && (pVia->VideoStatus & VIDEO_SWOV_ON)
+                    && (pVia->swov.gdwVideoFlagSW & VIDEO_HQV_INUSE) &&
                     REGION_EQUAL(pScrn->pScreen, &pPriv->clip, clipBoxes)) {
                 DBG_DD(ErrorF(" via_xv.c : don't do UpdateOverlay! \n"));
                 viaXvError(pScrn, pPriv, xve_none);
@@ -82,20 +82,96 @@ static const unsigned hqv_cme_regs_409[] = {
 
 #define HQV_CME_REG(HWDiff, name) (HWDiff)->HQVCmeRegs[name]
 
-static void
-viaWaitVideoCommandFire(VIAPtr pVia)
-{
 /*
  * Uncached PCI reading throughput is about 9 MB/s; so 8 bytes/loop means about
- * 1M loops/second.  We want to time out after 50 ms, which means 50000 loops.
+ * 1M loops/second.  Only spin for a short while before giving up the CPU; the
+ * registers we poll here only change at vertical blank, which is up to a
+ * whole frame away.
  */
-    unsigned count = 50000;
-    CARD32 volatile *pdwState =
-            (CARD32 volatile *)(pVia->MapBase + V_COMPOSE_MODE);
+#define VIA_WAIT_SPIN       200
+#define VIA_WAIT_TIMEOUT    50000   /* usec */
+#define VIA_WAIT_POLL       500     /* usec */
+
+/*
+ * Sleep until the next vertical blank of the given CRTC using the DRM
+ * vblank ioctl.  Returns FALSE when no vblank interrupt is available, in
+ * which case the caller has to poll.
+ */
+static Bool
+viaWaitVBlankIrq(VIAPtr pVia, int crtc)
+{
+#ifdef HAVE_DRI
+    drmVBlank vbl;
+
+    if (pVia->swov.vblankIrqBroken)
+        return FALSE;
+
+    switch (pVia->directRenderingType) {
+    case DRI_1:
+        /* The DRI1 kernel module only delivers vblanks for the primary. */
+        if (crtc || !pVia->pDRIInfo
+            || !((VIADRIPtr) pVia->pDRIInfo->devPrivate)->irqEnabled)
+            return FALSE;
+        break;
+    case DRI_2:
+        break;
+    default:
+        return FALSE;
+    }
 
-    while (--count && ((*pdwState & V1_COMMAND_FIRE)
-                       || (*pdwState & V3_COMMAND_FIRE))) ;
-    if (!count) {
+    vbl.request.type = DRM_VBLANK_RELATIVE;
+    if (crtc)
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    vbl.request.sequence = 1;
+    vbl.request.signal = 0;
+
+    if (drmWaitVBlank(pVia->drmmode.fd, &vbl)) {
+        ErrorF("viaWaitVBlankIrq: drmWaitVBlank failed, "
+               "falling back to polling.\n");
+        pVia->swov.vblankIrqBroken = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * Wait until (*reg & mask) is non-zero when set is TRUE, or zero otherwise.
+ * Spin briefly, then sleep on the vblank interrupt (or in short usleep
+ * steps) and check again.  Returns FALSE on timeout.
+ */
+static Bool
+viaWaitVideoReg(VIAPtr pVia, unsigned long reg, CARD32 mask, Bool set)
+{
+    CARD32 volatile *pdwState = (CARD32 volatile *)(pVia->MapBase + reg);
+    unsigned count = VIA_WAIT_SPIN;
+    unsigned waited = 0;
+
+    while (((*pdwState & mask) != 0) != set) {
+        if (count) {
+            count--;
+            continue;
+        }
+        if (waited >= VIA_WAIT_TIMEOUT)
+            return FALSE;
+        if (viaWaitVBlankIrq(pVia, pVia->swov.vblankCrtc)) {
+            /* One refresh period at worst; account a typical 60 Hz frame. */
+            waited += 16667;
+        } else {
+            usleep(VIA_WAIT_POLL);
+            waited += VIA_WAIT_POLL;
+        }
+    }
+    return TRUE;
+}
+
+static void
+viaWaitVideoCommandFire(VIAPtr pVia)
+{
+    if (!viaWaitVideoReg(pVia, V_COMPOSE_MODE,
+                         V1_COMMAND_FIRE | V3_COMMAND_FIRE, FALSE)) {
         ErrorF("viaWaitVideoCommandFire: Timeout.\n");
     }
 }
@@ -104,19 +180,15 @@ static void
 viaWaitHQVFlip(VIAPtr pVia)
 {
     unsigned long proReg = 0;
-    CARD32 volatile *pdwState;
-    unsigned count = 50000;
 
     if (pVia->ChipId == PCI_CHIP_VT3259
         && !(pVia->swov.gdwVideoFlagSW & VIDEO_1_INUSE))
         proReg = PRO_HQV1_OFFSET;
 
-    pdwState = (CARD32 volatile *)(pVia->MapBase + (HQV_CONTROL + proReg));
-
     if (pVia->VideoEngine == VIDEO_ENGINE_CME) {
-		while (--count && (*pdwState & HQV_SUBPIC_FLIP));
+        viaWaitVideoReg(pVia, HQV_CONTROL + proReg, HQV_SUBPIC_FLIP, FALSE);
     } else {
-        while (--count && !(*pdwState & HQV_FLIP_STATUS)) ;
+        viaWaitVideoReg(pVia, HQV_CONTROL + proReg, HQV_FLIP_STATUS, TRUE);
     }
 }
 
@@ -133,29 +205,42 @@ viaWaitHQVFlipClear(VIAPtr pVia, unsigned long dwData)
     }
 }
 
+/*
+ * Wait for the start of the vertical blanking interval.
+ */
 static void
 viaWaitVBI(VIAPtr pVia)
 {
-    while (IN_VIDEO_DISPLAY) ;
+    if (IN_VIDEO_DISPLAY && viaWaitVBlankIrq(pVia, pVia->swov.vblankCrtc))
+        return;
+
+    if (!viaWaitVideoReg(pVia, V_FLAGS, VBI_STATUS, FALSE))
+        ErrorF("viaWaitVBI: Timeout.\n");
 }
 
 static void
 viaWaitHQVDone(VIAPtr pVia)
 {
-    CARD32 volatile *pdwState;
     unsigned long proReg = 0;
-    unsigned count = 50000;
 
     if (pVia->ChipId == PCI_CHIP_VT3259
         && !(pVia->swov.gdwVideoFlagSW & VIDEO_1_INUSE))
         proReg = PRO_HQV1_OFFSET;
 
-    pdwState = (CARD32 volatile *)(pVia->MapBase + (HQV_CONTROL + proReg));
     if (pVia->swov.MPEG_ON) {
-        while (--count && (*pdwState & HQV_SW_FLIP)) ;
+        viaWaitVideoReg(pVia, HQV_CONTROL + proReg, HQV_SW_FLIP, FALSE);
     }
 }
 
+/*
+ * Wait for a pending HQV software flip to be picked up by the hardware.
+ */
+void
+viaWaitHQVSwFlip(VIAPtr pVia, unsigned long proReg)
+{
+    viaWaitVideoReg(pVia, HQV_CONTROL + proReg, HQV_SW_FLIP, FALSE);
+}
+
 /*
  * Send all data in VidRegBuffer to the hardware.
  */
@@ -185,7 +270,6 @@ FlushVidRegBuffer(VIAPtr pVia)
 static void
 ResetVidRegBuffer(VIAPtr pVia)
 {
-    /* BUG: (Memory leak) This allocation may need have a corresponding free somewhere... /A */
     if (!pVia->VidRegBuffer)
         pVia->VidRegBuffer =
                 xnfcalloc(VIDREG_BUFFER_SIZE, sizeof(CARD32) * 2);
@@ -1146,7 +1230,8 @@ AddHQVSurface(ScrnInfoPtr pScrn, unsigned int numbuf, CARD32 fourcc)
     pitch = pVia->swov.SWDevice.dwPitch;
     fbsize = pitch * height * (isplanar ? 2 : 1);
 
-    pVia->swov.HQVMem = drm_bo_alloc(pScrn, fbsize * numbuf, 1, TTM_PL_FLAG_VRAM);
+    pVia->swov.HQVMem = drm_bo_alloc(pScrn, fbsize * numbuf, 1,
+                                     TTM_PL_FLAG_VRAM, VIA_BO_XV);
     if (!pVia->swov.HQVMem)
         return BadAlloc;
     addr = pVia->swov.HQVMem->offset;
@@ -1179,6 +1264,16 @@ CreateSurface(ScrnInfoPtr pScrn, CARD32 FourCC, CARD16 Width,
     pVia->swov.SrcFourCC = FourCC;
     pVia->swov.gdwVideoFlagSW = ViaInitVideoStatusFlag(pVia);
 
+    /*
+     * The second port drives the other overlay engine.  Only the PM800
+     * has a second HQV for it; elsewhere V1/V3 fetch the surface directly.
+     */
+    if (pVia->swov.altEngine) {
+        pVia->swov.gdwVideoFlagSW ^= VIDEO_1_INUSE | VIDEO_3_INUSE;
+        if (pVia->ChipId != PCI_CHIP_VT3259)
+            pVia->swov.gdwVideoFlagSW &= ~(VIDEO_HQV_INUSE | SW_USE_HQV);
+    }
+
     isplanar = FALSE;
     switch (FourCC) {
         case FOURCC_YV12:
@@ -1199,7 +1294,8 @@ CreateSurface(ScrnInfoPtr pScrn, CARD32 FourCC, CARD16 Width,
     }
 
     if (doalloc) {
-        pVia->swov.SWfbMem = drm_bo_alloc(pScrn, fbsize * 2, 1, TTM_PL_FLAG_VRAM);
+        pVia->swov.SWfbMem = drm_bo_alloc(pScrn, fbsize * 2, 1,
+                                          TTM_PL_FLAG_VRAM, VIA_BO_XV);
         if (!pVia->swov.SWfbMem)
             return BadAlloc;
         addr = pVia->swov.SWfbMem->offset;
@@ -1257,6 +1353,14 @@ ViaSwovSurfaceCreate(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv,
         && (FourCC == pPriv->FourCC))
         return Success;
 
+    /* Without the HQV, the overlay engines can only show packed YUV. */
+    if (pVia->swov.altEngine && (pVia->ChipId != PCI_CHIP_VT3259)
+        && (FourCC != FOURCC_YUY2)) {
+        DBG_DD(ErrorF("ViaSwovSurfaceCreate: FourCC 0x%08lx not supported "
+                      "on the second overlay engine.\n", FourCC));
+        return BadMatch;
+    }
+
     pPriv->FourCC = FourCC;
     switch (FourCC) {
         case FOURCC_YUY2:
@@ -1584,6 +1688,10 @@ SetColorKey(VIAPtr pVia, unsigned long videoFlag,
     if (pVia->VideoEngine == VIDEO_ENGINE_CME)
         keyLow |= 0x40000000;
 
+    /*
+     * SND_COLOR_KEY is V1's key when it is on the second display. The V3
+     * engine, used by the second port, only has V3_COLOR_KEY.
+     */
     if (videoFlag & VIDEO_1_INUSE) {
         SaveVideoRegister(pVia, V_COLOR_KEY, keyLow);
         SaveVideoRegister(pVia, SND_COLOR_KEY, keyLow);
@@ -1816,6 +1924,9 @@ Upd_Video(xf86CrtcPtr crtc, unsigned long videoFlag,
     if (pVia->ChipId == PCI_CHIP_VT3259 && !(videoFlag & VIDEO_1_INUSE))
         proReg = PRO_HQV1_OFFSET;
 
+    /* Vblank waits below refer to the CRTC the overlay is shown on. */
+    pVia->swov.vblankCrtc = iga->index;
+
     compose = ((VIAGETREG(V_COMPOSE_MODE)
                 & ~(SELECT_VIDEO_IF_COLOR_KEY
                     | V1_COMMAND_FIRE | V3_COMMAND_FIRE))
@@ -2313,7 +2424,10 @@ VIAVidUpdateOverlay(xf86CrtcPtr crtc, LPDDUPDATEOVERLAY pUpdate)
     ResetVidRegBuffer(pVia);
 
     /* For SW decode HW overlay use */
-    startAddr = VIAGETREG(HQV_SRC_STARTADDR_Y + proReg);
+    if (videoFlag & VIDEO_HQV_INUSE)
+        startAddr = VIAGETREG(HQV_SRC_STARTADDR_Y + proReg);
+    else
+        startAddr = pVia->swov.dwDisplayAddr;
 
     if (flags & DDOVER_KEYDEST) {
         haveColorKey = 1;
@@ -2443,11 +2557,14 @@ ViaOverlayHide(ScrnInfoPtr pScrn)
     if (pVia->HWDiff.dwHQVDisablePatch)
         ViaSeqMask(hwp, 0x2E, 0x00, 0x10);
 
-    SaveVideoRegister(pVia, V_FIFO_CONTROL, V1_FIFO_PRETHRESHOLD12 |
-                      V1_FIFO_THRESHOLD8 | V1_FIFO_DEPTH16);
-    SaveVideoRegister(pVia, ALPHA_V3_FIFO_CONTROL,
-                      ALPHA_FIFO_THRESHOLD4 | ALPHA_FIFO_DEPTH8 |
-                      V3_FIFO_THRESHOLD24 | V3_FIFO_DEPTH32);
+    /* Leave the FIFO of the other engine alone, it may be in use. */
+    if (!(videoFlag & VIDEO_3_INUSE))
+        SaveVideoRegister(pVia, V_FIFO_CONTROL, V1_FIFO_PRETHRESHOLD12 |
+                          V1_FIFO_THRESHOLD8 | V1_FIFO_DEPTH16);
+    if (!(videoFlag & VIDEO_1_INUSE))
+        SaveVideoRegister(pVia, ALPHA_V3_FIFO_CONTROL,
+                          ALPHA_FIFO_THRESHOLD4 | ALPHA_FIFO_DEPTH8 |
+                          V3_FIFO_THRESHOLD24 | V3_FIFO_DEPTH32);
 
     if (videoFlag & VIDEO_HQV_INUSE)
         SaveVideoRegister(pVia, HQV_CONTROL + proReg,
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2016 The OpenChrome Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Textured video.
+ *
+ * The 3D engine has no YUV texture formats, so each frame is converted to
+ * ARGB8888 by the CPU into a staging texture in video memory. The 3D engine
+ * then scales it with bilinear filtering into the destination drawable.
+ * Unlike the overlay this works for any number of ports, on every CRTC and
+ * into redirected windows.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "via_driver.h"
+#include "fourcc.h"
+
+#define VIA_XV_TEX_BUFS 2
+
+static inline CARD32
+viaXvTexYUVToARGB(int y, int u, int v)
+{
+    int r, g, b;
+
+    /* ITU-R BT.601, studio swing. */
+    y = (y - 16) * 298 + 128;
+    u -= 128;
+    v -= 128;
+
+    r = (y + 409 * v) >> 8;
+    g = (y - 100 * u - 208 * v) >> 8;
+    b = (y + 516 * u) >> 8;
+
+    if (r < 0) r = 0; else if (r > 255) r = 255;
+    if (g < 0) g = 0; else if (g > 255) g = 255;
+    if (b < 0) b = 0; else if (b > 255) b = 255;
+
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+/*
+ * The converters fill a padding column right of the image and a spare
+ * line below it with copies of the edge pixels, which the bilinear filter
+ * reads at the right and bottom edges.
+ */
+static void
+viaXvTexConvertPlanar(unsigned char *dst, unsigned dstPitch,
+                      const unsigned char *buf, int id,
+                      int width, int height, int *pitches, int *offsets)
+{
+    const unsigned char *yP = buf + offsets[0];
+    const unsigned char *uP = buf + offsets[(id == FOURCC_YV12) ? 2 : 1];
+    const unsigned char *vP = buf + offsets[(id == FOURCC_YV12) ? 1 : 2];
+    int x, y;
+    CARD32 p = 0;
+
+    for (y = 0; y <= height; y++) {
+        int sy = min(y, height - 1);
+        const unsigned char *ys = yP + sy * pitches[0];
+        const unsigned char *us = uP + (sy >> 1) * pitches[1];
+        const unsigned char *vs = vP + (sy >> 1) * pitches[2];
+        CARD32 *d = (CARD32 *) (dst + y * dstPitch);
+
+        for (x = 0; x < width; x++)
+            d[x] = p = viaXvTexYUVToARGB(ys[x], us[x >> 1], vs[x >> 1]);
+        d[width] = p;
+    }
+}
+
+static void
+viaXvTexConvertPacked(unsigned char *dst, unsigned dstPitch,
+                      const unsigned char *buf,
+                      int width, int height, int *pitches)
+{
+    int x, y;
+    CARD32 p = 0;
+
+    for (y = 0; y <= height; y++) {
+        const unsigned char *s = buf + min(y, height - 1) * pitches[0];
+        CARD32 *d = (CARD32 *) (dst + y * dstPitch);
+
+        /* Y0 U Y1 V */
+        for (x = 0; x < width - 1; x += 2, s += 4) {
+            d[x] = viaXvTexYUVToARGB(s[0], s[1], s[3]);
+            d[x + 1] = p = viaXvTexYUVToARGB(s[2], s[1], s[3]);
+        }
+        if (x < width)
+            d[x] = p = viaXvTexYUVToARGB(s[0], s[1], s[3]);
+        d[width] = p;
+    }
+}
+
+/*
+ * (Re)allocate the staging textures of a port. There are two, so that
+ * the CPU can fill one while the 3D engine still reads the other.
+ */
+static Bool
+viaXvTexAlloc(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv, int width, int height)
+{
+    /* One padding column for the bilinear filter at the right edge. */
+    unsigned pitch = ALIGN_TO((width + 1) << 2, 32);
+    int i;
+
+    if (pPriv->texBuf && (pPriv->texWidth == width) &&
+        (pPriv->texHeight == height))
+        return TRUE;
+
+    viaXvTextureFree(pScrn, pPriv);
+
+    /* One spare line for the bilinear filter at the bottom edge. */
+    pPriv->texBuf = drm_bo_alloc(pScrn, VIA_XV_TEX_BUFS * pitch * (height + 1),
+                                 32, TTM_PL_FLAG_VRAM, VIA_BO_XV);
+    if (!pPriv->texBuf)
+        return FALSE;
+
+    if (!drm_bo_map(pScrn, pPriv->texBuf)) {
+        drm_bo_free(pScrn, pPriv->texBuf);
+        pPriv->texBuf = NULL;
+        return FALSE;
+    }
+
+    pPriv->texPitch = pitch;
+    pPriv->texWidth = width;
+    pPriv->texHeight = height;
+    pPriv->texCur = 0;
+    for (i = 0; i < VIA_XV_TEX_BUFS; i++)
+        pPriv->texSync[i] = -1;
+
+    DBG_DD(ErrorF(" via_xv_texture.c : %dx%d staging texture at 0x%lx\n",
+                  width, height, pPriv->texBuf->offset));
+    return TRUE;
+}
+
+void
+viaXvTextureFree(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+    int i;
+
+    if (!pPriv->texBuf)
+        return;
+
+    for (i = 0; i < VIA_XV_TEX_BUFS; i++)
+        if (pPriv->texSync[i] >= 0)
+            pVia->exaDriverPtr->WaitMarker(pScrn->pScreen, pPriv->texSync[i]);
+
+    drm_bo_unmap(pScrn, pPriv->texBuf);
+    drm_bo_free(pScrn, pPriv->texBuf);
+    pPriv->texBuf = NULL;
+}
+
+/*
+ * Textured video draws with the same 3D state as EXA composite.
+ */
+Bool
+viaXvTextureSupported(ScrnInfoPtr pScrn)
+{
+    VIAPtr pVia = VIAPTR(pScrn);
+
+    return (pVia->useEXA && !pVia->NoAccel && pVia->exaDriverPtr);
+}
+
+int
+viaXvTexturePutImage(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv,
+                     short src_x, short src_y, short drw_x, short drw_y,
+                     short src_w, short src_h, short drw_w, short drw_h,
+                     int id, unsigned char *buf, short width, short height,
+                     int *pitches, int *offsets,
+                     RegionPtr clipBoxes, DrawablePtr pDraw)
+{
+    ScreenPtr pScreen = pScrn->pScreen;
+    VIAPtr pVia = VIAPTR(pScrn);
+    Via3DState *v3d = &pVia->v3d;
+    PixmapPtr pPix;
+    BoxPtr pBox;
+    CARD32 wOrder, hOrder;
+    unsigned long texOffset;
+    unsigned char *texAddr;
+    int nBox, xOff = 0, yOff = 0, dstFormat, buffer, x, y;
+    ViaTileIter tile;
+    float scaleX, scaleY;
+
+    if (!drw_w || !drw_h || !src_w || !src_h)
+        return Success;
+
+    if (pDraw->type == DRAWABLE_WINDOW)
+        pPix = (*pScreen->GetWindowPixmap) ((WindowPtr) pDraw);
+    else
+        pPix = (PixmapPtr) pDraw;
+
+    exaMoveInPixmap(pPix);
+    if (!viaExaIsOffscreen(pPix))
+        return BadAlloc;
+
+#ifdef COMPOSITE
+    /* Clip boxes are in screen coordinates. */
+    xOff = -pPix->screen_x;
+    yOff = -pPix->screen_y;
+#endif
+
+    switch (pPix->drawable.bitsPerPixel) {
+        case 32:
+            dstFormat = (pPix->drawable.depth == 32) ?
+                        PICT_a8r8g8b8 : PICT_x8r8g8b8;
+            break;
+        case 16:
+            dstFormat = PICT_r5g6b5;
+            break;
+        default:
+            return BadMatch;
+    }
+    if (!v3d->dstSupported(dstFormat))
+        return BadMatch;
+
+    if (!viaXvTexAlloc(pScrn, pPriv, width, height))
+        return BadAlloc;
+
+    /* Convert into the staging texture the 3D engine is done with. */
+    buffer = pPriv->texCur;
+    pPriv->texCur = (buffer + 1) % VIA_XV_TEX_BUFS;
+    if (pPriv->texSync[buffer] >= 0)
+        pVia->exaDriverPtr->WaitMarker(pScreen, pPriv->texSync[buffer]);
+
+    texOffset = pPriv->texBuf->offset +
+                buffer * pPriv->texPitch * (pPriv->texHeight + 1);
+    texAddr = (unsigned char *) pPriv->texBuf->ptr +
+              buffer * pPriv->texPitch * (pPriv->texHeight + 1);
+
+    switch (id) {
+        case FOURCC_YV12:
+        case FOURCC_I420:
+            viaXvTexConvertPlanar(texAddr, pPriv->texPitch, buf, id,
+                                  width, height, pitches, offsets);
+            break;
+        case FOURCC_YUY2:
+            viaXvTexConvertPacked(texAddr, pPriv->texPitch, buf,
+                                  width, height, pitches);
+            break;
+        default:
+            return BadMatch;
+    }
+
+    viaOrder(width, &wOrder);
+    viaOrder(height, &hOrder);
+
+    viaExaTile3DSetup(pScrn, pPix, dstFormat, FALSE);
+    v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0x00);
+    v3d->setFlags(v3d, 1, TRUE, TRUE, FALSE);
+    if (!v3d->setTexture(v3d, 0, texOffset, pPriv->texPitch, TRUE,
+                         1 << wOrder, 1 << hOrder, PICT_a8r8g8b8,
+                         via_clamp, via_clamp, via_src, FALSE))
+        return BadMatch;
+    v3d->setTexFilter(v3d, 0, TRUE);
+    v3d->emitState(v3d, &pVia->cb, viaCheckUpload(pScrn, v3d));
+    viaExaTile3DClip(pScrn);
+
+    scaleX = (float) src_w / drw_w;
+    scaleY = (float) src_h / drw_h;
+    pBox = REGION_RECTS(clipBoxes);
+    nBox = REGION_NUM_RECTS(clipBoxes);
+
+    while (nBox--) {
+        /* Boxes on large pixmaps may cross VIA_TILE squares. */
+        viaExaTileInit(&tile, pBox->x1 + xOff, pBox->y1 + yOff,
+                       pBox->x2 - pBox->x1, pBox->y2 - pBox->y1);
+        while (viaExaTileNext(&tile)) {
+            x = tile.x;
+            y = tile.y;
+            viaExaTile3D(pScrn, &x, &y);
+            v3d->emitQuadScaled(v3d, &pVia->cb, x, y, tile.w, tile.h,
+                                src_x + (tile.x - xOff - drw_x) * scaleX,
+                                src_y + (tile.y - yOff - drw_y) * scaleY,
+                                tile.w * scaleX, tile.h * scaleY);
+        }
+        pBox++;
+    }
+
+    pPriv->texSync[buffer] = pVia->exaDriverPtr->MarkSync(pScreen);
+    exaMarkSync(pScreen);
+
+    DamageDamageRegion(pDraw, clipBoxes);
+    return Success;
+}
@@ -585,7 +585,7 @@ ViaXvMCCreateSurface(ScrnInfoPtr pScrn, XvMCSurfacePtr pSurf,
     ctx = pSurf->context;
     bufSize = size_yuv420(ctx->width, ctx->height);
     sPriv->memory_ref = drm_bo_alloc(pScrn, numBuffers * bufSize,
-                                    32, TTM_PL_FLAG_VRAM);
+                                    32, TTM_PL_FLAG_VRAM, VIA_BO_XVMC);
     if (!sPriv->memory_ref) {
         free(*priv);
         free(sPriv);
@@ -662,7 +662,8 @@ ViaXvMCCreateSubpicture(ScrnInfoPtr pScrn, XvMCSubpicturePtr pSubp,
 
     ctx = pSubp->context;
     bufSize = size_xx44(ctx->width, ctx->height);
-    sPriv->memory_ref = drm_bo_alloc(pScrn, 1 * bufSize, 32, TTM_PL_FLAG_VRAM);
+    sPriv->memory_ref = drm_bo_alloc(pScrn, 1 * bufSize, 32,
+                                     TTM_PL_FLAG_VRAM, VIA_BO_XVMC);
     if (!sPriv->memory_ref) {
         free(*priv);
         free(sPriv);
@@ -731,7 +732,7 @@ ViaXvMCDestroySurface(ScrnInfoPtr pScrn, XvMCSurfacePtr pSurf)
                 DRM_CAS(&(sAPriv->XvMCDisplaying[vx->xvmc_port]),
                         i | VIA_XVMC_VALID, 0, __ret);
                 if (!__ret)
-                    ViaOverlayHide(pScrn);
+                    viaXvHidePort(pScrn, pPriv);
             }
             drm_bo_free(pScrn, vXvMC->sPrivs[i]->memory_ref);
             free(vXvMC->sPrivs[i]);
@@ -964,7 +965,7 @@ viaXvMCInterceptPutImage(ScrnInfoPtr pScrn, short src_x, short src_y,
                     DRM_CAS(&(sAPriv->XvMCDisplaying[vx->xvmc_port]),
                         vXvMCData->srfNo, 0, __ret);
                     if (!__ret)
-                        ViaOverlayHide(pScrn);
+                        viaXvHidePort(pScrn, pPriv);
                 }
                 return Success;
             default:
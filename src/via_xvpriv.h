@@ -26,9 +26,11 @@
 #define _VIA_XVPRIV_H_ 1
 
 #include "xf86xv.h"
+#include "via_priv.h"
 
 enum
 { XV_ADAPT_SWOV = 0,
+    XV_ADAPT_TEXTURE,
     XV_ADAPT_NUM
 };
 
@@ -43,7 +45,16 @@ typedef enum
     xve_numerr
 } XvError;
 
-#define VIA_MAX_XV_PORTS 1
+#define VIA_MAX_XV_PORTS 2
+#define VIA_MAX_XV_TEXTURE_PORTS 16
+
+/* Values of the XV_DEINTERLACE port attribute. */
+enum
+{
+    VIA_DEINTERLACE_WEAVE = 0,  /* show frames as they are */
+    VIA_DEINTERLACE_BOB,        /* line doubled fields, flipped at vblank */
+    VIA_DEINTERLACE_FIELD       /* line doubling of the top field, no more */
+};
 
 typedef struct
 {
@@ -57,6 +68,7 @@ typedef struct
     RegionRec clip;
     CARD32 colorKey;
     Bool autoPaint;
+    int deinterlace;
 
     CARD32 FourCC;		       /* from old SurfaceDesc -- passed down from viaPutImageG */
 
@@ -82,8 +94,32 @@ typedef struct
     unsigned dmaBounceLines;
     XvError xvErr;
 
+    /*
+     * Overlay state of this port.  The overlay code works on pVia->swov,
+     * so it is swapped in when the port becomes the active one.
+     */
+    swovRec swov;
+    CARD32 VideoStatus;
+    unsigned long dwFrameNum;
+    unsigned long old_dwUseExtendedFIFO;
+
+    /* Shows the second field of a frame when bob deinterlacing. */
+    ScrnInfoPtr pScrn;
+    OsTimerPtr fieldTimer;
+    CARD32 lastFrameTime;               /* Of the top field flip */
+
+    /* Staging textures of a textured video port. */
+    struct buffer_object *texBuf;
+    unsigned texPitch;
+    int texWidth;
+    int texHeight;
+    int texCur;
+    int texSync[2];
+
 } viaPortPrivRec, *viaPortPrivPtr;
 
 extern unsigned viaNumXvPorts;
 
+void viaXvHidePort(ScrnInfoPtr pScrn, viaPortPrivPtr pPriv);
+
 #endif /* _VIA_XVPRIV_H_ */
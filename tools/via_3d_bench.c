@@ -0,0 +1,150 @@
+/*
+ * Copyright 2016 The OpenChrome Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the 3D engine command generation.
+ *
+ * Runs the vertex writer of via_3d.c against a command buffer whose flush
+ * function throws the commands away, and reports the quads per second for
+ * composites with no, one and two textures, and with a transformed one.
+ * No hardware or X server is needed. Built by "make check", run as
+ *
+ *     tools/via_3d_bench [quads]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* The static functions are used through Via3DState. */
+#include "via_3d.c"
+
+#define BENCH_QUADS	10000000
+#define BENCH_DMASIZE	VIA_DMASIZE
+
+static unsigned long benchFlushes;
+static unsigned long long benchDwords;
+
+/*
+ * The only X server function via_3d.c uses.
+ */
+void
+ErrorF(const char *f, ...)
+{
+    va_list args;
+
+    va_start(args, f);
+    vfprintf(stderr, f, args);
+    va_end(args);
+}
+
+/*
+ * Like viaFlushPCI, but the commands go nowhere.
+ */
+static void
+benchFlush(ViaCommandBuffer *cb)
+{
+    benchFlushes++;
+    benchDwords += cb->pos;
+    cb->pos = 0;
+    cb->mode = 0;
+    cb->has3dState = FALSE;
+}
+
+static double
+benchNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void
+benchRun(const char *name, Via3DState *v3d, ViaCommandBuffer *cb,
+         int numTex, const float *transform, unsigned long quads)
+{
+    unsigned long i;
+    double start, secs;
+    int tex;
+
+    v3d->setDestination(v3d, 0, 1024 * 4, PICT_a8r8g8b8);
+    v3d->setDrawing(v3d, 0x0c, 0xFFFFFFFF, 0x000000FF, 0xFF);
+    v3d->setFlags(v3d, numTex, TRUE, TRUE, FALSE);
+    for (tex = 0; tex < numTex; tex++) {
+        v3d->setTexture(v3d, tex, 0, 256 * 4, TRUE, 256, 256,
+                        PICT_a8r8g8b8, via_repeat, via_repeat,
+                        tex ? via_mask : via_src, FALSE);
+        v3d->setTexTransform(v3d, tex, transform);
+    }
+    v3d->emitState(v3d, cb, TRUE);
+
+    benchFlushes = 0;
+    benchDwords = 0;
+    start = benchNow();
+    for (i = 0; i < quads; i++)
+        v3d->emitQuad(v3d, cb, i & 1023, (i >> 10) & 1023,
+                      i & 255, i & 255, 0, 0, 16, 16);
+    v3d->flushQuads(v3d, cb);
+    secs = benchNow() - start;
+
+    printf("%-20s %12.0f quads/s, %5.1f dwords/quad, %lu flushes\n",
+           name, quads / secs, (double) benchDwords / quads, benchFlushes);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const float rotate[6] = { 0.f, -1.f, 256.f, 1.f, 0.f, 0.f };
+    unsigned long quads = BENCH_QUADS;
+    ViaCommandBuffer cb;
+    Via3DState v3d;
+
+    if (argc > 1)
+        quads = strtoul(argv[1], NULL, 0);
+    if (!quads)
+        quads = BENCH_QUADS;
+
+    memset(&cb, 0, sizeof(cb));
+    cb.bufSize = BENCH_DMASIZE >> 2;
+    cb.buf = calloc(cb.bufSize, sizeof(CARD32));
+    if (!cb.buf)
+        return 1;
+    cb.flushFunc = benchFlush;
+
+    memset(&v3d, 0, sizeof(v3d));
+    viaInit3DState(&v3d);
+
+    benchRun("solid", &v3d, &cb, 0, NULL, quads);
+    benchRun("one texture", &v3d, &cb, 1, NULL, quads);
+    benchRun("two textures", &v3d, &cb, 2, NULL, quads);
+    benchRun("transformed texture", &v3d, &cb, 1, rotate, quads);
+
+    free(cb.buf);
+    return 0;
+}
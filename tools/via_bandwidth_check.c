@@ -0,0 +1,242 @@
+/*
+ * Copyright 2016 The OpenChrome Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Check of the memory bandwidth model.
+ *
+ * Runs viaBandwidthCrtcDemand, viaBandwidthIsTight and
+ * viaBandwidthOverlayCheck of via_bandwidth.c against a table of chipset,
+ * memory clock and mode cases with their recorded results, so that changes
+ * to the model show up as changed decisions. No hardware or X server is
+ * needed. Run by "make check".
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/* The static functions are used through the exported ones. */
+#include "via_bandwidth.c"
+
+/*
+ * The X server functions and data via_bandwidth.c uses.
+ */
+int xf86CrtcConfigPrivateIndex;
+
+static unsigned checkWarnings;
+
+void
+ErrorF(const char *f, ...)
+{
+    va_list args;
+
+    va_start(args, f);
+    vfprintf(stderr, f, args);
+    va_end(args);
+}
+
+void
+xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+    va_list args;
+
+    if (type == X_WARNING)
+        checkWarnings++;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+double
+xf86ModeVRefresh(const DisplayModeRec *mode)
+{
+    if (mode->HTotal <= 0 || mode->VTotal <= 0)
+        return 0.;
+    return mode->Clock * 1000. / mode->HTotal / mode->VTotal;
+}
+
+/*
+ * Recorded cases. The modes are width, height and refresh of the enabled
+ * CRTCs, the overlay is on the CRTC given.
+ */
+static const struct {
+    const char *name;
+    int chipset;
+    int memClk;
+    int bpp;
+    int numCrtc;
+    int modes[2][3];
+    int crtc;
+    int numOther;
+    Bool hqv;
+    unsigned srcW, srcH, dstW, dstH;
+    float demand;                       /* viaBandwidthCrtcDemand */
+    Bool tight;                         /* viaBandwidthIsTight */
+    int check;                          /* viaBandwidthOverlayCheck */
+} checkCases[] = {
+    {"CLE266 DDR266 XGA", VIA_CLE266, VIA_MEM_DDR266, 16,
+     1, {{1024, 768, 60}}, 0, 0, TRUE, 720, 576, 1024, 768,
+     138.782, FALSE, 1},
+    {"CLE266 DDR200 XGA", VIA_CLE266, VIA_MEM_DDR200, 16,
+     1, {{1024, 768, 60}}, 0, 0, TRUE, 720, 576, 1024, 768,
+     138.782, FALSE, 1},
+    {"CLE266 DDR200 SVGA", VIA_CLE266, VIA_MEM_DDR200, 16,
+     1, {{800, 600, 60}}, 0, 0, TRUE, 720, 576, 800, 600,
+     84.706, FALSE, 1},
+    {"CLE266 SDR133, no overlay", VIA_CLE266, VIA_MEM_SDR133, 16,
+     1, {{640, 480, 60}}, 0, 0, TRUE, 320, 240, 320, 240,
+     54.212, TRUE, 0},
+    {"KM400 DDR266 SXGA", VIA_KM400, VIA_MEM_DDR266, 32,
+     1, {{1280, 1024, 60}}, 0, 0, TRUE, 720, 576, 1280, 1024,
+     462.607, FALSE, 1},
+    {"KM400 DDR200 SAMM UXGA", VIA_KM400, VIA_MEM_DDR200, 32,
+     2, {{1600, 1200, 60}, {1024, 768, 60}}, 0, 0, TRUE, 720, 576, 720, 576,
+     955.211, TRUE, 0},
+    {"KM400 DDR200 SAMM XGA", VIA_KM400, VIA_MEM_DDR200, 16,
+     2, {{1024, 768, 60}, {1024, 768, 60}}, 0, 0, TRUE, 720, 576, 720, 576,
+     277.564, FALSE, 1},
+    {"KM400 DDR200 HD downscaled", VIA_KM400, VIA_MEM_DDR200, 32,
+     1, {{1280, 1024, 60}}, 0, 0, TRUE, 1920, 1080, 640, 360,
+     462.607, TRUE, 2},
+    {"KM400 DDR200 HD thumbnail", VIA_KM400, VIA_MEM_DDR200, 32,
+     1, {{1280, 1024, 75}}, 0, 0, TRUE, 1920, 1080, 320, 180,
+     578.259, TRUE, 4},
+    {"KM400 DDR200 HD thumbnail, no HQV", VIA_KM400, VIA_MEM_DDR200, 32,
+     1, {{1280, 1024, 75}}, 0, 0, FALSE, 1920, 1080, 320, 180,
+     578.259, TRUE, 4},
+    {"PM800 SDR133 XGA", VIA_PM800, VIA_MEM_SDR133, 32,
+     1, {{1024, 768, 60}}, 0, 0, TRUE, 720, 576, 1024, 768,
+     277.564, TRUE, 1},
+    {"P4M900 DDR400 HD downscaled, no HQV", VIA_P4M900, VIA_MEM_DDR400, 32,
+     1, {{1280, 1024, 75}}, 0, 0, FALSE, 1920, 1080, 640, 360,
+     578.259, FALSE, 1},
+    {"CX700 DDR333 WUXGA, two overlays", VIA_CX700, VIA_MEM_DDR333, 32,
+     1, {{1920, 1200, 60}}, 0, 1, TRUE, 1920, 1080, 1920, 1200,
+     813.176, FALSE, 1},
+    {"VX900 DDR800 dual HD, two overlays", VIA_VX900, VIA_MEM_DDR800, 32,
+     2, {{1920, 1080, 60}, {1920, 1080, 60}}, 1, 1, TRUE,
+     1920, 1080, 1920, 1080,
+     1463.718, FALSE, 1},
+};
+
+#define CHECK_CASES (sizeof(checkCases) / sizeof(checkCases[0]))
+
+static ScrnInfoRec checkScrn;
+static VIARec checkVia;
+static DevUnion checkPrivates[1];
+static xf86CrtcConfigRec checkConfig;
+static xf86CrtcRec checkCrtc[2];
+static xf86CrtcPtr checkCrtcs[2];
+
+static void
+checkSetup(int chipset, int memClk, int bpp, int numCrtc,
+           const int (*modes)[3])
+{
+    int i;
+
+    memset(&checkScrn, 0, sizeof(checkScrn));
+    memset(&checkVia, 0, sizeof(checkVia));
+    memset(&checkConfig, 0, sizeof(checkConfig));
+    memset(checkCrtc, 0, sizeof(checkCrtc));
+
+    checkVia.Chipset = chipset;
+    checkVia.MemClk = memClk;
+    checkScrn.driverPrivate = &checkVia;
+    checkScrn.bitsPerPixel = bpp;
+    checkPrivates[0].ptr = &checkConfig;
+    checkScrn.privates = checkPrivates;
+    checkConfig.num_crtc = numCrtc;
+    checkConfig.crtc = checkCrtcs;
+
+    for (i = 0; i < numCrtc; i++) {
+        DisplayModePtr mode = &checkCrtc[i].mode;
+
+        mode->name = (char *) "check";
+        mode->HDisplay = modes[i][0];
+        mode->VDisplay = modes[i][1];
+        mode->VRefresh = modes[i][2];
+        checkCrtc[i].desiredMode = *mode;
+        checkCrtc[i].scrn = &checkScrn;
+        checkCrtc[i].enabled = TRUE;
+        checkCrtcs[i] = &checkCrtc[i];
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int uxga[2][3] = {{1600, 1200, 60}, {1024, 768, 60}};
+    unsigned i, failed = 0;
+
+    for (i = 0; i < CHECK_CASES; i++) {
+        xf86CrtcPtr crtc = &checkCrtc[checkCases[i].crtc];
+        float demand;
+        Bool tight;
+        int check;
+
+        checkSetup(checkCases[i].chipset, checkCases[i].memClk,
+                   checkCases[i].bpp, checkCases[i].numCrtc,
+                   checkCases[i].modes);
+
+        demand = viaBandwidthCrtcDemand(&checkScrn, crtc, &crtc->mode);
+        tight = viaBandwidthIsTight(&checkScrn, crtc, &crtc->mode);
+        check = viaBandwidthOverlayCheck(crtc, checkCases[i].numOther,
+                                         checkCases[i].hqv,
+                                         checkCases[i].srcW,
+                                         checkCases[i].srcH,
+                                         checkCases[i].dstW,
+                                         checkCases[i].dstH);
+
+        if (fabs(demand - checkCases[i].demand) >
+            checkCases[i].demand * 1e-4 || tight != checkCases[i].tight ||
+            check != checkCases[i].check) {
+            printf("FAIL %s: demand %.3f, tight %d, check %d; "
+                   "recorded %.3f, %d, %d\n", checkCases[i].name,
+                   demand, tight, check, checkCases[i].demand,
+                   checkCases[i].tight, checkCases[i].check);
+            failed++;
+        } else {
+            printf("ok   %s\n", checkCases[i].name);
+        }
+    }
+
+    /* A mode over the available bandwidth is only warned about once. */
+    checkSetup(VIA_KM400, VIA_MEM_DDR200, 32, 2, uxga);
+    checkWarnings = 0;
+    viaBandwidthCheckMode(&checkScrn, &checkCrtc[0], &checkCrtc[0].mode);
+    viaBandwidthCheckMode(&checkScrn, &checkCrtc[1], &checkCrtc[1].mode);
+    if (checkWarnings != 1) {
+        printf("FAIL KM400 DDR200 SAMM UXGA: %u warnings\n", checkWarnings);
+        failed++;
+    } else {
+        printf("ok   KM400 DDR200 SAMM UXGA warns once\n");
+    }
+
+    return failed ? 1 : 0;
+}